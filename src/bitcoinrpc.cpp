@@ -244,6 +244,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getconnectioncount",     &getconnectioncount,     true,   false },
     { "getnodes",               &getnodes,               true,   false },
     { "getpeerinfo",            &getpeerinfo,            true,   false },
+    { "getnetworkinfo",         &getnetworkinfo,         true,   false },
     { "getdifficulty",          &getdifficulty,          true,   false },
     { "getinfo",                &getinfo,                true,   false },
     { "getsubsidy",             &getsubsidy,             true,   false },
@@ -275,6 +276,7 @@ static const CRPCCommand vRPCCommands[] =
     { "addmultisigaddress",     &addmultisigaddress,     false,  false },
     { "addredeemscript",        &addredeemscript,        false,  false },
     { "getrawmempool",          &getrawmempool,          true,   false },
+    { "getmempoolinfo",         &getmempoolinfo,         true,   false },
     { "getblock",               &getblock,               false,  false },
     { "getblockbynumber",       &getblockbynumber,       false,  false },
     { "getblockhash",           &getblockhash,           false,  false },
@@ -302,6 +304,7 @@ static const CRPCCommand vRPCCommands[] =
     { "signrawtransaction",     &signrawtransaction,     false,  false },
     { "sendrawtransaction",     &sendrawtransaction,     false,  false },
     { "getcheckpoint",          &getcheckpoint,          true,   false },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true,   false },
     { "reservebalance",         &reservebalance,         false,  true},
     { "combinethreshold",       &combinethreshold,         false,  true},
     { "splitthreshold",         &splitthreshold,         false,  true},
@@ -340,6 +343,8 @@ static const CRPCCommand vRPCCommands[] =
     { "smsginbox",              &smsginbox,              false,  false},
     { "smsgoutbox",             &smsgoutbox,             false,  false},
     { "smsgbuckets",            &smsgbuckets,            false,  false},
+    { "smsgbenchpow",           &smsgbenchpow,           false,  true },
+    { "smsgscaninfo",           &smsgscaninfo,           true,   false},
     { "vote",                   &vote,                   false,  false},
 };
 
@@ -1318,6 +1323,8 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "keypoolrefill"          && n > 0) ConvertTo<int64_t>(params[0]);
     
     if (strMethod == "sendtostealthaddress"   && n > 1) ConvertTo<double>(params[1]);
+    if (strMethod == "smsgbenchpow"           && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "smsgbenchpow"           && n > 1) ConvertTo<int64_t>(params[1]);
 
     return params;
 }
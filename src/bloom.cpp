@@ -0,0 +1,120 @@
+// Copyright (c) 2012-2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <math.h>
+#include <algorithm>
+
+#include "bloom.h"
+#include "util.h"
+
+static inline uint32_t ROTL32(uint32_t x, int8_t r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+// MurmurHash3 (x86, 32-bit) of a 32 byte hash
+static uint32_t MurmurHash3(uint32_t nHashSeed, const uint256& hash)
+{
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    const unsigned char* pch = (const unsigned char*)&hash;
+
+    uint32_t h1 = nHashSeed;
+    for (unsigned int i = 0; i < 32; i += 4)
+    {
+        uint32_t k1 = pch[i] | (pch[i + 1] << 8) | (pch[i + 2] << 16) | ((uint32_t)pch[i + 3] << 24);
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+
+        h1 ^= k1;
+        h1 = ROTL32(h1, 13);
+        h1 = h1 * 5 + 0xe6546b64;
+    }
+
+    h1 ^= 32;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+    return h1;
+}
+
+static inline uint32_t RollingBloomHash(unsigned int nHashNum, uint32_t nTweak, const uint256& hash)
+{
+    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, hash);
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    double logFpRate = log(fpRate);
+    // The optimal number of hash functions is log(fpRate) / log(0.5)
+    nHashFuncs = std::max(1, std::min((int)round(logFpRate / log(0.5)), 50));
+    // Keep three generations of nElements/2 entries
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    // The number of bits needed for nMaxElements at fpRate with nHashFuncs:
+    // fpRate = (1 - exp(-nHashFuncs * nMaxElements / nFilterBits))^nHashFuncs
+    uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    // Each group of 64 cells is stored as two words holding the two bits of
+    // the generation number
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        uint64_t nGenerationMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        // Wipe the cells last set by the generation number we're reusing
+        for (unsigned int p = 0; p < data.size(); p += 2)
+        {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        uint32_t h = RollingBloomHash(n, nTweak, hash);
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % data.size();
+        // The lowest bit of pos is ignored: the word pair holds the two bits
+        // of the generation number that set this cell
+        data[pos & ~1] = (data[pos & ~1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        uint32_t h = RollingBloomHash(n, nTweak, hash);
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % data.size();
+        // A cell is set if it belongs to any live generation
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = (unsigned int)GetRand(0x100000000ULL);
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
@@ -0,0 +1,43 @@
+// Copyright (c) 2012-2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include <vector>
+
+#include "uint256.h"
+
+/** Probabilistic set of the most recently inserted hashes.
+ *
+ * Remembers at least the last nElements/2 inserted hashes and at most the
+ * last 1.5 * nElements, with a false positive rate of fpRate, in constant
+ * memory. Insertions happen in generations of nElements/2 entries; each
+ * filter cell stores the generation that last set it, and starting a new
+ * generation wipes the oldest of the three kept.
+ *
+ * The hash functions are salted with a random tweak per filter, so peers
+ * can't grind hashes that collide in everyone's filter.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double fpRate);
+
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+    void reset();
+
+    // Approximate memory used by the filter, in bytes
+    size_t GetMemoryUsage() const { return data.size() * sizeof(uint64_t); }
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    int nHashFuncs;
+};
+
+#endif // BITCOIN_BLOOM_H
@@ -12,6 +12,7 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
+#include "kernel.h"
 #include "smessage.h"
 
 #include <boost/filesystem.hpp>
@@ -40,6 +41,9 @@ unsigned int nNodeLifespan;
 unsigned int nDerivationMethodIndex;
 unsigned int nMinerSleep;
 bool fUseFastIndex;
+bool fCoinsDB;
+int64_t nBlockServeCacheSize;
+int64_t nMaxMempoolSize;
 enum Checkpoints::CPMode CheckpointsMode;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -94,6 +98,11 @@ void Shutdown(void* parg)
 //        CTxDB().Close();
         bitdb.Flush(false);
         StopNode();
+        if (GetBoolArg("-persistmempool", true))
+            DumpMempool();
+        FlushCoinsCache();
+        FlushTxDBCache();
+        WriteBlockIndexSnapshot();
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -261,8 +270,14 @@ std::string HelpMessage()
         "  -pid=<file>            " + _("Specify pid file (default: pinkcoind.pid)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n" +
-        "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 100)") + "\n" +
+        "  -dbcache=<n>           " + _("Set database cache size in megabytes, half of it for batching writes during the initial download (default: 100)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes, evicting the lowest fee rates first (default: 300)") + "\n" +
+        "  -persistmempool        " + _("Save the memory pool on shutdown and reload it on startup (default: 1)") + "\n" +
+        "  -coinsdb               " + _("Keep unspent outputs in the database to validate inputs without reading block files (default: 0)") + "\n" +
+        "  -coinsflush=<n>        " + _("Write cached unspent outputs to the database every <n> blocks (default: 100)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -sigcachesize=<n>      " + _("Size of the cache of verified signatures in megabytes (default: 32)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -281,12 +296,15 @@ std::string HelpMessage()
         "  -dnsseed               " + _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)") + "\n" +
         "  -forcednsseed          " + _("Always query for peer addresses via DNS lookup (default: 0)") + "\n" +
         "  -staking               " + _("Stake your coins to support network and gain reward (default: 1)") + "\n" +
+        "  -stakethreads=<n>      " + _("Set the number of threads searching for stake kernels (0 = one per core, default: 0)") + "\n" +
         "  -synctime              " + _("Sync time with other nodes. Disable if time on your system is precise e.g. syncing with NTP (default: 1)") + "\n" +
         "  -cppolicy              " + _("Sync checkpoints policy (default: strict)") + "\n" +
         "  -banscore=<n>          " + _("Threshold for disconnecting misbehaving peers (default: 100)") + "\n" +
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -blockservecache=<n>   " + _("Keep <n> megabytes of recently requested blocks ready to send to peers (default: 16)") + "\n" +
+        "  -msghandlerthreads=<n> " + _("Number of threads processing peer messages (1 to 8, default: 1)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -344,7 +362,9 @@ std::string HelpMessage()
         "\n" + _("Secure messaging options:") + "\n" +
         "  -nosmsg                                  " + _("Disable secure messaging.") + "\n" +
         "  -debugsmsg                               " + _("Log extra debug messages.") + "\n" +
-        "  -smsgscanchain                           " + _("Scan the block chain for public key addresses on startup.") + "\n";
+        "  -smsgscanchain                           " + _("Scan the block chain for public key addresses on startup.") + "\n" +
+        "  -smsgpowthreads=<n>                      " + _("Set the number of threads for secure message proof of work (0 = all cores, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -smsgscanthreads=<n>                     " + _("Set the number of threads trying received secure messages against the receive addresses and scanning the block chain for public keys (0 = all cores, <0 = leave that many cores free, default: 0)") + "\n";
 
     return strUsage;
 }
@@ -419,8 +439,24 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fCoinsDB = GetBoolArg("-coinsdb", false);
+    nBlockServeCacheSize = GetArg("-blockservecache", 16) * 1000000;
+    nMaxMempoolSize = max(GetArg("-maxmempool", 300), (int64_t)5) * 1000000;
     nMinerSleep = GetArg("-minersleep", 800);
 
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    nStakeSearchThreads = GetArg("-stakethreads", 0);
+    if (nStakeSearchThreads <= 0)
+        nStakeSearchThreads = boost::thread::hardware_concurrency();
+
     CheckpointsMode = Checkpoints::STRICT;
     std::string strCpMode = GetArg("-cppolicy", "strict");
 
@@ -485,6 +521,16 @@ bool AppInit2(boost::thread_group& threadGroup)
         fDebugSmsg = GetBoolArg("-debugsmsg");
     }
     fNoSmsg = GetBoolArg("-nosmsg");
+    nSmsgPowThreads = GetArg("-smsgpowthreads", 0);
+    if (nSmsgPowThreads <= 0)
+        nSmsgPowThreads += boost::thread::hardware_concurrency();
+    if (nSmsgPowThreads < 1)
+        nSmsgPowThreads = 1;
+    nSmsgScanThreads = GetArg("-smsgscanthreads", 0);
+    if (nSmsgScanThreads <= 0)
+        nSmsgScanThreads += boost::thread::hardware_concurrency();
+    if (nSmsgScanThreads < 1)
+        nSmsgScanThreads = 1;
     
     bitdb.SetDetach(GetBoolArg("-detachdb", false));
 
@@ -597,6 +643,14 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fDaemon)
         fprintf(stdout, "Pinkcoin server starting\n");
 
+    InitSignatureCache(GetArg("-sigcachesize", 32));
+
+    if (nScriptCheckThreads) {
+        printf("Using %d threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -1057,6 +1111,11 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (!NewThread(StartNode, NULL))
         InitError(_("Error: could not start node"));
 
+    NewThread(ThreadFlushTxDB, NULL);
+
+    if (GetBoolArg("-persistmempool", true))
+        NewThread(ThreadMempoolPersist, NULL);
+
     if (fServer)
         NewThread(ThreadRPCServer, NULL);
 
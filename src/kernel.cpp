@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 #include "kernel.h"
 #include "txdb.h"
@@ -11,6 +13,8 @@
 
 using namespace std;
 
+int nStakeSearchThreads = 0;
+
 // Get time weight
 int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd)
 {
@@ -206,7 +210,8 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+// pnHeightEnd, if given, receives the height of the last block the lookup walked through
+static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake, int* pnHeightEnd = NULL)
 {
     nStakeModifier = 0;
     if (!mapBlockIndex.count(hashBlockFrom))
@@ -237,6 +242,22 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+    if (pnHeightEnd)
+        *pnHeightEnd = pindex->nHeight;
+    return true;
+}
+
+// FlashPOS 2.0: during flash staking only coins of at least minFlash2 PINK may stake
+static bool IsStakeValueAllowed(int64_t nValueIn, unsigned int nTimeTx)
+{
+    const time_t btFlash2 = fTestNet ? 1534208400 : FPOS2_START_DATE; // September 30th, 2018 @ 12:00am UTC MainNet, August 14th, 2018 @ 1:00am UTC TestNet
+    const unsigned int minFlash2 = 100000; // Minimum coin requirement to stake during FPOS
+
+    if (IsFlashStake(nTimeTx))
+    {
+        if (nTimeTx > btFlash2 && nValueIn < minFlash2)
+            return false;
+    }
     return true;
 }
 
@@ -271,85 +292,207 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
         return error("CheckStakeKernelHash() : min age violation");
 
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
+    if (!IsStakeValueAllowed(txPrev.vout[prevout.n].nValue / COIN, nTimeTx))
+        return false;
 
     uint256 hashBlockFrom = blockFrom.GetHash();
-    int64_t bnCoinDayWeight_Calc;
-
-    //  Add accumulated weight to .9 so coins are eligible to stake sooner. Boost coin weight 100x
-    int nDayTime = 24 * 60 * 60; // Length of a Day
-
-    nValueIn = nValueIn / COIN; // Don't let amounts less than 1 PINK stake on their own.
-
 
-
-    // FlashPOS 2.0 Begin
-    const time_t btFlash2 = fTestNet ? 1534208400 : FPOS2_START_DATE; // September 30th, 2018 @ 12:00am UTC MainNet, August 14th, 2018 @ 1:00am UTC TestNet
-    const unsigned int minFlash2 = 100000; // Minimum coin requirement to stake during FPOS
-
-    if (IsFlashStake(nTimeTx))
-    {
-        if (nTimeTx > btFlash2 && nValueIn < minFlash2)
-            return false;
-    }
-
-    // FlashPOS 2.0 End
-
-
-    // int64_t nDivideBase = nDayTime;
-    bnCoinDayWeight_Calc = nValueIn * GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx) / nDayTime;
-
-
-    CBigNum bnCoinDayWeight = CBigNum(bnCoinDayWeight_Calc);
-
-
-    targetProofOfStake = (bnCoinDayWeight * bnTargetPerCoinDay).getuint256();
-
-    // Calculate hash
-    CDataStream ss(SER_GETHASH, 0);
-    uint64_t nStakeModifier = 0;
+    CStakeKernelInput kernel;
     int nStakeModifierHeight = 0;
     int64_t nStakeModifierTime = 0;
-    
-    if (!GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake))
+
+    if (!GetKernelStakeModifier(hashBlockFrom, kernel.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake))
         return false;
-    ss << nStakeModifier;
-    
-    ss << nTimeBlockFrom << nTxPrevOffset << txPrev.nTime << prevout.n << nTimeTx;
-    hashProofOfStake = Hash(ss.begin(), ss.end());
+    kernel.prevout = prevout;
+    kernel.nTimeBlockFrom = nTimeBlockFrom;
+    kernel.nTxPrevOffset = nTxPrevOffset;
+    kernel.nTimeTxPrev = txPrev.nTime;
+    kernel.nValueIn = txPrev.vout[prevout.n].nValue;
+
+    bool fPass = CheckStakeKernelHash(nBits, kernel, nTimeTx, hashProofOfStake, targetProofOfStake);
     if (fPrintProofOfStake)
     {
         printf("CheckStakeKernelHash() : using modifier 0x%016"  PRIx64" at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
-            nStakeModifier, nStakeModifierHeight,
+            kernel.nStakeModifier, nStakeModifierHeight,
             DateTimeStrFormat(nStakeModifierTime).c_str(),
             mapBlockIndex[hashBlockFrom]->nHeight,
             DateTimeStrFormat(blockFrom.GetBlockTime()).c_str());
         printf("CheckStakeKernelHash() : check modifier=0x%016"  PRIx64" nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
-            nStakeModifier,
+            kernel.nStakeModifier,
             nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout.n, nTimeTx,
             hashProofOfStake.ToString().c_str());
     }
-    
+
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay)
+    if (!fPass)
         return false;
     if (fDebug && !fPrintProofOfStake)
     {
         printf("CheckStakeKernelHash() : using modifier 0x%016"  PRIx64" at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
-            nStakeModifier, nStakeModifierHeight, 
+            kernel.nStakeModifier, nStakeModifierHeight,
             DateTimeStrFormat(nStakeModifierTime).c_str(),
             mapBlockIndex[hashBlockFrom]->nHeight,
             DateTimeStrFormat(blockFrom.GetBlockTime()).c_str());
         printf("CheckStakeKernelHash() : pass modifier=0x%016"  PRIx64" nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
-            nStakeModifier,
+            kernel.nStakeModifier,
             nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout.n, nTimeTx,
             hashProofOfStake.ToString().c_str());
     }
     return true;
 }
 
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeKernelInput& kernel, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    if (nTimeTx < kernel.nTimeTxPrev || kernel.nTimeBlockFrom + nStakeMinAge > nTimeTx)
+        return false;
+
+    //  Add accumulated weight to .9 so coins are eligible to stake sooner. Boost coin weight 100x
+    int nDayTime = 24 * 60 * 60; // Length of a Day
+
+    int64_t nValueIn = kernel.nValueIn / COIN; // Don't let amounts less than 1 PINK stake on their own.
+
+    if (!IsStakeValueAllowed(nValueIn, nTimeTx))
+        return false;
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    int64_t bnCoinDayWeight_Calc = nValueIn * GetWeight((int64_t)kernel.nTimeTxPrev, (int64_t)nTimeTx) / nDayTime;
+    CBigNum bnCoinDayWeight = CBigNum(bnCoinDayWeight_Calc);
+
+    CBigNum bnTarget = bnCoinDayWeight * bnTargetPerCoinDay;
+    targetProofOfStake = bnTarget.getuint256();
+
+    // Calculate hash
+    CDataStream ss(SER_GETHASH, 0);
+    ss << kernel.nStakeModifier;
+    ss << kernel.nTimeBlockFrom << kernel.nTxPrevOffset << kernel.nTimeTxPrev << kernel.prevout.n << nTimeTx;
+    hashProofOfStake = Hash(ss.begin(), ss.end());
+
+    // Now check if proof-of-stake hash meets target protocol
+    return CBigNum(hashProofOfStake) <= bnTarget;
+}
+
+bool GetStakeKernelInput(const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, CStakeKernelInput& kernelRet)
+{
+    int nStakeModifierHeight = 0;
+    int64_t nStakeModifierTime = 0;
+    if (!GetKernelStakeModifier(blockFrom.GetHash(), kernelRet.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false, &kernelRet.nHeightModifierEnd))
+        return false;
+
+    kernelRet.prevout = prevout;
+    kernelRet.nTimeBlockFrom = blockFrom.GetBlockTime();
+    kernelRet.nTxPrevOffset = nTxPrevOffset;
+    kernelRet.nTimeTxPrev = txPrev.nTime;
+    kernelRet.nValueIn = txPrev.vout[prevout.n].nValue;
+    return true;
+}
+
+// Shared state of one kernel search. Candidates are handed out to the
+// search threads in small batches; the first thread to find a kernel
+// records it and makes everybody else stop.
+class CStakeKernelSearch
+{
+private:
+    boost::mutex mutex;
+    const std::vector<CStakeKernelInput>& vKernels;
+    unsigned int nBits;
+    unsigned int nTimeTx;
+    unsigned int nSearchInterval;
+    const CBlockIndex* pindexPrev;
+    unsigned int nNext;
+    bool fFound;
+
+    bool IsDone()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fFound || fShutdown;
+    }
+
+    // The tip is only looked at while cs_main is free; if it's busy, most
+    // likely connecting a block, the next batch will notice
+    bool TipChanged()
+    {
+        TRY_LOCK(cs_main, lockMain);
+        return lockMain && pindexPrev != pindexBest;
+    }
+
+    bool Claim(unsigned int& nBegin, unsigned int& nEnd)
+    {
+        if (TipChanged())
+            return false;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fFound || fShutdown || nNext >= vKernels.size())
+            return false;
+        nBegin = nNext;
+        nEnd = nNext = std::min(nNext + nBatchSize, (unsigned int)vKernels.size());
+        return true;
+    }
+
+public:
+    static const unsigned int nBatchSize = 8;
+
+    unsigned int nIndexFound;
+    unsigned int nTimeTxFound;
+
+    CStakeKernelSearch(const CBlockIndex* pindexPrevIn, unsigned int nBitsIn, const std::vector<CStakeKernelInput>& vKernelsIn, unsigned int nTimeTxIn, unsigned int nSearchIntervalIn) :
+        vKernels(vKernelsIn), nBits(nBitsIn), nTimeTx(nTimeTxIn), nSearchInterval(nSearchIntervalIn),
+        pindexPrev(pindexPrevIn), nNext(0), fFound(false), nIndexFound(0), nTimeTxFound(0) {}
+
+    void Loop()
+    {
+        unsigned int nBegin = 0, nEnd = 0;
+        while (Claim(nBegin, nEnd))
+        {
+            for (unsigned int i = nBegin; i < nEnd && !IsDone(); i++)
+            {
+                // Search backward in time from the given timestamp
+                for (unsigned int n = 0; n < nSearchInterval; n++)
+                {
+                    uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+                    if (CheckStakeKernelHash(nBits, vKernels[i], nTimeTx - n, hashProofOfStake, targetProofOfStake))
+                    {
+                        boost::unique_lock<boost::mutex> lock(mutex);
+                        if (!fFound)
+                        {
+                            fFound = true;
+                            nIndexFound = i;
+                            nTimeTxFound = nTimeTx - n;
+                        }
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    bool Found()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fFound;
+    }
+};
+
+bool FindStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<CStakeKernelInput>& vKernels, unsigned int nTimeTx, unsigned int nSearchInterval,
+                     unsigned int& nIndexRet, unsigned int& nTimeTxRet)
+{
+    CStakeKernelSearch search(pindexPrev, nBits, vKernels, nTimeTx, nSearchInterval);
+
+    // No point in starting threads that would not get a batch of their own
+    int nThreads = std::min(nStakeSearchThreads, (int)((vKernels.size() + CStakeKernelSearch::nBatchSize - 1) / CStakeKernelSearch::nBatchSize));
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads - 1; i++)
+        threadGroup.create_thread(boost::bind(&CStakeKernelSearch::Loop, &search));
+    search.Loop();
+    threadGroup.join_all();
+
+    if (!search.Found())
+        return false;
+    nIndexRet = search.nIndexFound;
+    nTimeTxRet = search.nTimeTxFound;
+    return true;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
@@ -16,10 +16,56 @@ static const int MODIFIER_INTERVAL_RATIO = 5;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Number of threads used to search for a stake kernel (0 = search on the calling thread only)
+extern int nStakeSearchThreads;
+
+/** Everything the kernel hash of a staking candidate depends on, apart from
+ *  the coinstake timestamp. Filled in under cs_main, so that the kernel
+ *  search itself needs neither locks nor disk access.
+ */
+class CStakeKernelInput
+{
+public:
+    COutPoint prevout;
+    uint64_t nStakeModifier;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    int64_t nValueIn;
+
+    // Height of the last block the stake modifier lookup depended on; the
+    // inputs stay valid for as long as that block remains in the main chain
+    int nHeightModifierEnd;
+
+    CStakeKernelInput()
+    {
+        nStakeModifier = 0;
+        nTimeBlockFrom = 0;
+        nTxPrevOffset = 0;
+        nTimeTxPrev = 0;
+        nValueIn = 0;
+        nHeightModifierEnd = 0;
+    }
+};
+
+// Gather the kernel inputs of a coin; requires cs_main for the stake modifier lookup
+bool GetStakeKernelInput(const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, CStakeKernelInput& kernelRet);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
+// Check whether stake kernel meets hash target, using precomputed kernel inputs.
+// Does not touch the block index, so it is safe to call without cs_main.
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeKernelInput& kernel, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake);
+
+// Search the candidates for a kernel at nTimeTx or up to nSearchInterval-1 seconds before it,
+// spreading the candidates across nStakeSearchThreads threads. Stops as soon as one is found
+// or the best block is no longer pindexPrev.
+// Sets nIndexRet to the winning candidate and nTimeTxRet to its timestamp on success return.
+bool FindStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<CStakeKernelInput>& vKernels, unsigned int nTimeTx, unsigned int nSearchInterval,
+                     unsigned int& nIndexRet, unsigned int& nTimeTxRet);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
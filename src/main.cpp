@@ -5,6 +5,7 @@
 
 #include "alert.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "txdb.h"
 #include "net.h"
@@ -33,6 +34,7 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
+int nScriptCheckThreads = 0;
 
 map<uint256, CBlockIndex*> mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
@@ -66,6 +68,7 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 int64_t nTimeBestReceived = 0;
 
 CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes claim to have
@@ -77,6 +80,36 @@ set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
+// Transactions recently evicted from the full memory pool, so they aren't
+// asked for again straight away
+static CRollingBloomFilter filterRecentlyEvicted(10000, 0.000001);
+
+// Headers-first sync: validated headers whose blocks we don't have yet, and
+// the best chain of them starting right above a block in mapBlockIndex
+struct CHeaderIndex
+{
+    uint256 hashPrev;
+    int nHeight;
+    unsigned int nTime;
+    uint256 nChainTrust;
+};
+static map<uint256, CHeaderIndex> mapHeaderIndex;
+static deque<uint256> vHeaderChain;
+static map<uint256, CNode*> mapBlocksInFlight;
+static int nSyncStarted = 0;
+static bool fDownloadWindowFull = false;
+
+// Compact blocks waiting for getblocktxn to be answered, guarded by cs_main
+struct CPartialBlock
+{
+    CBlock block;
+    vector<unsigned int> vMissing;
+    unsigned int nShortIds;
+    CNode* pfrom;
+    int64_t nTime;
+};
+static map<uint256, CPartialBlock> mapPartialBlocks;
+
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
 
@@ -145,15 +178,6 @@ bool static IsFromMe(CTransaction& tx)
     return false;
 }
 
-// get the wallet transaction with the given hash (if it exists)
-bool static GetTransaction(const uint256& hashTx, CWalletTx& wtx)
-{
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        if (pwallet->GetTransaction(hashTx,wtx))
-            return true;
-    return false;
-}
-
 // erases transaction with the given hash from all wallets
 void static EraseFromWallets(uint256 hash)
 {
@@ -164,6 +188,12 @@ void static EraseFromWallets(uint256 hash)
 // make sure all wallets know about the given transaction, in the given block
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate, bool fConnect)
 {
+    if (pblock)
+    {
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->UpdateStakeKernelCache(tx, pblock, fConnect);
+    }
+
     if (!fConnect)
     {
         // ppcoin: wallets need to refund inputs when disconnecting coinstake
@@ -721,6 +751,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx,
         }
     }
 
+    CTxMemPoolEntry entry;
     {
         MapPrevTx mapInputs;
         map<uint256, CTxIndex> mapUnused;
@@ -734,6 +765,12 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx,
             return false;
         }
 
+        // Spent outputs carry no value or script any more, so turn a double
+        // spend away here before anything reads them
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (!mapInputs[txin.prevout.hash].first.vSpent[txin.prevout.n].IsNull())
+                return error("CTxMemPool::accept() : %s prev tx already used", hash.ToString().substr(0,10).c_str());
+
         // Check for non-standard pay-to-script-hash in inputs
         if (!tx.AreInputsStandard(mapInputs) && !fTestNet)
             return error("CTxMemPool::accept() : nonstandard transaction input");
@@ -752,6 +789,14 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx,
                          hash.ToString().c_str(),
                          nFees, txMinFee);
 
+        // After evictions from a full pool, it takes a better fee rate than
+        // what was evicted
+        double dMinFeePerKb = GetMinFeePerKb(nMaxMempoolSize);
+        if (dMinFeePerKb > 0 && (double)nFees * 1000 / nSize < dMinFeePerKb)
+            return error("CTxMemPool::accept() : mempool min fee not met %s, %.0f < %.0f per kB",
+                         hash.ToString().c_str(),
+                         (double)nFees * 1000 / nSize, dMinFeePerKb);
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -783,6 +828,22 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx,
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
+
+        // Priority is sum(valuein * age) / txsize over the inputs already
+        // in the chain; inputs from the pool count once they're mined
+        double dPriority = 0;
+        int64_t nChainInputValue = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            if (exists(txin.prevout.hash))
+                continue;
+            const pair<CTxIndex, CTransaction>& prev = mapInputs[txin.prevout.hash];
+            int64_t nValueIn = prev.second.vout[txin.prevout.n].nValue;
+            nChainInputValue += nValueIn;
+            dPriority += (double)nValueIn * prev.first.GetDepthInMainChain();
+        }
+        unsigned int nSigOps = tx.GetLegacySigOpCount() + tx.GetP2SHSigOpCount(mapInputs);
+        entry = CTxMemPoolEntry(nFees, nSize, nSigOps, GetTime(), dPriority / nSize, nBestHeight, nChainInputValue);
     }
 
     // Store transaction in memory
@@ -793,9 +854,18 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx,
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, tx, entry);
     }
 
+    // Keep the pool within -maxmempool; if the new transaction doesn't make
+    // the cut it isn't relayed or handed to the wallets
+    vector<uint256> vEvicted;
+    TrimToSize(nMaxMempoolSize, vEvicted);
+    BOOST_FOREACH(const uint256& hashEvicted, vEvicted)
+        filterRecentlyEvicted.insert(hashEvicted);
+    if (!exists(hash))
+        return error("CTxMemPool::accept() : mempool full, fee rate too low for %s", hash.ToString().substr(0,10).c_str());
+
     ///// are we sure this is ok when loading transactions or restoring block txes
     // If updated, erase old tx from wallet
     if (ptxOld)
@@ -813,21 +883,150 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool* pfMissingInputs)
     return mempool.accept(txdb, *this, pfMissingInputs);
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+// Heap memory taken by an allocation of nAlloc bytes, assuming a malloc with
+// 16 byte granularity and 8 bytes of overhead per block
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    return nAlloc ? ((nAlloc + 23) & ~(size_t)15) : 0;
+}
+
+// Heap memory of one std::map or std::set node holding a T
+template<typename T>
+static inline size_t TreeNodeUsage()
+{
+    return MallocUsage(sizeof(T) + 4 * sizeof(void*));
+}
+
+static size_t GetMemPoolUsage(const CTransaction& tx)
+{
+    size_t nUsage = MallocUsage(tx.vin.capacity() * sizeof(CTxIn)) + MallocUsage(tx.vout.capacity() * sizeof(CTxOut));
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += MallocUsage(txin.scriptSig.capacity());
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += MallocUsage(txout.scriptPubKey.capacity());
+
+    // Its node in mapTx and mapInfo, one in mapNextTx per input and one in
+    // each of the four indexes
+    nUsage += TreeNodeUsage<pair<const uint256, CTransaction> >();
+    nUsage += TreeNodeUsage<pair<const uint256, CTxMemPoolEntry> >();
+    nUsage += tx.vin.size() * TreeNodeUsage<pair<const COutPoint, CInPoint> >();
+    nUsage += 4 * TreeNodeUsage<pair<double, uint256> >();
+    return nUsage;
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entryIn)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
+        CTxMemPoolEntry& entry = mapInfo[hash];
+        entry = entryIn;
+
+        // Sum up the package of all ancestors already in the pool
+        set<uint256> setAncestors;
+        vector<uint256> vWork;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            vWork.push_back(txin.prevout.hash);
+        while (!vWork.empty())
+        {
+            uint256 hashPrev = vWork.back();
+            vWork.pop_back();
+            map<uint256, CTransaction>::iterator mi = mapTx.find(hashPrev);
+            if (mi == mapTx.end() || !setAncestors.insert(hashPrev).second)
+                continue;
+            const CTxMemPoolEntry& prev = mapInfo[hashPrev];
+            entry.nCountWithAncestors++;
+            entry.nSizeWithAncestors += prev.nTxSize;
+            entry.nFeesWithAncestors += prev.nFee;
+            BOOST_FOREACH(const CTxIn& txin, mi->second.vin)
+                vWork.push_back(txin.prevout.hash);
+        }
+
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        entry.nUsageSize = GetMemPoolUsage(mapTx[hash]);
+        nTotalUsage += entry.nUsageSize;
+
+        setByDescendantScore.insert(make_pair(entry.GetDescendantScore(), hash));
+        setByAncestorScore.insert(make_pair(entry.GetAncestorFeePerKb(), hash));
+        setByPriority.insert(make_pair(entry.GetPriority(nPriorityHeight), hash));
+        setByTime.insert(make_pair(entry.nTime, hash));
+
+        // Its ancestors gain it as a descendant. A transaction coming back
+        // from a disconnected block can have children in the pool already
+        UpdateAncestors(hash, 1, entry.nTxSize, entry.nFee);
+        UpdateDescendants(hash, 1, entry.nTxSize, entry.nFee);
         nTransactionsUpdated++;
     }
     return true;
 }
 
+// Add the given amounts to the ancestor package of everything in the pool
+// that spends hash, directly or indirectly
+void CTxMemPool::UpdateDescendants(const uint256& hash, int64_t nCount, int64_t nSize, int64_t nFees)
+{
+    set<uint256> setDescendants;
+    vector<uint256> vWork(1, hash);
+    while (!vWork.empty())
+    {
+        uint256 hashParent = vWork.back();
+        vWork.pop_back();
+        const CTransaction& txParent = mapTx[hashParent];
+        for (unsigned int i = 0; i < txParent.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hashParent, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashChild = it->second.ptx->GetHash();
+            if (setDescendants.insert(hashChild).second)
+                vWork.push_back(hashChild);
+        }
+    }
+
+    BOOST_FOREACH(const uint256& hashChild, setDescendants)
+    {
+        CTxMemPoolEntry& entry = mapInfo[hashChild];
+        setByAncestorScore.erase(make_pair(entry.GetAncestorFeePerKb(), hashChild));
+        entry.nCountWithAncestors += nCount;
+        entry.nSizeWithAncestors += nSize;
+        entry.nFeesWithAncestors += nFees;
+        setByAncestorScore.insert(make_pair(entry.GetAncestorFeePerKb(), hashChild));
+    }
+}
+
+// Add the given amounts to the descendant package of everything in the pool
+// that hash spends, directly or indirectly
+void CTxMemPool::UpdateAncestors(const uint256& hash, int64_t nCount, int64_t nSize, int64_t nFees)
+{
+    set<uint256> setAncestors;
+    vector<uint256> vWork;
+    BOOST_FOREACH(const CTxIn& txin, mapTx[hash].vin)
+        vWork.push_back(txin.prevout.hash);
+    while (!vWork.empty())
+    {
+        uint256 hashPrev = vWork.back();
+        vWork.pop_back();
+        map<uint256, CTransaction>::iterator mi = mapTx.find(hashPrev);
+        if (mi == mapTx.end() || !setAncestors.insert(hashPrev).second)
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, mi->second.vin)
+            vWork.push_back(txin.prevout.hash);
+    }
+
+    BOOST_FOREACH(const uint256& hashParent, setAncestors)
+    {
+        CTxMemPoolEntry& entry = mapInfo[hashParent];
+        setByDescendantScore.erase(make_pair(entry.GetDescendantScore(), hashParent));
+        entry.nCountWithDescendants += nCount;
+        entry.nSizeWithDescendants += nSize;
+        entry.nFeesWithDescendants += nFees;
+        setByDescendantScore.insert(make_pair(entry.GetDescendantScore(), hashParent));
+    }
+}
+
 
-bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
+bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive, vector<uint256>* pvRemoved)
 {
     // Remove transaction from memory pool
     {
@@ -839,9 +1038,24 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                 for (unsigned int i = 0; i < tx.vout.size(); i++) {
                     std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
                     if (it != mapNextTx.end())
-                        remove(*it->second.ptx, true);
+                        remove(*it->second.ptx, true, pvRemoved);
                 }
             }
+
+            // Whatever is left spending it loses it as an ancestor, and its
+            // ancestors lose it and whatever is left spending it
+            const CTxMemPoolEntry& entry = mapInfo[hash];
+            UpdateDescendants(hash, -1, -(int64_t)entry.nTxSize, -entry.nFee);
+            UpdateAncestors(hash, -(int64_t)entry.nCountWithDescendants, -(int64_t)entry.nSizeWithDescendants, -entry.nFeesWithDescendants);
+            setByDescendantScore.erase(make_pair(entry.GetDescendantScore(), hash));
+            setByAncestorScore.erase(make_pair(entry.GetAncestorFeePerKb(), hash));
+            setByPriority.erase(make_pair(entry.GetPriority(nPriorityHeight), hash));
+            setByTime.erase(make_pair(entry.nTime, hash));
+            nTotalUsage -= entry.nUsageSize;
+            mapInfo.erase(hash);
+            if (pvRemoved)
+                pvRemoved->push_back(hash);
+
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
@@ -851,6 +1065,19 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
     return true;
 }
 
+bool CTxMemPool::removeSpends(const CTransaction &tx)
+{
+    // Remove transactions which spend outputs of tx, recursively
+    LOCK(cs);
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+        if (it != mapNextTx.end())
+            remove(*it->second.ptx, true);
+    }
+    return true;
+}
+
 bool CTxMemPool::removeConflicts(const CTransaction &tx)
 {
     // Remove transactions which depend on inputs of tx, recursively
@@ -871,9 +1098,98 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapInfo.clear();
+    setByDescendantScore.clear();
+    setByAncestorScore.clear();
+    setByPriority.clear();
+    setByTime.clear();
+    nTotalUsage = 0;
     ++nTransactionsUpdated;
 }
 
+// Evict the packages of a transaction and its descendants paying the lowest
+// fee rate until the pool fits in nSizeLimit bytes. A transaction paying
+// little is kept while a descendant pays for it. The minimum fee rate for
+// new transactions is raised above each evicted package, so the same
+// transactions can't simply be sent again.
+void CTxMemPool::TrimToSize(size_t nSizeLimit, vector<uint256>& vEvicted)
+{
+    LOCK(cs);
+    size_t nUsageBefore = nTotalUsage;
+    unsigned int nCount = vEvicted.size();
+    while (nTotalUsage > nSizeLimit && !setByDescendantScore.empty())
+    {
+        double dScore = setByDescendantScore.begin()->first;
+        uint256 hash = setByDescendantScore.begin()->second;
+        dRollingMinFeePerKb = max(dRollingMinFeePerKb, dScore + MIN_RELAY_TX_FEE);
+        nLastRollingFeeUpdate = GetTime();
+        remove(mapTx[hash], true, &vEvicted);
+    }
+    if (vEvicted.size() > nCount)
+        printf("CTxMemPool::TrimToSize() : evicted %" PRIszu " transactions, %" PRIszu " bytes, min fee rate now %.0f per kB\n",
+               vEvicted.size() - nCount, nUsageBefore - nTotalUsage, dRollingMinFeePerKb);
+}
+
+// The minimum fee rate left by evictions halves every ROLLING_FEE_HALFLIFE,
+// and faster while the pool has plenty of room again
+double CTxMemPool::GetMinFeePerKb(size_t nSizeLimit)
+{
+    LOCK(cs);
+    if (dRollingMinFeePerKb == 0)
+        return 0;
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        if (nTotalUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nTotalUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+        dRollingMinFeePerKb /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+        if (dRollingMinFeePerKb < MIN_RELAY_TX_FEE / 2)
+            dRollingMinFeePerKb = 0;
+    }
+    return dRollingMinFeePerKb;
+}
+
+// tx was mined at nMinedHeight: the outputs of it that pool transactions
+// spend are chain inputs now and start adding to their priority
+void CTxMemPool::UpdateMinedParent(const CTransaction& tx, int nMinedHeight)
+{
+    LOCK(cs);
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+        if (it == mapNextTx.end())
+            continue;
+        uint256 hashChild = it->second.ptx->GetHash();
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapInfo.find(hashChild);
+        if (mi == mapInfo.end())
+            continue;
+        CTxMemPoolEntry& entry = mi->second;
+        int64_t nValueIn = tx.vout[i].nValue;
+        setByPriority.erase(make_pair(entry.GetPriority(nPriorityHeight), hashChild));
+        entry.nChainInputValue += nValueIn;
+        entry.dPriority += (double)nValueIn * (entry.nHeight - nMinedHeight + 1) / entry.nTxSize;
+        setByPriority.insert(make_pair(entry.GetPriority(nPriorityHeight), hashChild));
+    }
+}
+
+// Priorities age at different rates, so the index is re-sorted once per
+// block rather than kept in order all the time
+void CTxMemPool::UpdatePriorities(int nHeight)
+{
+    LOCK(cs);
+    if (nHeight == nPriorityHeight)
+        return;
+    nPriorityHeight = nHeight;
+    setByPriority.clear();
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapInfo.begin(); mi != mapInfo.end(); ++mi)
+        setByPriority.insert(make_pair(mi->second.GetPriority(nHeight), mi->first));
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
@@ -1021,22 +1337,33 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+void CChain::SetTip(CBlockIndex* pindex)
+{
+    if (pindex == NULL)
+    {
+        vChain.clear();
+        return;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+CBlockIndex* CChain::FindFork(CBlockIndex* pindex) const
+{
+    while (pindex && pindex->nHeight > Height())
+        pindex = pindex->pprev;
+    while (pindex && !Contains(pindex))
+        pindex = pindex->pprev;
+    return pindex;
+}
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1461,10 +1788,12 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         // Read txindex
         CTxIndex& txindex = inputsRet[prevout.hash].first;
         bool fFound = true;
+        bool fTestPool = false;
         if ((fBlock || fMiner) && mapTestPool.count(prevout.hash))
         {
             // Get txindex from current proposed changes
             txindex = mapTestPool.find(prevout.hash)->second;
+            fTestPool = true;
         }
         else
         {
@@ -1486,9 +1815,19 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         }
         else
         {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
-                return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+            // Get prev tx outputs from the coins database if we can, from disk otherwise
+            CCoins coins;
+            if (fCoinsDB && txdb.ReadCoins(prevout.hash, coins))
+                coins.ToTransaction(prevout.hash, txPrev);
+            else
+            {
+                if (!txPrev.ReadFromDisk(txindex.pos))
+                    return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+
+                // Remember the outputs, unless txindex carries changes that aren't in the db
+                if (fCoinsDB && !fTestPool)
+                    txdb.WriteCoins(prevout.hash, CCoins(txPrev, txindex));
+            }
         }
     }
 
@@ -1554,8 +1893,16 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
     return nSigOps;
 }
 
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
+    return true;
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1575,6 +1922,12 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
                 return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %" PRIszu " %" PRIszu " prev tx %s\n%s", GetHash().ToString().substr(0,10).c_str(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString().substr(0,10).c_str(), txPrev.ToString().c_str()));
 
+            // Check for conflicts (double-spend) before the value checks: the
+            // coins database keeps spent outputs with nValue -1. This doesn't
+            // trigger the DoS code on purpose, see below.
+            if (!txindex.vSpent[prevout.n].IsNull())
+                return fMiner ? false : error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString().substr(0,10).c_str(), txindex.vSpent[prevout.n].ToString().c_str());
+
             // If prev is coinbase or coinstake, check that it's matured
             if (txPrev.IsCoinBase() || txPrev.IsCoinStake())
                 for (const CBlockIndex* pindex = pindexBlock; pindex && pindexBlock->nHeight - pindex->nHeight < nCoinbaseMaturity; pindex = pindex->pprev)
@@ -1613,7 +1966,13 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, 0))
+                CScriptCheck check(txPrev, *this, i, 0);
+                if (pvChecks)
+                {
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                }
+                else if (!check())
                 {
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
                 }
@@ -1659,6 +2018,11 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
         if (!vtx[i].DisconnectInputs(txdb))
             return false;
 
+    if (fCoinsDB)
+        for (int i = vtx.size()-1; i >= 0; i--)
+            if (!txdb.ForgetCoins(vtx[i]))
+                return error("DisconnectBlock() : ForgetCoins failed");
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1750,6 +2114,226 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck()
+{
+    RenameThread("pinkcoin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Mempool persistence
+//
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+// Serializes dumps from the persistence thread and from Shutdown, which
+// both write mempool.dat.new
+static CCriticalSection cs_mempoolDump;
+
+// Set once mempool.dat has been reloaded, so a node shut down while still
+// loading doesn't overwrite the file with a partial pool. Guarded by
+// cs_mempoolDump.
+static bool fMempoolLoaded = false;
+
+struct CMempoolDumpEntry
+{
+    CTransaction tx;
+    int64_t nTime;
+    uint64_t nCountWithAncestors;
+
+    // Parents have fewer ancestors than their children, so they are
+    // written, and later reloaded, first
+    bool operator<(const CMempoolDumpEntry& other) const
+    {
+        if (nCountWithAncestors != other.nCountWithAncestors)
+            return nCountWithAncestors < other.nCountWithAncestors;
+        return nTime < other.nTime;
+    }
+};
+
+bool DumpMempool()
+{
+    LOCK(cs_mempoolDump);
+    if (!fMempoolLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    vector<CMempoolDumpEntry> vEntries;
+    {
+        LOCK(mempool.cs);
+        vEntries.reserve(mempool.mapTx.size());
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapInfo.begin(); mi != mempool.mapInfo.end(); ++mi)
+        {
+            CMempoolDumpEntry dump;
+            dump.tx = mempool.mapTx[mi->first];
+            dump.nTime = mi->second.nTime;
+            dump.nCountWithAncestors = mi->second.nCountWithAncestors;
+            vEntries.push_back(dump);
+        }
+    }
+    sort(vEntries.begin(), vEntries.end());
+
+    // Write to a temporary file first so a crash can't leave a truncated dump
+    boost::filesystem::path pathDump = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+
+    try {
+        fileout << MEMPOOL_DUMP_VERSION << FLATDATA(pchMessageStart);
+        fileout << (uint64_t)vEntries.size();
+        BOOST_FOREACH(const CMempoolDumpEntry& dump, vEntries)
+            fileout << dump.tx << dump.nTime;
+    }
+    catch (std::exception &e) {
+        return error("DumpMempool() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathDump))
+        return error("DumpMempool() : rename failed");
+
+    printf("Dumped mempool: %" PRIszu " transactions in %" PRId64 "ms\n", vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+// Accept a batch of transactions read back from mempool.dat. With script
+// check threads running, all the batch's signatures are first verified in
+// parallel, which fills the signature cache so the serial checks made by
+// accept() are cache hits.
+static unsigned int LoadMempoolBatch(vector<CTransaction>& vBatch)
+{
+    unsigned int nAccepted = 0;
+
+    LOCK(cs_main);
+    CTxDB txdb("r");
+
+    if (nScriptCheckThreads)
+    {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        vector<MapPrevTx> vInputs(vBatch.size());
+        for (unsigned int i = 0; i < vBatch.size(); i++)
+        {
+            CTransaction& tx = vBatch[i];
+            map<uint256, CTxIndex> mapUnused;
+            bool fInvalid = false;
+            // Children whose parents aren't in the pool yet are verified
+            // serially by accept()
+            if (!tx.FetchInputs(txdb, mapUnused, false, false, vInputs[i], fInvalid))
+                continue;
+
+            vector<CScriptCheck> vChecks;
+            for (unsigned int n = 0; n < tx.vin.size(); n++)
+            {
+                const CTransaction& txPrev = vInputs[i][tx.vin[n].prevout.hash].second;
+                if (tx.vin[n].prevout.n >= txPrev.vout.size())
+                    break;
+                vChecks.push_back(CScriptCheck(txPrev, tx, n, 0));
+            }
+            control.Add(vChecks);
+        }
+        // A failed check only means some transaction will be rejected below
+        control.Wait();
+    }
+
+    BOOST_FOREACH(CTransaction& tx, vBatch)
+        if (tx.AcceptToMemoryPool(txdb))
+            nAccepted++;
+
+    return nAccepted;
+}
+
+static bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    boost::filesystem::path pathDump = GetDataDir() / "mempool.dat";
+    FILE* file = fopen(pathDump.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    unsigned int nRead = 0, nAccepted = 0, nExpired = 0;
+    try {
+        uint64_t nVersion, nCount;
+        unsigned char pchMsgTmp[4];
+        filein >> nVersion >> FLATDATA(pchMsgTmp);
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("LoadMempool() : unknown version %" PRIu64, nVersion);
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("LoadMempool() : invalid network magic number");
+        filein >> nCount;
+
+        int64_t nNow = GetAdjustedTime();
+        vector<CTransaction> vBatch;
+        vBatch.reserve(MEMPOOL_LOAD_BATCH);
+        while (nRead < nCount && !fShutdown)
+        {
+            CTransaction tx;
+            int64_t nTime;
+            filein >> tx >> nTime;
+            nRead++;
+
+            if (nTime + MEMPOOL_EXPIRY < nNow)
+            {
+                nExpired++;
+                continue;
+            }
+
+            vBatch.push_back(tx);
+            if (vBatch.size() >= MEMPOOL_LOAD_BATCH)
+            {
+                // cs_main is released between batches so block processing
+                // and peers aren't held up by a large reload
+                nAccepted += LoadMempoolBatch(vBatch);
+                vBatch.clear();
+            }
+        }
+        if (!vBatch.empty() && !fShutdown)
+            nAccepted += LoadMempoolBatch(vBatch);
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool() : deserialize or I/O error after %u transactions", nRead);
+    }
+
+    printf("Loaded mempool: %u of %u transactions accepted, %u expired, in %" PRId64 "ms\n",
+           nAccepted, nRead, nExpired, GetTimeMillis() - nStart);
+    return !fShutdown;
+}
+
+void ThreadMempoolPersist(void* parg)
+{
+    // Make this thread recognisable as the mempool persistence thread
+    RenameThread("pinkcoin-mempool");
+
+    LoadMempool();
+    if (fShutdown)
+        return;
+    {
+        LOCK(cs_mempoolDump);
+        fMempoolLoaded = true;
+    }
+
+    int64_t nLastDump = GetTime();
+    while (!fShutdown)
+    {
+        MilliSleep(1000);
+
+        if (GetTime() - nLastDump >= MEMPOOL_DUMP_INTERVAL)
+        {
+            DumpMempool();
+            nLastDump = GetTime();
+        }
+    }
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
@@ -1775,6 +2359,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
     int64_t nFees = 0;
     int64_t nPoolFees = 0;
@@ -1859,8 +2445,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())  // We already checked that it's not a VotePoll in CheckBlock() so this is ok.
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
@@ -1888,6 +2476,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return DoS(100, error("ConnectBlock() : coinstake pays too much(actual=%" PRId64 " vs calculated=%" PRId64 ")", nStakeReward, nCalculatedStakeReward));
     }
 
+    // Wait for the script checks handed to the worker pool before touching the index
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+
     // ppcoin: track money supply, mint amount, and feepool info
     pindex->nMint = nValueOut - nValueIn + nFees + nFeeFromPool;
     pindex->nFeePool = (pindex->pprev? pindex->pprev->nFeePool : 0) + nPoolFees - nFeeFromPool;
@@ -1913,6 +2505,16 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    // Keep the coins database in step with the tx index
+    if (fCoinsDB)
+    {
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+        {
+            if (!txdb.UpdateCoins(tx))
+                return error("ConnectBlock() : UpdateCoins failed");
+        }
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -2017,18 +2619,9 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     printf("REORGANIZE\n");
 
     // Find the fork
-    CBlockIndex* pfork = pindexBest;
-    CBlockIndex* plonger = pindexNew;
-    while (pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight)
-            if (!(plonger = plonger->pprev))
-                return error("Reorganize() : plonger->pprev is null");
-        if (pfork == plonger)
-            break;
-        if (!(pfork = pfork->pprev))
-            return error("Reorganize() : pfork->pprev is null");
-    }
+    CBlockIndex* pfork = chainActive.FindFork(pindexNew);
+    if (!pfork)
+        return error("Reorganize() : no fork point with the best chain");
 
     // List of what to disconnect
     vector<CBlockIndex*> vDisconnect;
@@ -2046,6 +2639,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Disconnect shorter branch
     list<CTransaction> vResurrect;
+    vector<CTransaction> vGone;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
     {
         CBlock block;
@@ -2060,6 +2654,8 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         BOOST_REVERSE_FOREACH(const CTransaction& tx, block.vtx)
             if (!(tx.IsCoinBase() || tx.IsCoinStake()) && pindex->nHeight > Checkpoints::GetTotalBlocksEstimate())
                 vResurrect.push_front(tx);
+            else
+                vGone.push_back(tx);
     }
 
     // Connect longer branch
@@ -2096,17 +2692,28 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    chainActive.SetTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
-        tx.AcceptToMemoryPool(txdb);
+        if (!tx.AcceptToMemoryPool(txdb) && !mempool.exists(tx.GetHash()))
+            vGone.push_back(tx);
 
     // Delete redundant memory transactions that are in the connected branch
+    set<uint256> setConnected;
     BOOST_FOREACH(CTransaction& tx, vDelete) {
+        mempool.UpdateMinedParent(tx, pindexNew->nHeight);
         mempool.remove(tx);
         mempool.removeConflicts(tx);
+        setConnected.insert(tx.GetHash());
     }
 
+    // Drop whatever in the pool spends outputs of disconnected transactions
+    // that are now in neither the chain nor the pool
+    BOOST_FOREACH(const CTransaction& tx, vGone)
+        if (!setConnected.count(tx.GetHash()))
+            mempool.removeSpends(tx);
+
     printf("REORGANIZE: done\n");
 
     return true;
@@ -2130,10 +2737,14 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    chainActive.SetTip(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
+    {
+        mempool.UpdateMinedParent(tx, pindexNew->nHeight);
         mempool.remove(tx);
+    }
 
     return true;
 }
@@ -2151,6 +2762,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        chainActive.SetTip(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -2213,8 +2825,8 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // New best block
     hashBestChain = hash;
+    filterRecentlyEvicted.reset();
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -2591,10 +3203,35 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        CInv inv(MSG_BLOCK, hash);
+        CSharedMessage pssCompact;
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (!pnode->fSendCompact)
+            {
+                pnode->PushInventory(inv);
+                continue;
+            }
+
+            // Push the block straight away as a compact block, built once
+            // for all peers, to everyone who doesn't have it yet
+            {
+                LOCK(pnode->cs_inventory);
+                if (pnode->filterInventoryKnown.contains(inv.hash))
+                    continue;
+                pnode->filterInventoryKnown.insert(inv.hash);
+            }
+            if (!pssCompact)
+            {
+                CDataStream ssCompact(SER_NETWORK, PROTOCOL_VERSION);
+                ssCompact << CCompactBlock(*this);
+                pssCompact = MakeSharedMessage("cmpctblock", ssCompact);
+            }
+            pnode->PushSharedMessage(pssCompact);
+        }
     }
 
     // ppcoin: check pending sync-checkpoint
@@ -2750,8 +3387,9 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         mapOrphanBlocks.insert(make_pair(hash, pblock2));
         mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing, unless the headers
+        // sync already knows where this block goes and will fetch its parents
+        if (pfrom && !mapHeaderIndex.count(hash))
         {
             pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
             // ppcoin: getblocks may not obtain the ancestor block rejected
@@ -3242,37 +3880,591 @@ string GetWarnings(string strFor)
 }
 
 
-
-
-
-
-
-
 //////////////////////////////////////////////////////////////////////////////
 //
-// Messages
+// Headers-first synchronization
 //
 
+static int GetHeaderTipHeight()
+{
+    if (vHeaderChain.empty())
+        return nBestHeight;
+    return max(nBestHeight, mapHeaderIndex[vHeaderChain.back()].nHeight);
+}
+
+static uint256 GetHeaderTipTrust()
+{
+    if (vHeaderChain.empty())
+        return nBestChainTrust;
+    return max(nBestChainTrust, mapHeaderIndex[vHeaderChain.back()].nChainTrust);
+}
 
-bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+// Trust a header adds to its chain. A proof-of-stake header's target can't
+// be verified without its coinstake, so it is only credited at the stake
+// limit; otherwise a made-up nBits would buy any amount of trust.
+static uint256 GetHeaderTrust(const CBigNum& bnTarget, bool fProofOfWork)
 {
-    switch (inv.type)
+    CBigNum bnTrustTarget = fProofOfWork ? bnTarget : bnProofOfStakeLimit;
+    return ((CBigNum(1)<<256) / (bnTrustTarget+1)).getuint256();
+}
+
+static CBlockLocator GetHeaderLocator()
+{
+    vector<uint256> vHave;
+    int nStep = 1;
+    for (int i = (int)vHeaderChain.size() - 1; i >= 0; i -= nStep)
     {
-    case MSG_TX:
-        {
-        bool txInMap = false;
-        txInMap = mempool.exists(inv.hash);
-        return txInMap ||
-               mapOrphanTransactions.count(inv.hash) ||
-               txdb.ContainsTx(inv.hash);
-        }
+        vHave.push_back(vHeaderChain[i]);
+        if (vHave.size() > 10U)
+            nStep *= 2;
+    }
 
-    case MSG_BLOCK:
-        return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+    // Continue below the header chain with the block index
+    CBlockIndex* pindex = pindexBest;
+    if (!vHeaderChain.empty())
+        pindex = mapBlockIndex[mapHeaderIndex[vHeaderChain.front()].hashPrev];
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10U)
+            nStep *= 2;
     }
-    // Don't know what it is, just say we already got one
-    return true;
+    vHave.push_back((!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
+    return CBlockLocator(vHave);
+}
+
+static void PushGetHeaders(CNode* pnode, uint256 hashStop = 0)
+{
+    pnode->nHeadersRequestTime = GetTime();
+    pnode->PushMessage("getheaders", GetHeaderLocator(), hashStop);
+}
+
+static int64_t GetHeaderMedianTimePast(uint256 hash)
+{
+    vector<int64_t> vTimes;
+    map<uint256, CHeaderIndex>::iterator mi;
+    while (vTimes.size() < (size_t)CBlockIndex::nMedianTimeSpan && (mi = mapHeaderIndex.find(hash)) != mapHeaderIndex.end())
+    {
+        vTimes.push_back(mi->second.nTime);
+        hash = mi->second.hashPrev;
+    }
+    map<uint256, CBlockIndex*>::iterator mb = mapBlockIndex.find(hash);
+    for (CBlockIndex* pindex = mb != mapBlockIndex.end() ? mb->second : NULL;
+         pindex && vTimes.size() < (size_t)CBlockIndex::nMedianTimeSpan; pindex = pindex->pprev)
+        vTimes.push_back(pindex->GetBlockTime());
+    if (vTimes.empty())
+        return 0;
+    sort(vTimes.begin(), vTimes.end());
+    return vTimes[vTimes.size() / 2];
+}
+
+// Make the best header chain end at hashTip
+static bool SetBestHeader(const uint256& hashTip)
+{
+    deque<uint256> vChain;
+    uint256 hash = hashTip;
+    while (!mapBlockIndex.count(hash))
+    {
+        map<uint256, CHeaderIndex>::iterator mi = mapHeaderIndex.find(hash);
+        if (mi == mapHeaderIndex.end())
+            return false;
+        vChain.push_front(hash);
+        hash = mi->second.hashPrev;
+    }
+    vHeaderChain.swap(vChain);
+    return true;
+}
+
+// Drop headers whose blocks are in, and headers on forks off the best header
+// chain. A fork gets some room to grow over several "headers" messages, but
+// once forks take more than MAX_HEADER_FORKS entries they all go, whatever
+// their height.
+static void PruneHeaderIndex()
+{
+    while (!vHeaderChain.empty() && mapBlockIndex.count(vHeaderChain.front()))
+    {
+        mapHeaderIndex.erase(vHeaderChain.front());
+        vHeaderChain.pop_front();
+    }
+
+    if (mapHeaderIndex.size() <= vHeaderChain.size() + MAX_HEADERS_RESULTS)
+        return;
+
+    // Sweep out headers that are now in the block index or on stale forks
+    bool fDropForks = (mapHeaderIndex.size() > vHeaderChain.size() + MAX_HEADER_FORKS);
+    int nChainStart = vHeaderChain.empty() ? 0 : mapHeaderIndex[vHeaderChain.front()].nHeight;
+    for (map<uint256, CHeaderIndex>::iterator mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end();)
+    {
+        int nPos = mi->second.nHeight - nChainStart;
+        bool fOnChain = (nPos >= 0 && nPos < (int)vHeaderChain.size() && vHeaderChain[nPos] == mi->first);
+        if (!fOnChain && (fDropForks || mapBlockIndex.count(mi->first) || mi->second.nHeight <= nBestHeight))
+            mapHeaderIndex.erase(mi++);
+        else
+            ++mi;
+    }
+}
+
+// Check a header from a "headers" message and add it to mapHeaderIndex.
+// Only the header fields are available, so a header is accepted either as
+// proof-of-work, if its hash meets its target, or else as a proof-of-stake
+// candidate whose target is within the stake limit; the kernel itself is
+// checked once the block arrives. Proof-of-stake headers cost nothing to
+// make, so above the last hardened checkpoint a run of them on top of other
+// headers is only taken up to MAX_HEADERS_AHEAD past the best block; they
+// are credited at the stake limit, and MAX_HEADER_INDEX_SIZE with the fork
+// pruning bounds what a peer can make us hold.
+static bool AcceptBlockHeader(const CBlock& header, const uint256& hash, int& nHeight, int& nDoS)
+{
+    nDoS = 0;
+    map<uint256, CBlockIndex*>::iterator mb = mapBlockIndex.find(hash);
+    if (mb != mapBlockIndex.end())
+    {
+        nHeight = mb->second->nHeight;
+        return true;
+    }
+    map<uint256, CHeaderIndex>::iterator mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+    {
+        nHeight = mi->second.nHeight;
+        return true;
+    }
+
+    if (mapHeaderIndex.size() >= MAX_HEADER_INDEX_SIZE)
+    {
+        PruneHeaderIndex();
+        if (mapHeaderIndex.size() >= MAX_HEADER_INDEX_SIZE)
+            return error("AcceptBlockHeader() : header index full");
+    }
+
+    // Find the previous header
+    bool fPrevBlock = false;
+    uint256 nPrevTrust;
+    if ((mb = mapBlockIndex.find(header.hashPrevBlock)) != mapBlockIndex.end())
+    {
+        fPrevBlock = true;
+        nHeight = mb->second->nHeight + 1;
+        nPrevTrust = mb->second->nChainTrust;
+    }
+    else if ((mi = mapHeaderIndex.find(header.hashPrevBlock)) != mapHeaderIndex.end())
+    {
+        nHeight = mi->second.nHeight + 1;
+        nPrevTrust = mi->second.nChainTrust;
+    }
+    else
+        return error("AcceptBlockHeader() : prev block %s not found", header.hashPrevBlock.ToString().substr(0,20).c_str());
+
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    bool fProofOfWork = (bnTarget > 0 && bnTarget <= bnProofOfWorkLimit && hash <= bnTarget.getuint256());
+    if (!fProofOfWork && (bnTarget <= 0 || bnTarget > bnProofOfStakeLimit))
+    {
+        nDoS = 100;
+        return error("AcceptBlockHeader() : nBits below minimum %s", bnTarget > bnProofOfWorkLimit ? "proof-of-stake" : "proof-of-work");
+    }
+    if (!fProofOfWork && !fPrevBlock && nHeight > Checkpoints::GetTotalBlocksEstimate() &&
+        nHeight > nBestHeight + MAX_HEADERS_AHEAD)
+        return false; // wait until more blocks are in
+
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("AcceptBlockHeader() : block timestamp too far in the future");
+    if (header.GetBlockTime() <= GetHeaderMedianTimePast(header.hashPrevBlock))
+    {
+        nDoS = 100;
+        return error("AcceptBlockHeader() : block timestamp too early");
+    }
+
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+    {
+        nDoS = 100;
+        return error("AcceptBlockHeader() : rejected by hardened checkpoint lock-in at %d", nHeight);
+    }
+
+    CHeaderIndex& entry = mapHeaderIndex[hash];
+    entry.hashPrev = header.hashPrevBlock;
+    entry.nHeight = nHeight;
+    entry.nTime = header.nTime;
+    entry.nChainTrust = nPrevTrust + GetHeaderTrust(bnTarget, fProofOfWork);
+
+    // Extend or switch the best header chain
+    if (!vHeaderChain.empty() && header.hashPrevBlock == vHeaderChain.back())
+        vHeaderChain.push_back(hash);
+    else if (entry.nChainTrust > GetHeaderTipTrust())
+        SetBestHeader(hash);
+    return true;
+}
+
+// A block we had a header for turned out invalid: drop it so nothing
+// on top of it gets downloaded
+static void ForgetHeader(const uint256& hash)
+{
+    if (mapHeaderIndex.erase(hash))
+    {
+        printf("ForgetHeader() : dropping header chain through %s\n", hash.ToString().substr(0,20).c_str());
+        vHeaderChain.clear();
+    }
+}
+
+static void MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, CNode*>::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return;
+    mi->second->mapBlocksInFlight.erase(hash);
+    mapBlocksInFlight.erase(mi);
+}
+
+static void ReleaseBlocksInFlight(CNode* pnode)
+{
+    BOOST_FOREACH(const PAIRTYPE(uint256, int64_t)& item, pnode->mapBlocksInFlight)
+        mapBlocksInFlight.erase(item.first);
+    pnode->mapBlocksInFlight.clear();
+}
+
+void FinalizeNode(CNode* pnode)
+{
+    AssertLockHeld(cs_main);
+    if (pnode->fSyncStarted)
+        nSyncStarted--;
+    pnode->fSyncStarted = false;
+    ReleaseBlocksInFlight(pnode);
+
+    for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end();)
+    {
+        if (mi->second.pfrom == pnode)
+            mapPartialBlocks.erase(mi++);
+        else
+            ++mi;
+    }
+}
+
+// Request the next blocks of the best header chain from pto, spreading the
+// download window over all peers and taking blocks back from stalled ones
+static void ScheduleBlockDownload(CNode* pto, vector<CInv>& vGetData)
+{
+    PruneHeaderIndex();
+    int64_t nNow = GetTimeMicros();
+
+    // Hand blocks that this peer never delivered to someone else
+    vector<uint256> vTimedOut;
+    BOOST_FOREACH(const PAIRTYPE(uint256, int64_t)& item, pto->mapBlocksInFlight)
+        if (nNow - item.second > BLOCK_DOWNLOAD_TIMEOUT * 1000000LL)
+            vTimedOut.push_back(item.first);
+    BOOST_FOREACH(const uint256& hash, vTimedOut)
+    {
+        printf("block download of %s from %s timed out\n", hash.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+        MarkBlockReceived(hash);
+    }
+    if (!vTimedOut.empty())
+        pto->nDownloadBackoffUntil = GetTime() + BLOCK_DOWNLOAD_BACKOFF;
+
+    if (vHeaderChain.empty())
+        return;
+
+    // If every block in the window is already requested and this peer is
+    // the one holding up its front, reassign everything it has in flight
+    if (fDownloadWindowFull)
+    {
+        map<uint256, int64_t>::iterator mi = pto->mapBlocksInFlight.find(vHeaderChain.front());
+        if (mi != pto->mapBlocksInFlight.end() && nNow - mi->second > BLOCK_STALLING_TIMEOUT * 1000000LL)
+        {
+            printf("peer %s is stalling block download, reassigning %" PRIszu " blocks\n", pto->addr.ToString().c_str(), pto->mapBlocksInFlight.size());
+            ReleaseBlocksInFlight(pto);
+            pto->nDownloadBackoffUntil = GetTime() + BLOCK_DOWNLOAD_BACKOFF;
+            fDownloadWindowFull = false;
+        }
+    }
+
+    if (GetTime() < pto->nDownloadBackoffUntil || pto->fClient)
+        return;
+
+    int nChainStart = mapHeaderIndex[vHeaderChain.front()].nHeight;
+    int nWindow = min((int)vHeaderChain.size(), BLOCK_DOWNLOAD_WINDOW);
+    bool fSkipped = false;
+    for (int i = 0; i < nWindow && (int)pto->mapBlocksInFlight.size() < MAX_BLOCKS_IN_TRANSIT_PER_PEER; i++)
+    {
+        const uint256& hash = vHeaderChain[i];
+        if (nChainStart + i > pto->nSyncHeight)
+            break;
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+        if (mapBlocksInFlight.count(hash))
+        {
+            fSkipped = true;
+            continue;
+        }
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        pto->mapBlocksInFlight[hash] = nNow;
+        mapBlocksInFlight[hash] = pto;
+    }
+    fDownloadWindowFull = (fSkipped && (int)pto->mapBlocksInFlight.size() < MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Compact blocks
+//
+
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    header.vchBlockSig = block.vchBlockSig;
+
+    RAND_bytes((unsigned char*)&nShortIdNonce, sizeof(nShortIdNonce));
+    uint256 key = GetShortIdKey();
+
+    // The coinbase and coinstake are never in anyone's memory pool
+    vShortIds.reserve(block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i == 0 || (i == 1 && block.IsProofOfStake()))
+            vPrefilled.push_back(CPrefilledTransaction(i, block.vtx[i]));
+        else
+            vShortIds.push_back(GetShortId(key, block.vtx[i].GetHash()));
+    }
+}
+
+// Fill in the transactions of a compact block from the memory pool and the
+// orphan transactions. Slots that nothing or more than one transaction maps
+// to are returned in vMissing. Returns false if the compact block itself is
+// malformed.
+static bool ReconstructCompactBlock(const CCompactBlock& cmpctblock, CBlock& block, vector<unsigned int>& vMissing)
+{
+    unsigned int nCount = cmpctblock.GetTransactionCount();
+    if (nCount == 0 || nCount > MAX_BLOCK_SIZE / 60)
+        return false;
+
+    block = cmpctblock.header;
+    block.vtx.resize(nCount);
+    vector<bool> vHave(nCount, false);
+
+    int nLastIndex = -1;
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilled)
+    {
+        if ((int)prefilled.nIndex <= nLastIndex || prefilled.nIndex >= nCount)
+            return false;
+        nLastIndex = prefilled.nIndex;
+        block.vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // Map every short id to its slot; a short id occurring twice in the
+    // block can't be resolved, so those slots are fetched from the peer
+    map<uint64_t, unsigned int> mapShortIds;
+    vector<bool> vCollision(nCount, false);
+    unsigned int nSlot = 0;
+    BOOST_FOREACH(uint64_t nShortId, cmpctblock.vShortIds)
+    {
+        while (vHave[nSlot])
+            nSlot++;
+        pair<map<uint64_t, unsigned int>::iterator, bool> ret = mapShortIds.insert(make_pair(nShortId, nSlot));
+        if (!ret.second)
+        {
+            vCollision[nSlot] = true;
+            vCollision[ret.first->second] = true;
+        }
+        nSlot++;
+    }
+
+    uint256 key = cmpctblock.GetShortIdKey();
+    vector<bool> vFound(nCount, false);
+    {
+        LOCK(mempool.cs);
+        for (map<uint256, CTransaction>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        {
+            map<uint64_t, unsigned int>::iterator it = mapShortIds.find(CCompactBlock::GetShortId(key, mi->first));
+            if (it == mapShortIds.end())
+                continue;
+            if (vFound[it->second])
+                vCollision[it->second] = true;
+            block.vtx[it->second] = mi->second;
+            vFound[it->second] = true;
+        }
+    }
+    for (map<uint256, CTransaction>::const_iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+    {
+        map<uint64_t, unsigned int>::iterator it = mapShortIds.find(CCompactBlock::GetShortId(key, mi->first));
+        if (it == mapShortIds.end())
+            continue;
+        if (vFound[it->second])
+            vCollision[it->second] = true;
+        block.vtx[it->second] = mi->second;
+        vFound[it->second] = true;
+    }
+
+    vMissing.clear();
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        if (!vHave[i] && (!vFound[i] || vCollision[i]))
+        {
+            block.vtx[i].SetNull();
+            vMissing.push_back(i);
+        }
+    }
+    return true;
+}
+
+static void RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+static void ProcessReceivedBlock(CNode* pfrom, CBlock& block, const uint256& hashBlock)
+{
+    CInv inv(MSG_BLOCK, hashBlock);
+    pfrom->AddInventoryKnown(inv);
+    MarkBlockReceived(hashBlock);
+
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+
+    if (block.nDoS)
+    {
+        pfrom->Misbehaving(block.nDoS);
+        ForgetHeader(hashBlock);
+    }
+
+    if (fSecMsgenabled)
+        SecureMsgScanBlock(block);
+}
+
+// All transactions of a compact block are in place; a merkle root mismatch
+// means a short id matched the wrong transaction, so get the real block.
+// If the peer sent every transaction itself, the mismatch is its own doing.
+static void FinishCompactBlock(CNode* pfrom, CBlock& block, const uint256& hashBlock, bool fAllFromPeer)
+{
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        if (fAllFromPeer)
+        {
+            pfrom->Misbehaving(100);
+            error("FinishCompactBlock() : hashMerkleRoot mismatch in %s from %s", hashBlock.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+            return;
+        }
+        printf("compact block %s failed to reconstruct, requesting full block from %s\n", hashBlock.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+        RequestFullBlock(pfrom, hashBlock);
+        return;
+    }
+    ProcessReceivedBlock(pfrom, block, hashBlock);
+}
+
+// Fall back to the full block for reconstructions the peer left hanging
+static void ExpirePartialBlocks(CNode* pto)
+{
+    int64_t nNow = GetTime();
+    for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end();)
+    {
+        if (mi->second.pfrom == pto && nNow - mi->second.nTime > COMPACT_BLOCK_TIMEOUT)
+        {
+            RequestFullBlock(pto, mi->first);
+            mapPartialBlocks.erase(mi++);
+        }
+        else
+            ++mi;
+    }
+}
+
+
+
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Messages
+//
+
+
+// Recently requested blocks as complete "block" messages, shared by all
+// peers so a new block asked for by many peers is read and serialized once
+// and then queued to each of them without copying
+static CCriticalSection cs_blockServeCache;
+static list<pair<uint256, CSharedMessage> > lruBlockServeCache;
+static map<uint256, list<pair<uint256, CSharedMessage> >::iterator> mapBlockServeCache;
+static uint64_t nBlockServeCacheBytes = 0;
+static uint64_t nBlockServeCacheLookups = 0;
+static uint64_t nBlockServeCacheHits = 0;
+
+static CSharedMessage GetServedBlock(CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_blockServeCache);
+        nBlockServeCacheLookups++;
+        map<uint256, list<pair<uint256, CSharedMessage> >::iterator>::iterator mi = mapBlockServeCache.find(hash);
+        if (mi != mapBlockServeCache.end())
+        {
+            nBlockServeCacheHits++;
+            lruBlockServeCache.splice(lruBlockServeCache.begin(), lruBlockServeCache, mi->second);
+            return mi->second->second;
+        }
+    }
+
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+        return CSharedMessage();
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock.reserve(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    ssBlock << block;
+    CSharedMessage pssBlock = MakeSharedMessage("block", ssBlock);
+    if ((int64_t)pssBlock->size() > nBlockServeCacheSize)
+        return pssBlock;
+
+    LOCK(cs_blockServeCache);
+    if (mapBlockServeCache.count(hash))
+        return pssBlock;
+    lruBlockServeCache.push_front(make_pair(hash, pssBlock));
+    mapBlockServeCache[hash] = lruBlockServeCache.begin();
+    nBlockServeCacheBytes += pssBlock->size();
+    while (nBlockServeCacheBytes > (uint64_t)nBlockServeCacheSize)
+    {
+        nBlockServeCacheBytes -= lruBlockServeCache.back().second->size();
+        mapBlockServeCache.erase(lruBlockServeCache.back().first);
+        lruBlockServeCache.pop_back();
+    }
+    return pssBlock;
+}
+
+void GetBlockServeCacheStats(uint64_t& nEntries, uint64_t& nBytes, uint64_t& nLookups, uint64_t& nHits)
+{
+    LOCK(cs_blockServeCache);
+    nEntries = mapBlockServeCache.size();
+    nBytes = nBlockServeCacheBytes;
+    nLookups = nBlockServeCacheLookups;
+    nHits = nBlockServeCacheHits;
+}
+
+bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+{
+    switch (inv.type)
+    {
+    case MSG_TX:
+        {
+        bool txInMap = false;
+        txInMap = mempool.exists(inv.hash);
+        return txInMap ||
+               mapOrphanTransactions.count(inv.hash) ||
+               filterRecentlyEvicted.contains(inv.hash) ||
+               txdb.ContainsTx(inv.hash);
+        }
+
+    case MSG_BLOCK:
+        return mapBlockIndex.count(inv.hash) ||
+               mapOrphanBlocks.count(inv.hash);
+    }
+    // Don't know what it is, just say we already got one
+    return true;
 }
 
 
@@ -3364,6 +4556,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->PushMessage("verack");
         pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
+        // Have new blocks announced to us as compact blocks
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct", true);
+
         if (!pfrom->fInbound)
         {
             // Advertise our address
@@ -3389,17 +4585,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
-        // Ask the first connected node for block updates
-        static int nAskedForBlocks = 0;
-        if (!pfrom->fClient && !pfrom->fOneShot &&
-            (pfrom->nStartingHeight > (nBestHeight - 144)) &&
-            (pfrom->nVersion < NOBLKS_VERSION_START ||
-             pfrom->nVersion >= NOBLKS_VERSION_END) &&
-             (nAskedForBlocks < 1 || vNodes.size() <= 1U))
-        {
-            nAskedForBlocks++;
-            pfrom->PushGetBlocks(pindexBest, uint256(0));
-        }
+        // Block updates are requested by the headers sync in SendMessages
+        pfrom->nSyncHeight = pfrom->nStartingHeight;
 
         // Relay alerts
         {
@@ -3516,6 +4703,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->Misbehaving(20);
             return error("message inv size() = %" PRIszu "", vInv.size());
         }
+        {
+            LOCK(pfrom->cs_inventory);
+            pfrom->nInvRecv += vInv.size();
+        }
 
         // find last block in inv vector
         unsigned int nLastBlock = (unsigned int)(-1);
@@ -3526,6 +4717,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
         CTxDB txdb("r");
+        bool fInitialDownload = IsInitialBlockDownload();
+        uint256 hashGetHeaders = 0;
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
             const CInv &inv = vInv[nInv];
@@ -3538,9 +4731,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave)
+            if (inv.type == MSG_BLOCK)
+            {
+                map<uint256, CHeaderIndex>::iterator mi = mapHeaderIndex.find(inv.hash);
+                if (mi != mapHeaderIndex.end())
+                    pfrom->nSyncHeight = max(pfrom->nSyncHeight, mi->second.nHeight);
+            }
+
+            if (!fAlreadyHave && inv.type == MSG_BLOCK && (fInitialDownload || mapHeaderIndex.count(inv.hash)))
+            {
+                // Headers-first: the block is fetched by the download window
+                // once its header connects
+                if (!mapHeaderIndex.count(inv.hash))
+                    hashGetHeaders = inv.hash;
+            }
+            else if (!fAlreadyHave)
                 pfrom->AskFor(inv);
-            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
+            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash) && !mapHeaderIndex.count(inv.hash)) {
                 pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
             } else if (nInv == nLastBlock) {
                 // In case we are on a very long side-chain, it is possible that we already have
@@ -3554,6 +4761,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // Track requests for our stuff
             Inventory(inv.hash);
         }
+
+        if (hashGetHeaders != 0 && pfrom->nHeadersRequestTime == 0 && GetHeaderTipHeight() < nBestHeight + MAX_HEADERS_AHEAD)
+            PushGetHeaders(pfrom, hashGetHeaders);
     }
 
 
@@ -3581,11 +4791,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             {
                 // Send block from disk
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                CSharedMessage pssBlock;
+                if (mi != mapBlockIndex.end() && (pssBlock = GetServedBlock((*mi).second)))
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    pfrom->PushSharedMessage(pssBlock);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3606,9 +4815,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -3708,7 +4917,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3720,6 +4929,64 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %" PRIszu "", vHeaders.size());
+        }
+
+        // Only take headers we asked this peer for
+        if (pfrom->nHeadersRequestTime == 0)
+        {
+            if (fDebug)
+                printf("ignoring unrequested headers from %s\n", pfrom->addr.ToString().c_str());
+            return true;
+        }
+        pfrom->nHeadersRequestTime = 0;
+
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+        {
+            if (fShutdown)
+                return true;
+            uint256 hash = header.GetHash();
+            int nHeight = -1;
+            int nDoS = 0;
+            if (!AcceptBlockHeader(header, hash, nHeight, nDoS))
+            {
+                if (nDoS > 0)
+                    pfrom->Misbehaving(nDoS);
+                else if (!mapHeaderIndex.count(header.hashPrevBlock) && !mapBlockIndex.count(header.hashPrevBlock))
+                    PushGetHeaders(pfrom); // doesn't connect, resync from our locator
+                else
+                {
+                    // Resume once more blocks are in, far enough for a run
+                    // of unconnected headers to fit
+                    pfrom->fHeadersMore = true;
+                    pfrom->nHeadersAwaitHeight = max(nBestHeight + 1, nHeight - MAX_HEADERS_AHEAD);
+                }
+                return true;
+            }
+            pfrom->nSyncHeight = max(pfrom->nSyncHeight, nHeight);
+        }
+
+        // A full result means the peer has more; keep going unless we're too
+        // far ahead of the blocks, in which case SendMessages resumes later
+        if (vHeaders.size() == MAX_HEADERS_RESULTS)
+        {
+            if (GetHeaderTipHeight() < nBestHeight + MAX_HEADERS_AHEAD)
+                PushGetHeaders(pfrom);
+            else
+                pfrom->fHeadersMore = true;
+        }
+        if (fDebug)
+            printf("received %" PRIszu " headers from %s, header tip %d\n", vHeaders.size(), pfrom->addr.ToString().c_str(), GetHeaderTipHeight());
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3795,17 +5062,168 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // printf("received block %s\n", hashBlock.ToString().substr(0,20).c_str());
         // block.print();
 
+        ProcessReceivedBlock(pfrom, block, hashBlock);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounce = false;
+        vRecv >> fAnnounce;
+        pfrom->fSendCompact = fAnnounce;
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+
         CInv inv(MSG_BLOCK, hashBlock);
         pfrom->AddInventoryKnown(inv);
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock) || mapPartialBlocks.count(hashBlock))
+            return true;
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        
-        if (block.nDoS)
-            pfrom->Misbehaving(block.nDoS);
-        
-        if (fSecMsgenabled)
-            SecureMsgScanBlock(block);
+        // The headers sync fetches blocks during initial download
+        if (IsInitialBlockDownload())
+            return true;
+
+        // Let the orphan logic of the full block ask for what's missing
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+        {
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        }
+
+        // Check what the header and the prefilled coinbase and coinstake can
+        // tell before the memory pool is searched for the rest
+        CBlock blockHeader = cmpctblock.header;
+        BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilled)
+            if (prefilled.nIndex == blockHeader.vtx.size())
+                blockHeader.vtx.push_back(prefilled.tx);
+        if (!blockHeader.CheckBlock(true, false, true))
+        {
+            if (blockHeader.nDoS)
+                pfrom->Misbehaving(blockHeader.nDoS);
+            return error("message cmpctblock : CheckBlock FAILED for %s", hashBlock.ToString().substr(0,20).c_str());
+        }
+        if (blockHeader.nBits != GetNextTargetRequired(mi->second, blockHeader.IsProofOfStake(), blockHeader.nTime))
+        {
+            pfrom->Misbehaving(100);
+            return error("message cmpctblock : incorrect %s", blockHeader.IsProofOfWork() ? "proof-of-work" : "proof-of-stake");
+        }
+
+        CBlock block;
+        vector<unsigned int> vMissing;
+        if (!ReconstructCompactBlock(cmpctblock, block, vMissing))
+        {
+            pfrom->Misbehaving(100);
+            return error("message cmpctblock : malformed compact block %s", hashBlock.ToString().substr(0,20).c_str());
+        }
+
+        if (vMissing.empty())
+        {
+            FinishCompactBlock(pfrom, block, hashBlock, cmpctblock.vShortIds.empty());
+            return true;
+        }
+
+        unsigned int nPeerPartial = 0;
+        for (map<uint256, CPartialBlock>::iterator it = mapPartialBlocks.begin(); it != mapPartialBlocks.end(); ++it)
+            if (it->second.pfrom == pfrom)
+                nPeerPartial++;
+        if (mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS || nPeerPartial >= MAX_PARTIAL_BLOCKS_PER_PEER)
+        {
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        }
+
+        if (fDebug)
+            printf("compact block %s missing %" PRIszu " of %u transactions\n", hashBlock.ToString().substr(0,20).c_str(), vMissing.size(), cmpctblock.GetTransactionCount());
+
+        CBlockTxnRequest req;
+        req.blockhash = hashBlock;
+        req.vIndexes = vMissing;
+        pfrom->PushMessage("getblocktxn", req);
+
+        CPartialBlock& partial = mapPartialBlocks[hashBlock];
+        partial.block = cmpctblock.header;
+        partial.block.vtx.swap(block.vtx);
+        partial.vMissing.swap(vMissing);
+        partial.nShortIds = cmpctblock.vShortIds.size();
+        partial.pfrom = pfrom;
+        partial.nTime = GetTime();
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTxnRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end())
+            return true;
+        CBlockIndex* pindex = (*mi).second;
+
+        // Anything older than a fresh block is served whole
+        if (!pindex->IsInMainChain() || pindex->nHeight < nBestHeight - MAX_BLOCKTXN_DEPTH)
+        {
+            CSharedMessage pssBlock = GetServedBlock(pindex);
+            if (pssBlock)
+                pfrom->PushSharedMessage(pssBlock);
+            return true;
+        }
+
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return true;
+
+        CBlockTxn resp;
+        resp.blockhash = req.blockhash;
+        resp.vtx.reserve(req.vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("message getblocktxn : index %u out of range", nIndex);
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        CBlockTxn resp;
+        vRecv >> resp;
+
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(resp.blockhash);
+        if (mi == mapPartialBlocks.end() || mi->second.pfrom != pfrom)
+            return true;
+
+        uint256 hashBlock = mi->first;
+        vector<CTransaction> vtx;
+        vtx.swap(mi->second.block.vtx);
+        CBlock block = mi->second.block;
+        block.vtx.swap(vtx);
+        vector<unsigned int> vMissing;
+        vMissing.swap(mi->second.vMissing);
+        bool fAllFromPeer = (vMissing.size() == mi->second.nShortIds);
+        mapPartialBlocks.erase(mi);
+
+        if (resp.vtx.size() != vMissing.size())
+        {
+            pfrom->Misbehaving(10);
+            RequestFullBlock(pfrom, hashBlock);
+            return error("message blocktxn : got %" PRIszu " transactions, expected %" PRIszu "", resp.vtx.size(), vMissing.size());
+        }
+        for (unsigned int i = 0; i < vMissing.size(); i++)
+            block.vtx[vMissing[i]] = resp.vtx[i];
+        FinishCompactBlock(pfrom, block, hashBlock, fAllFromPeer);
     }
 
 
@@ -4037,6 +5455,13 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            if (strCommand == "ping" || strCommand == "pong")
+            {
+                // Keepalives only touch the peer, answer them even while
+                // another handler thread holds cs_main for a block
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            }
+            else
             {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -4173,65 +5598,85 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: inventory
         //
+        // Blocks are announced right away. Transactions are batched and sent
+        // at Poisson distributed times per peer, which smooths out relay
+        // bursts and hides which peer saw a transaction first.
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
+            int64_t nNow = GetTimeMicros();
+            bool fSendTxInv = false;
+            if (pto->nNextInvSend < nNow)
             {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
+                fSendTxInv = true;
+                pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL / 2);
+            }
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+            vector<pair<CInv, int64_t> > vInvWait;
+            vInv.reserve(pto->vInventoryToSend.size());
+            BOOST_FOREACH(const PAIRTYPE(CInv, int64_t)& item, pto->vInventoryToSend)
+            {
+                const CInv& inv = item.first;
+                if (inv.type == MSG_TX && !fSendTxInv)
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    // always trickle our own transactions
-                    if (!fTrickleWait)
-                    {
-                        CWalletTx wtx;
-                        if (GetTransaction(inv.hash, wtx))
-                            if (wtx.fFromMe)
-                                fTrickleWait = true;
-                    }
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                    vInvWait.push_back(item);
+                    continue;
                 }
+                if (pto->filterInventoryKnown.contains(inv.hash))
+                    continue;
+                pto->filterInventoryKnown.insert(inv.hash);
+                pto->nInvSent++;
+                pto->nInvDelay += nNow - item.second;
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000U)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000U)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.swap(vInvWait);
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
 
+        //
+        // Message: getheaders
+        //
+        if (!pto->fSyncStarted && !pto->fClient && !pto->fOneShot && !pto->fDisconnect &&
+            GetTime() >= pto->nDownloadBackoffUntil && pto->nSyncHeight > GetHeaderTipHeight() &&
+            (nSyncStarted == 0 || !IsInitialBlockDownload()))
+        {
+            // Sync headers from one peer at a time until close to the tip
+            pto->fSyncStarted = true;
+            nSyncStarted++;
+            PushGetHeaders(pto);
+        }
+        else if (pto->fHeadersMore && GetHeaderTipHeight() < nBestHeight + MAX_HEADERS_AHEAD / 2 &&
+                 nBestHeight >= pto->nHeadersAwaitHeight)
+        {
+            pto->fHeadersMore = false;
+            pto->nHeadersAwaitHeight = 0;
+            PushGetHeaders(pto);
+        }
+        if (pto->fSyncStarted && pto->nHeadersRequestTime != 0 && GetTime() - pto->nHeadersRequestTime > HEADERS_DOWNLOAD_TIMEOUT)
+        {
+            // Let another peer take over the headers sync
+            printf("headers sync with %s timed out\n", pto->addr.ToString().c_str());
+            pto->fSyncStarted = false;
+            pto->nHeadersRequestTime = 0;
+            pto->nDownloadBackoffUntil = GetTime() + BLOCK_DOWNLOAD_BACKOFF;
+            nSyncStarted--;
+        }
+
+
         //
         // Message: getdata
         //
         vector<CInv> vGetData;
+        ScheduleBlockDownload(pto, vGetData);
+        ExpirePartialBlocks(pto);
         int64_t nNow = GetTime() * 1000000;
         CTxDB txdb("r");
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
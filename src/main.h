@@ -42,6 +42,44 @@ static const int64_t MIN_TX_FEE = 10000;
 static const int64_t MIN_RELAY_TX_FEE = MIN_TX_FEE;
 static const int64_t MAX_MONEY = 500000000 * COIN;
 static const int64_t YEARLY_BLOCKCOUNT = 423400;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Number of headers sent in one getheaders result */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Stop asking for more headers when this far ahead of the best block */
+static const int MAX_HEADERS_AHEAD = 50000;
+/** Headers kept on forks off the best header chain before they're dropped */
+static const unsigned int MAX_HEADER_FORKS = 4 * MAX_HEADERS_RESULTS;
+/** Hard cap on the number of headers held without their blocks */
+static const unsigned int MAX_HEADER_INDEX_SIZE = MAX_HEADERS_AHEAD + 2 * MAX_HEADERS_RESULTS + MAX_HEADER_FORKS;
+/** Size of the moving window of blocks requested ahead of the best block */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Number of blocks that can be requested from a single peer at once */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Seconds a peer may hold up the front of a full download window */
+static const int BLOCK_STALLING_TIMEOUT = 10;
+/** Seconds before an unanswered block request is given to another peer */
+static const int BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Seconds before an unanswered getheaders request is abandoned */
+static const int HEADERS_DOWNLOAD_TIMEOUT = 120;
+/** Seconds a stalling peer is left out of the block download */
+static const int BLOCK_DOWNLOAD_BACKOFF = 60;
+/** Seconds a compact block may wait for its missing transactions */
+static const int COMPACT_BLOCK_TIMEOUT = 30;
+/** Maximum number of compact blocks being reconstructed at once */
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+/** Maximum number of compact blocks being reconstructed for one peer */
+static const unsigned int MAX_PARTIAL_BLOCKS_PER_PEER = 2;
+/** Only blocks this close to the tip are served by getblocktxn */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Seconds between periodic writes of mempool.dat */
+static const int MEMPOOL_DUMP_INTERVAL = 15 * 60;
+/** Transactions reloaded from mempool.dat per hold of cs_main */
+static const unsigned int MEMPOOL_LOAD_BATCH = 100;
+/** Dumped transactions older than this many seconds aren't reloaded */
+static const int64_t MEMPOOL_EXPIRY = 72 * 60 * 60;
+/** Half-life in seconds of the minimum fee rate left behind by evictions */
+static const int64_t ROLLING_FEE_HALFLIFE = 12 * 60 * 60;
 
 // Mainnet feature forks
 static const time_t VOTE_START_DATE = 1540857600; // 10/30/2018 @ 12:00am (UTC)
@@ -97,7 +135,11 @@ extern int64_t nSplitThreshold;
 extern int64_t nMinimumInputValue;
 extern int64_t nMinimumStakeValue;
 extern bool fUseFastIndex;
+extern bool fCoinsDB;
+extern int64_t nBlockServeCacheSize;
+extern int64_t nMaxMempoolSize;
 extern unsigned int nDerivationMethodIndex;
+extern int nScriptCheckThreads;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
@@ -105,6 +147,7 @@ static const uint64_t nMinDiskSpace = 52428800;
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CScriptCheck;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
@@ -120,7 +163,15 @@ void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+void FinalizeNode(CNode* pnode);
+void GetBlockServeCacheStats(uint64_t& nEntries, uint64_t& nBytes, uint64_t& nLookups, uint64_t& nHits);
 bool LoadExternalBlockFile(FILE* fileIn);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
+/** Write the memory pool to mempool.dat, once it has been reloaded */
+bool DumpMempool();
+/** Reload mempool.dat, then dump the memory pool periodically */
+void ThreadMempoolPersist(void* parg);
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake, unsigned int nBlockTime = 0);
@@ -708,11 +759,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	If not NULL, script checks are pushed onto it instead of being performed inline
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool* pfMissingInputs=NULL);
     bool GetCoinAge(CTxDB& txdb, uint64_t& nCoinAge) const;  // ppcoin: get transaction coin age
@@ -784,6 +837,37 @@ public:
 
 
 
+/** Closure representing one script verification.
+ *  Note that this stores a copy of the spent output's scriptPubKey, but only
+ *  a pointer to the spending transaction, which must outlive the check.
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(NULL), nIn(0), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
+
+
+
 /**  A txdb record that contains the disk location of a transaction and the
  * locations of transactions that spend its outputs.  vSpent is really only
  * used as a flag, but having the location is very helpful for debugging.
@@ -839,6 +923,83 @@ public:
 };
 
 
+/** The unspent outputs of a transaction, kept in the optional coins database (-coinsdb)
+ * so inputs can be validated without reading the previous transaction from the block
+ * files. Spent outputs are nulled rather than removed so output positions stay valid;
+ * an entry without outputs stands for "not in the coins database".
+ */
+class CCoins
+{
+public:
+    bool fCoinBase;
+    bool fCoinStake;
+    unsigned int nTime;
+    std::vector<CTxOut> vout;
+
+    CCoins()
+    {
+        SetNull();
+    }
+
+    CCoins(const CTransaction& tx) : fCoinBase(tx.IsCoinBase()), fCoinStake(tx.IsCoinStake()), nTime(tx.nTime), vout(tx.vout) {}
+
+    CCoins(const CTransaction& tx, const CTxIndex& txindex) : fCoinBase(tx.IsCoinBase()), fCoinStake(tx.IsCoinStake()), nTime(tx.nTime), vout(tx.vout)
+    {
+        for (unsigned int i = 0; i < vout.size() && i < txindex.vSpent.size(); i++)
+            if (!txindex.vSpent[i].IsNull())
+                vout[i].SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(fCoinBase);
+        READWRITE(fCoinStake);
+        READWRITE(nTime);
+        READWRITE(vout);
+    )
+
+    void SetNull()
+    {
+        fCoinBase = false;
+        fCoinStake = false;
+        nTime = 0;
+        vout.clear();
+    }
+
+    bool IsNull() const
+    {
+        return vout.empty();
+    }
+
+    void Spend(unsigned int n)
+    {
+        if (n < vout.size())
+            vout[n].SetNull();
+    }
+
+    bool IsFullySpent() const
+    {
+        BOOST_FOREACH(const CTxOut& txout, vout)
+            if (txout.nValue != -1 && !txout.IsEmpty())
+                return false;
+        return true;
+    }
+
+    // Stand-in for the previous transaction in FetchInputs: same outputs, time and
+    // coinbase/coinstake classification, which is all ConnectInputs looks at
+    void ToTransaction(const uint256& hash, CTransaction& tx) const
+    {
+        tx.SetNull();
+        tx.nTime = nTime;
+        tx.vout = vout;
+        if (fCoinBase)
+            tx.vin.push_back(CTxIn());
+        else if (fCoinStake)
+            tx.vin.push_back(CTxIn(COutPoint(hash, 0)));
+    }
+};
+
+
 
 
 
@@ -1123,6 +1284,106 @@ private:
 
 
 
+/** A transaction sent in full as part of a compact block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex; // position in the block
+    CTransaction tx;
+
+    CPrefilledTransaction()
+    {
+        nIndex = 0;
+    }
+
+    CPrefilledTransaction(unsigned int nIndexIn, const CTransaction& txIn) : nIndex(nIndexIn), tx(txIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** Block announcement carrying the header and block signature, the coinbase
+ * and coinstake in full and a short id for every other transaction, which
+ * the receiver is expected to find in its memory pool.
+ */
+class CCompactBlock
+{
+public:
+    CBlock header; // header and vchBlockSig, vtx left empty
+    uint64_t nShortIdNonce;
+    std::vector<uint64_t> vShortIds;
+    std::vector<CPrefilledTransaction> vPrefilled;
+
+    CCompactBlock()
+    {
+        nShortIdNonce = 0;
+    }
+
+    CCompactBlock(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nShortIdNonce);
+        READWRITE(vShortIds);
+        READWRITE(vPrefilled);
+    )
+
+    unsigned int GetTransactionCount() const
+    {
+        return vShortIds.size() + vPrefilled.size();
+    }
+
+    // Per-block salt for the short ids, so a collision can't be prepared
+    // ahead of time against every block
+    uint256 GetShortIdKey() const
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << header << nShortIdNonce;
+        return ss.GetHash();
+    }
+
+    static uint64_t GetShortId(const uint256& key, const uint256& txid)
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << key << txid;
+        return ss.GetHash().Get64();
+    }
+};
+
+/** Request for the transactions of a compact block that could not be found */
+class CBlockTxnRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    )
+};
+
+/** Answer to getblocktxn, the requested transactions in order */
+class CBlockTxn
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+
+
 
 
 
@@ -1470,7 +1731,64 @@ public:
 
 
 
+/** The active (best) block chain as a vector indexed by height, so height lookups,
+ * main chain membership and fork searches don't have to walk pprev/pnext.
+ * Kept in step with the pnext links by SetBestChainInner/Reorganize (guarded by cs_main).
+ */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** Returns the genesis block index, or NULL if the chain is empty */
+    CBlockIndex* Genesis() const
+    {
+        return vChain.size() > 0 ? vChain[0] : NULL;
+    }
+
+    /** Returns the tip of the chain, or NULL if the chain is empty */
+    CBlockIndex* Tip() const
+    {
+        return vChain.size() > 0 ? vChain[vChain.size() - 1] : NULL;
+    }
+
+    /** Returns the block index at the given height, or NULL if out of range */
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    /** Whether this chain contains the given block index */
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return pindex != NULL && (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Returns the successor of a block in this chain, or NULL if it is the tip or not in the chain */
+    CBlockIndex* Next(const CBlockIndex* pindex) const
+    {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        return NULL;
+    }
+
+    /** Height of the tip, -1 if the chain is empty */
+    int Height() const
+    {
+        return vChain.size() - 1;
+    }
+
+    /** Make pindex the new tip, replacing only the entries above the fork point */
+    void SetTip(CBlockIndex* pindex);
+
+    /** Returns the last block this chain has in common with the branch ending at pindex */
+    CBlockIndex* FindFork(CBlockIndex* pindex) const;
+};
 
+extern CChain chainActive;
 
 
 
@@ -1609,20 +1927,142 @@ public:
 
 
 
+/** Fee, size and priority of a memory pool transaction, worked out once when
+ * it is accepted so block assembly never has to fetch its inputs again.
+ */
+class CTxMemPoolEntry
+{
+public:
+    int64_t nFee;
+    unsigned int nTxSize;
+    unsigned int nSigOps;       // legacy and P2SH
+    int64_t nTime;              // when it entered the pool
+    double dPriority;           // at nHeight, counting inputs in the chain only
+    int nHeight;
+    int64_t nChainInputValue;   // value of the inputs in the chain
+    size_t nUsageSize;          // memory taken by the transaction and the pool's references to it
+
+    // This transaction together with all its ancestors in the pool
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+
+    // This transaction together with all its descendants in the pool
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+
+    CTxMemPoolEntry()
+    {
+        nFee = 0;
+        nTxSize = 0;
+        nSigOps = 0;
+        nTime = 0;
+        dPriority = 0;
+        nHeight = 0;
+        nChainInputValue = 0;
+        nUsageSize = 0;
+        nCountWithAncestors = 0;
+        nSizeWithAncestors = 0;
+        nFeesWithAncestors = 0;
+        nCountWithDescendants = 0;
+        nSizeWithDescendants = 0;
+        nFeesWithDescendants = 0;
+    }
+
+    CTxMemPoolEntry(int64_t nFeeIn, unsigned int nTxSizeIn, unsigned int nSigOpsIn, int64_t nTimeIn,
+                    double dPriorityIn, int nHeightIn, int64_t nChainInputValueIn)
+    {
+        nFee = nFeeIn;
+        nTxSize = nTxSizeIn;
+        nSigOps = nSigOpsIn;
+        nTime = nTimeIn;
+        dPriority = dPriorityIn;
+        nHeight = nHeightIn;
+        nChainInputValue = nChainInputValueIn;
+        nUsageSize = 0;
+        nCountWithAncestors = 1;
+        nSizeWithAncestors = nTxSize;
+        nFeesWithAncestors = nFee;
+        nCountWithDescendants = 1;
+        nSizeWithDescendants = nTxSize;
+        nFeesWithDescendants = nFee;
+    }
+
+    double GetFeePerKb() const
+    {
+        return (double)nFee * 1000 / nTxSize;
+    }
+
+    double GetAncestorFeePerKb() const
+    {
+        return (double)nFeesWithAncestors * 1000 / nSizeWithAncestors;
+    }
+
+    // Eviction score: a transaction is worth keeping if either it alone or
+    // the package of it and its descendants pays well
+    double GetDescendantScore() const
+    {
+        return std::max(GetFeePerKb(), (double)nFeesWithDescendants * 1000 / nSizeWithDescendants);
+    }
+
+    // Priority keeps growing as the inputs in the chain get older
+    double GetPriority(int nCurrentHeight) const
+    {
+        return dPriority + (double)nChainInputValue * (nCurrentHeight - nHeight) / nTxSize;
+    }
+};
+
 class CTxMemPool
 {
 public:
+    typedef std::set<std::pair<double, uint256> > ScoreIndex;
+    typedef std::set<std::pair<int64_t, uint256> > TimeIndex;
+
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+    // Entry data and sorted indexes over mapTx, best last
+    std::map<uint256, CTxMemPoolEntry> mapInfo;
+    ScoreIndex setByDescendantScore;
+    ScoreIndex setByAncestorScore;
+    ScoreIndex setByPriority;   // as of nPriorityHeight
+    TimeIndex setByTime;
+    int nPriorityHeight;
+    size_t nTotalUsage;
+
+    // Raised past the fee rate of what TrimToSize evicts, decaying after
+    double dRollingMinFeePerKb;
+    int64_t nLastRollingFeeUpdate;
+
+    CTxMemPool()
+    {
+        nPriorityHeight = 0;
+        nTotalUsage = 0;
+        dRollingMinFeePerKb = 0;
+        nLastRollingFeeUpdate = 0;
+    }
+
     bool accept(CTxDB& txdb, CTransaction &tx,
                 bool* pfMissingInputs);
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
-    bool remove(const CTransaction &tx, bool fRecursive = false);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entry);
+    bool remove(const CTransaction &tx, bool fRecursive = false, std::vector<uint256>* pvRemoved = NULL);
     bool removeConflicts(const CTransaction &tx);
+    bool removeSpends(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    void UpdateMinedParent(const CTransaction& tx, int nMinedHeight);
+    void UpdatePriorities(int nHeight);
+    void TrimToSize(size_t nSizeLimit, std::vector<uint256>& vEvicted);
+    double GetMinFeePerKb(size_t nSizeLimit);
+
+    // Approximate heap memory used by the pool
+    size_t DynamicMemoryUsage() const
+    {
+        LOCK(cs);
+        return nTotalUsage;
+    }
 
     unsigned long size() const
     {
@@ -1644,6 +2084,10 @@ public:
         result = i->second;
         return true;
     }
+
+private:
+    void UpdateDescendants(const uint256& hash, int64_t nCount, int64_t nSize, int64_t nFees);
+    void UpdateAncestors(const uint256& hash, int64_t nCount, int64_t nSize, int64_t nFees);
 };
 
 extern CTxMemPool mempool;
@@ -55,58 +55,65 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+ 
+// Transactions picked for the last block of each kind, reused for as long
+// as neither the tip nor the memory pool has changed. Guarded by cs_main.
+struct CBlockTemplateCache
 {
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdated;
+    int64_t nTime;
+    vector<CTransaction> vtx;
+    int64_t nFees;
+    int64_t nFeePool;
+    uint64_t nBlockSize;
+
+    CBlockTemplateCache()
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().substr(0,10).c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
+        pindexPrev = NULL;
+        nTransactionsUpdated = 0;
+        nTime = 0;
+        nFees = 0;
+        nFeePool = 0;
+        nBlockSize = 0;
     }
 };
+static CBlockTemplateCache blockTemplateCache[2]; // proof-of-work, proof-of-stake
 
+// Collect the ancestors of hash in the memory pool that aren't in the block
+// yet, followed by hash itself, parents always ahead of their children
+static void GetBlockPackage(const uint256& hash, const set<uint256>& setIncluded, set<uint256>& setVisited, vector<uint256>& vPackage)
+{
+    if (setIncluded.count(hash) || !setVisited.insert(hash).second)
+        return;
+    map<uint256, CTransaction>::const_iterator mi = mempool.mapTx.find(hash);
+    if (mi == mempool.mapTx.end())
+        return;
+    BOOST_FOREACH(const CTxIn& txin, mi->second.vin)
+        if (mempool.mapTx.count(txin.prevout.hash))
+            GetBlockPackage(txin.prevout.hash, setIncluded, setVisited, vPackage);
+    vPackage.push_back(hash);
+}
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
- 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
-class TxPriorityCompare
+// Inputs of a pool transaction that aren't in the pool must be unspent in
+// the chain; a block spending anything else would be rejected
+static bool HaveChainInputs(CTxDB& txdb, const CTransaction& tx)
 {
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        if (mempool.mapTx.count(txin.prevout.hash))
+            continue;
+        CTxIndex txindex;
+        if (!txdb.ReadTxIndex(txin.prevout.hash, txindex))
+            return false;
+        if (txin.prevout.n >= txindex.vSpent.size() || !txindex.vSpent[txin.prevout.n].IsNull())
+            return false;
     }
-};
+    return true;
+}
 
 // CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees, int64_t* pPoolFees)
@@ -215,201 +222,141 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees, int
     int64_t nFeePool = 0;
     {
         LOCK2(cs_main, mempool.cs);
-        CTxDB txdb("r");
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        // Reuse the last selection unless the tip or the pool moved on, or
+        // it's old enough that transactions held back by their timestamp
+        // may have become eligible
+        CBlockTemplateCache& cache = blockTemplateCache[fProofOfStake ? 1 : 0];
+        if (cache.pindexPrev != pindexPrev || cache.nTransactionsUpdated != nTransactionsUpdated ||
+            GetTime() - cache.nTime > BLOCK_TEMPLATE_MAX_AGE)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            mempool.UpdatePriorities(nHeight);
+
+            // Fees, sizes and sigops of a pool transaction were worked out when
+            // it was accepted, so the block is put together from the pool
+            // indexes; only a transaction's chain inputs are looked up again
+            // in case a reorganization took them away
+            CTxDB txdb("r");
+            uint64_t nBlockSize = 1000;
+            int nBlockSigOps = 100;
+            set<uint256> setIncluded;
+            set<uint256> setFailed;
+
+            // Fill the high-priority area first, then take whole packages of a
+            // transaction and its unconfirmed ancestors by package fee rate
+            for (int nPass = (nBlockPrioritySize > 0 ? 0 : 1); nPass < 2; nPass++)
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                bool fSortedByFee = (nPass == 1);
+                const CTxMemPool::ScoreIndex& index = fSortedByFee ? mempool.setByAncestorScore : mempool.setByPriority;
+                for (CTxMemPool::ScoreIndex::const_reverse_iterator it = index.rbegin(); it != index.rend(); ++it)
                 {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
+                    if (!fSortedByFee && (nBlockSize >= nBlockPrioritySize || it->first < COIN * 144 / 250))
+                        break;
+                    if (nBlockSize + 100 >= nBlockMaxSize)
                         break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-                continue;
-
-            // Transaction fee
-            int64_t nMinFee = tx.GetMinFee(nBlockSize, GMF_BLOCK);
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
 
-            if (tx.vout[0].scriptPubKey.IsVotePoll())
-            {
-                if (nTxFees < VOTE_FEE)
-                    continue;
+                    const uint256& hashRoot = it->second;
+                    if (setIncluded.count(hashRoot) || setFailed.count(hashRoot))
+                        continue;
 
-                nTxFees -= VOTE_FEE;
-                nFeePool += VOTE_FEE;
-            }
-            if (nTxFees < nMinFee)
-                continue;
+                    set<uint256> setVisited;
+                    vector<uint256> vPackage;
+                    GetBlockPackage(hashRoot, setIncluded, setVisited, vPackage);
 
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+                    uint64_t nPackageSize = 0;
+                    int64_t nPackageFees = 0;
+                    int64_t nPackageFeePool = 0;
+                    unsigned int nPackageSigOps = 0;
+                    bool fOk = true;
+                    BOOST_FOREACH(const uint256& hash, vPackage)
+                    {
+                        const CTransaction& tx = mempool.mapTx[hash];
+                        const CTxMemPoolEntry& entry = mempool.mapInfo[hash];
+                        if (setFailed.count(hash) || tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
+                            fOk = false;
+                        else if (!HaveChainInputs(txdb, tx))
+                            fOk = false;
+
+                        // Timestamp limit
+                        else if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
+                            fOk = false;
+
+                        // Transaction fee
+                        int64_t nTxFees = entry.nFee;
+                        if (fOk && tx.vout[0].scriptPubKey.IsVotePoll())
+                        {
+                            if (nTxFees < VOTE_FEE)
+                                fOk = false;
+                            nTxFees -= VOTE_FEE;
+                            nPackageFeePool += VOTE_FEE;
+                        }
+                        if (fOk && nTxFees < tx.GetMinFee(nBlockSize + nPackageSize, GMF_BLOCK))
+                            fOk = false;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
+                        if (!fOk)
+                        {
+                            setFailed.insert(hash);
+                            break;
+                        }
+                        nPackageSize += entry.nTxSize;
+                        nPackageFees += nTxFees;
+                        nPackageSigOps += entry.nSigOps;
+                    }
+                    if (!fOk)
+                    {
+                        setFailed.insert(hashRoot);
+                        continue;
+                    }
 
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+                    // Size and sigop limits; a smaller package may still fit
+                    if (nBlockSize + nPackageSize >= nBlockMaxSize || nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+                        continue;
 
-            if (fDebug && GetBoolArg("-printpriority"))
-            {
-                printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
-            }
+                    // Skip free transactions if we're past the minimum block size:
+                    double dFeePerKb = double(nPackageFees) / (double(nPackageSize) / 1000.0);
+                    if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nPackageSize >= nBlockMinSize))
+                        continue;
 
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
+                    // Added
+                    BOOST_FOREACH(const uint256& hash, vPackage)
                     {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
+                        pblock->vtx.push_back(mempool.mapTx[hash]);
+                        setIncluded.insert(hash);
+
+                        if (fDebug && GetBoolArg("-printpriority"))
                         {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                            const CTxMemPoolEntry& entry = mempool.mapInfo[hash];
+                            printf("priority %.1f feeperkb %.1f txid %s\n",
+                                   entry.GetPriority(nHeight), entry.GetFeePerKb(), hash.ToString().c_str());
                         }
                     }
+                    nBlockSize += nPackageSize;
+                    nBlockSigOps += nPackageSigOps;
+                    nFees += nPackageFees;
+                    nFeePool += nPackageFeePool;
                 }
             }
-        }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
+            if (fDebug && GetBoolArg("-printpriority"))
+                printf("CreateNewBlock(): total size %" PRIu64"\n", nBlockSize);
+
+            cache.vtx.assign(pblock->vtx.begin() + 1, pblock->vtx.end());
+            cache.nFees = nFees;
+            cache.nFeePool = nFeePool;
+            cache.nBlockSize = nBlockSize;
+            cache.pindexPrev = pindexPrev;
+            cache.nTransactionsUpdated = nTransactionsUpdated;
+            cache.nTime = GetTime();
+        }
+        else
+        {
+            pblock->vtx.insert(pblock->vtx.end(), cache.vtx.begin(), cache.vtx.end());
+            nFees = cache.nFees;
+            nFeePool = cache.nFeePool;
+        }
 
-        if (fDebug && GetBoolArg("-printpriority"))
-            printf("CreateNewBlock(): total size %" PRIu64"\n", nBlockSize);
+        nLastBlockTx = cache.vtx.size();
+        nLastBlockSize = cache.nBlockSize;
 
         if (!fProofOfStake)
         {
@@ -9,6 +9,9 @@
 #include "main.h"
 #include "wallet.h"
 
+/** Seconds a block template's transaction selection is reused for while the tip and memory pool stay the same */
+static const int BLOCK_TEMPLATE_MAX_AGE = 60;
+
 /* Generate a new block, without valid proof-of-work */
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false, int64_t* pFees = 0, int64_t* pPoolFees = 0);
 
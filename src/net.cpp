@@ -7,12 +7,20 @@
 #include "net.h"
 #include "init.h"
 #include "addrman.h"
+#include "checkqueue.h"
 #include "ui_interface.h"
 
+#include <math.h>
+
 #ifdef WIN32
 #include <string.h>
 #endif
 
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -26,6 +34,7 @@ using namespace boost;
 static const int MAX_OUTBOUND_CONNECTIONS = 64;
 
 void ThreadMessageHandler2(void* parg);
+void ThreadMessageHandlerWorker(void* parg);
 void ThreadSocketHandler2(void* parg);
 void ThreadOpenConnections2(void* parg);
 void ThreadOpenAddedConnections2(void* parg);
@@ -57,10 +66,47 @@ uint64_t nLocalHostNonce = 0;
 boost::array<int, THREAD_MAX> vnThreadsRunning;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+#endif
+
+// The message handler sleeps on condMessageHandler until the socket thread
+// has complete messages for it or new inventory is queued for sending
+static boost::mutex mutexMessageHandler;
+static boost::condition_variable condMessageHandler;
+static bool fMessageHandlerWake = false;
+static int nMessageHandlerThreads = 1;
+
+static void HandleNodeMessages(CNode* pnode, bool fSendTrickle);
+
+// One peer's turn in a message handler pass, run by the handler pool
+class CMessageHandlerTask
+{
+private:
+    CNode* pnode;
+    bool fSendTrickle;
+
+public:
+    CMessageHandlerTask() : pnode(NULL), fSendTrickle(false) {}
+    CMessageHandlerTask(CNode* pnodeIn, bool fSendTrickleIn) : pnode(pnodeIn), fSendTrickle(fSendTrickleIn) {}
+
+    bool operator()()
+    {
+        HandleNodeMessages(pnode, fSendTrickle);
+        return true;
+    }
+
+    void swap(CMessageHandlerTask& task)
+    {
+        std::swap(pnode, task.pnode);
+        std::swap(fSendTrickle, task.fSendTrickle);
+    }
+};
+static CCheckQueue<CMessageHandlerTask> messageHandlerQueue(1);
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
@@ -492,6 +538,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        SocketEventsAdd(pnode);
 
         {
             LOCK(cs_vNodes);
@@ -624,6 +671,14 @@ void CNode::copyStats(CNodeStats &stats)
     // Raw ping time is in microseconds, but show it to user as whole seconds (Bitcoin users should be well used to small numbers with many decimal places by now :)
     stats.dPingTime = (((double)nPingUsecTime) / 1e6);
     stats.dPingWait = (((double)nPingUsecWait) / 1e6);
+
+    {
+        LOCK(cs_inventory);
+        stats.nInvSent = nInvSent;
+        stats.nInvRecv = nInvRecv;
+        stats.nInvQueued = vInventoryToSend.size();
+        stats.dInvDelay = nInvSent ? ((double)nInvDelay / nInvSent) / 1e6 : 0.0;
+    }
 }
 #undef X
 
@@ -734,30 +789,83 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    ssMsg.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    ssMsg << hdr;
+    ssMsg += ssPayload;
+
+    boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+    ssMsg.GetAndClear(*pdata);
+    return pdata;
+}
+
+// Time of the next event in a Poisson process with the given average
+// interval, so send times can't be predicted from earlier ones
+int64_t PoissonNextSend(int64_t nNow, int nAverageIntervalSeconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * nAverageIntervalSeconds * -1000000.0 + 0.5);
+}
+
+// Largest number of queued messages handed to the kernel in one call
+static const int SEND_IOV_MAX = 64;
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
-
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+    while (!pnode->vSendMsg.empty()) {
+#ifdef WIN32
+        const CSerializeData &data = *pnode->vSendMsg.front();
         assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        size_t nTrying = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nTrying, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather as much of the queue as possible into one sendmsg
+        struct iovec iov[SEND_IOV_MAX];
+        int nIov = 0;
+        size_t nTrying = 0;
+        for (std::deque<CSharedMessage>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < SEND_IOV_MAX; ++it, ++nIov)
+        {
+            const CSerializeData &data = **it;
+            size_t nOffset = (nIov == 0 ? pnode->nSendOffset : 0);
+            assert(data.size() > nOffset);
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+            nTrying += iov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
-            pnode->nSendOffset += nBytes;
-            
             pnode->nSendBytes += nBytes;
             pnode->RecordBytesSent(nBytes);
-            
-            if (pnode->nSendOffset == data.size()) {
+
+            // Drop the messages that went out completely
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = pnode->vSendMsg.front()->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                it++;
-            } else {
-                // could not send full message; stop sending more
-                break;
+                pnode->nSendSize -= pnode->vSendMsg.front()->size();
+                pnode->vSendMsg.pop_front();
             }
+
+            // could not send everything; the socket buffer is full
+            if ((size_t)nBytes < nTrying)
+                break;
         } else {
             if (nBytes < 0) {
                 // error
@@ -773,11 +881,190 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+    // Only wait for write readiness while something is left to send
+    if (pnode->fWantWrite != !pnode->vSendMsg.empty())
+    {
+        pnode->fWantWrite = !pnode->vSendMsg.empty();
+        SocketEventsModify(pnode);
+    }
+}
+
+#ifdef USE_EPOLL
+static void SocketEventsControl(CNode* pnode, int nOp)
+{
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (pnode->fWantWrite ? (uint32_t)EPOLLOUT : 0u);
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, nOp, pnode->hSocket, &event) == -1)
+        printf("epoll_ctl for %s failed, error %d\n", pnode->addrName.c_str(), errno);
+}
+#endif
+
+// Nodes are registered once, edge-triggered; closing the socket removes
+// them from the poller again
+void SocketEventsAdd(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    SocketEventsControl(pnode, EPOLL_CTL_ADD);
+#endif
+}
+
+// requires LOCK(cs_vSend)
+void SocketEventsModify(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    SocketEventsControl(pnode, EPOLL_CTL_MOD);
+#endif
+}
+
+static bool SocketEventsInit()
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+        return true;
+    hEpoll = epoll_create(1);
+    if (hEpoll == -1)
+    {
+        printf("SocketEventsInit() : epoll_create failed, error %d, using select\n", errno);
+        return false;
+    }
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+    {
+        // Listen sockets stay level-triggered and are told apart by a NULL node
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == -1)
+            printf("SocketEventsInit() : epoll_ctl for listen socket failed, error %d\n", errno);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Wait for socket readiness and mark it on the nodes; returns whether a
+// listen socket has connections waiting to be accepted
+static bool SocketEventsWait(const vector<CNode*>& vNodesCopy)
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+    {
+        // Come back quickly for nodes that still have unread data, the
+        // edge for it has already been consumed
+        int nTimeout = 200;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fRecvReady || pnode->fSendReady)
+                nTimeout = 10;
+
+        struct epoll_event events[256];
+        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+        int nEvents = epoll_wait(hEpoll, events, 256, nTimeout);
+        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+        if (nEvents == -1 && errno != EINTR)
+        {
+            printf("socket epoll_wait error %d\n", errno);
+            MilliSleep(nTimeout);
+        }
+
+        // A node pointer stays valid here: nodes are only deleted by this
+        // thread, and closing the socket drops any pending event
+        bool fListenReady = false;
+        for (int i = 0; i < nEvents; i++)
+        {
+            CNode* pnode = (CNode*)events[i].data.ptr;
+            if (pnode == NULL)
+            {
+                fListenReady = true;
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                pnode->fRecvReady = true;
+            if (events[i].events & EPOLLOUT)
+                pnode->fSendReady = true;
+        }
+        return fListenReady;
+    }
+#endif
+
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket);
+        have_fds = true;
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        pnode->fRecvReady = false;
+        pnode->fSendReady = false;
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend) {
+                // do not read, if draining write queue
+                if (!pnode->vSendMsg.empty())
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                else
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+                FD_SET(pnode->hSocket, &fdsetError);
+                hSocketMax = max(hSocketMax, pnode->hSocket);
+                have_fds = true;
+            }
+        }
+    }
+
+    vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+    if (fShutdown)
+        return false;
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            printf("socket select error %d\n", nErr);
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
+
+    bool fListenReady = false;
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+            fListenReady = true;
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        pnode->fRecvReady = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+        pnode->fSendReady = FD_ISSET(pnode->hSocket, &fdsetSend);
+    }
+    return fListenReady;
 }
 
 void ThreadSocketHandler(void* parg)
@@ -855,7 +1142,14 @@ void ThreadSocketHandler2(void* parg)
                             {
                                 TRY_LOCK(pnode->cs_inventory, lockInv);
                                 if (lockInv)
-                                    fDelete = true;
+                                {
+                                    TRY_LOCK(cs_main, lockMain);
+                                    if (lockMain)
+                                    {
+                                        FinalizeNode(pnode);
+                                        fDelete = true;
+                                    }
+                                }
                             }
                         }
                     }
@@ -877,72 +1171,23 @@ void ThreadSocketHandler2(void* parg)
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend) {
-                        // do not read, if draining write queue
-                        if (!pnode->vSendMsg.empty())
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                        else
-                            FD_SET(pnode->hSocket, &fdsetRecv);
-                        FD_SET(pnode->hSocket, &fdsetError);
-                        hSocketMax = max(hSocketMax, pnode->hSocket);
-                        have_fds = true;
-                    }
-                }
-            }
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
-
-        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+        bool fListenReady = SocketEventsWait(vNodesCopy);
         if (fShutdown)
             return;
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
 
 
         //
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET && fListenReady)
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -981,6 +1226,7 @@ void ThreadSocketHandler2(void* parg)
                 printf("accepted connection %s\n", addr.ToString().c_str());
                 CNode* pnode = new CNode(hSocket, addr, "", true);
                 pnode->AddRef();
+                SocketEventsAdd(pnode);
                 {
                     LOCK(cs_vNodes);
                     vNodes.push_back(pnode);
@@ -992,13 +1238,6 @@ void ThreadSocketHandler2(void* parg)
         //
         // Service each socket
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             if (fShutdown)
@@ -1009,17 +1248,23 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            // Hold off reading while the peer isn't taking our replies
+            if (pnode->fRecvReady && pnode->nSendSize <= SendBufferSize())
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
-                    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
-                        if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
+                    // Drain what the edge announced, a few buffers at a time
+                    // so one busy peer can't starve the others
+                    for (int nReads = 0; pnode->fRecvReady && nReads < 4; nReads++)
+                    {
+                        if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
+                            if (!pnode->fDisconnect)
+                                printf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
+                            pnode->CloseSocketDisconnect();
+                            break;
+                        }
+
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
@@ -1030,6 +1275,8 @@ void ThreadSocketHandler2(void* parg)
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())
+                                WakeMessageHandler();
                         }
                         else if (nBytes == 0)
                         {
@@ -1042,13 +1289,17 @@ void ThreadSocketHandler2(void* parg)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fRecvReady = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     printf("socket recv error %d\n", nErr);
                                 pnode->CloseSocketDisconnect();
                             }
                         }
+                        if (pnode->hSocket == INVALID_SOCKET)
+                            pnode->fRecvReady = false;
                     }
                 }
             }
@@ -1058,11 +1309,14 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSendReady)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
+                {
+                    pnode->fSendReady = false;
                     SocketSendData(pnode);
+                }
             }
 
             //
@@ -1753,6 +2007,57 @@ void ThreadMessageHandler(void* parg)
     printf("ThreadMessageHandler exited\n");
 }
 
+void ThreadMessageHandlerWorker(void* parg)
+{
+    RenameThread("pinkcoin-msgwork");
+
+    try
+    {
+        vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
+        messageHandlerQueue.Thread();
+        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
+        PrintException(&e, "ThreadMessageHandlerWorker()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
+        PrintException(NULL, "ThreadMessageHandlerWorker()");
+    }
+}
+
+void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMessageHandler);
+        fMessageHandlerWake = true;
+    }
+    condMessageHandler.notify_one();
+}
+
+static void HandleNodeMessages(CNode* pnode, bool fSendTrickle)
+{
+    if (pnode->fDisconnect || fShutdown)
+        return;
+
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
+            if (!ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
+    }
+    if (fShutdown)
+        return;
+
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            SendMessages(pnode, fSendTrickle);
+    }
+}
+
 void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
@@ -1767,34 +2072,27 @@ void ThreadMessageHandler2(void* parg)
                 pnode->AddRef();
         }
 
-        // Poll the connected nodes for messages
+        // Poll the connected nodes for messages, spreading the peers over
+        // the handler pool if there is one; each peer is only ever handled
+        // by one thread at a time and cs_main still orders block processing
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            if (pnode->fDisconnect)
-                continue;
-
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                    if (!ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-            }
-            if (fShutdown)
-                return;
-
-            // Send messages
+            CCheckQueueControl<CMessageHandlerTask> control(nMessageHandlerThreads > 1 ? &messageHandlerQueue : NULL);
+            vector<CMessageHandlerTask> vTasks;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                if (nMessageHandlerThreads > 1)
+                    vTasks.push_back(CMessageHandlerTask(pnode, pnode == pnodeTrickle));
+                else
+                    HandleNodeMessages(pnode, pnode == pnodeTrickle);
             }
-            if (fShutdown)
-                return;
+            control.Add(vTasks);
+            control.Wait();
         }
+        if (fShutdown)
+            return;
 
         {
             LOCK(cs_vNodes);
@@ -1802,11 +2100,17 @@ void ThreadMessageHandler2(void* parg)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
+        // Wait until the socket thread hands us new messages, or at most
+        // the interval pings and trickled inventory need.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        MilliSleep(100);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            if (!fMessageHandlerWake && !fShutdown)
+                condMessageHandler.timed_wait(lock, boost::posix_time::milliseconds(MESSAGE_HANDLER_INTERVAL));
+            fMessageHandlerWake = false;
+        }
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1993,6 +2297,9 @@ void StartNode(void* parg)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+    // Poll sockets with epoll where available, before any node connects
+    SocketEventsInit();
+
     Discover();
 
     //
@@ -2024,6 +2331,10 @@ void StartNode(void* parg)
     // Process messages
     if (!NewThread(ThreadMessageHandler, NULL))
         printf("Error: NewThread(ThreadMessageHandler) failed\n");
+    nMessageHandlerThreads = max(1, min((int)GetArg("-msghandlerthreads", 1), MAX_MSGHANDLER_THREADS));
+    for (int i = 1; i < nMessageHandlerThreads; i++)
+        if (!NewThread(ThreadMessageHandlerWorker, NULL))
+            printf("Error: NewThread(ThreadMessageHandlerWorker) failed\n");
 
     // Dump network addresses
     if (!NewThread(ThreadDumpAddress, NULL))
@@ -2042,6 +2353,8 @@ bool StopNode()
     printf("StopNode()\n");
     fShutdown = true;
     nTransactionsUpdated++;
+    messageHandlerQueue.Quit();
+    WakeMessageHandler();
     int64_t nStart = GetTime();
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
@@ -2120,8 +2433,9 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // framed once so every peer asking for it shares the same buffer
+        mapRelay.insert(std::make_pair(inv, MakeSharedMessage(inv.GetCommand(), ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -15,6 +16,7 @@
 #endif
 
 #include "mruset.h"
+#include "bloom.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
@@ -23,10 +25,22 @@ class CNode;
 class CBlockIndex;
 extern int nBestHeight;
 
+/** A complete network message, header included, that is never modified once
+ *  built, so one copy can sit in the send queues of any number of peers */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
 /** Time between pings automatically sent out for latency probing and keepalive (in seconds). */
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Longest the message handler sleeps without new messages (in milliseconds). */
+static const int MESSAGE_HANDLER_INTERVAL = 100;
+/** Maximum number of threads processing peer messages. */
+static const int MAX_MSGHANDLER_THREADS = 8;
+/** Average delay between transaction inventory sends to a peer (in seconds); outbound peers get half of it. */
+static const int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Number of recent inventory hashes remembered per peer. */
+static const unsigned int INVENTORY_KNOWN_ELEMENTS = 20000;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -45,6 +59,11 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(void* parg);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+void SocketEventsAdd(CNode *pnode);
+void SocketEventsModify(CNode *pnode);
+void WakeMessageHandler();
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload);
+int64_t PoissonNextSend(int64_t nNow, int nAverageIntervalSeconds);
 
 enum
 {
@@ -104,7 +123,7 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
@@ -132,6 +151,10 @@ public:
     int nMisbehavior;
     double dPingTime;
     double dPingWait;
+    uint64_t nInvSent;
+    uint64_t nInvRecv;
+    uint64_t nInvQueued;
+    double dInvDelay;
 };
 
 
@@ -189,6 +212,7 @@ public:
         nWakeCounter    = 0;
         nPeerId         = 0;
         fEnabled        = false;
+        fSketch         = false;
     };
     
     ~SecMsgNode() {};
@@ -199,6 +223,7 @@ public:
     uint32_t                    nWakeCounter;
     uint32_t                    nPeerId;
     bool                        fEnabled;
+    bool                        fSketch;        // peer reconciles buckets by sketch
     
 };
 
@@ -212,13 +237,18 @@ public:
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     int nRecvVersion;
 
+    // readiness reported by the socket handler's poller, socket thread only
+    bool fRecvReady;
+    bool fSendReady;
+    bool fWantWrite; // write readiness requested, guarded by cs_vSend
+
     int64_t nLastSend;
     int64_t nLastRecv;
     
@@ -262,10 +292,28 @@ public:
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
-    std::vector<CInv> vInventoryToSend;
+    CRollingBloomFilter filterInventoryKnown;
+    std::vector<std::pair<CInv, int64_t> > vInventoryToSend; // with the time queued, in usec
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
+    int64_t nNextInvSend;
+
+    // inventory relay statistics
+    uint64_t nInvSent;
+    uint64_t nInvRecv;
+    int64_t nInvDelay; // usec the sent items spent queued, in total
+
+    // headers-first block download, guarded by cs_main
+    bool fSyncStarted;
+    bool fHeadersMore;
+    int nHeadersAwaitHeight;
+    int nSyncHeight;
+    int64_t nHeadersRequestTime;
+    int64_t nDownloadBackoffUntil;
+    std::map<uint256, int64_t> mapBlocksInFlight;
+
+    // peer asked for new blocks as cmpctblock instead of inv
+    bool fSendCompact;
 
     SecMsgNode smsgData;
 
@@ -279,11 +327,14 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000), filterInventoryKnown(INVENTORY_KNOWN_ELEMENTS, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
         nRecvVersion = INIT_PROTO_VERSION;
+        fRecvReady = false;
+        fSendReady = false;
+        fWantWrite = false;
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
@@ -310,11 +361,21 @@ public:
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        nNextInvSend = 0;
+        nInvSent = 0;
+        nInvRecv = 0;
+        nInvDelay = 0;
         nPingNonceSent = 0;
         nPingUsecStart = 0;
         nPingUsecTime = 0;
         fPingQueued = false;
+        fSyncStarted = false;
+        fHeadersMore = false;
+        nHeadersAwaitHeight = 0;
+        nSyncHeight = -1;
+        nHeadersRequestTime = 0;
+        nDownloadBackoffUntil = 0;
+        fSendCompact = false;
 
         // Be shy and don't send version until we hear
         if (hSocket != INVALID_SOCKET && !fInbound)
@@ -400,17 +461,24 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
     void PushInventory(const CInv& inv)
     {
+        bool fQueued = false;
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (!filterInventoryKnown.contains(inv.hash))
+            {
+                vInventoryToSend.push_back(std::make_pair(inv, GetTimeMicros()));
+                fQueued = true;
+            }
         }
+        // Transactions wait for the peer's next inventory send anyway
+        if (fQueued && inv.type != MSG_TX)
+            WakeMessageHandler();
     }
 
     void AskFor(const CInv& inv)
@@ -481,15 +549,31 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+        ssSend.GetAndClear(*pdata);
+        QueueSendMessage(pdata);
+
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
+
+    // requires LOCK(cs_vSend)
+    void QueueSendMessage(const CSharedMessage& pmsg)
+    {
+        vSendMsg.push_back(pmsg);
+        nSendSize += pmsg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1U)
             SocketSendData(this);
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    // Queue a message built once with MakeSharedMessage, without copying it
+    void PushSharedMessage(const CSharedMessage& pmsg)
+    {
+        LOCK(cs_vSend);
+        if (fDebug)
+            printf("sending: shared message (%" PRIszu " bytes)\n", pmsg->size());
+        QueueSendMessage(pmsg);
     }
 
     void PushVersion();
@@ -213,6 +213,31 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0U)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns details on the transaction memory pool.");
+
+    uint64_t nBytes = 0;
+    size_t nSize, nUsage;
+    {
+        LOCK(mempool.cs);
+        nSize = mempool.mapTx.size();
+        nUsage = mempool.nTotalUsage;
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapInfo.begin(); mi != mempool.mapInfo.end(); ++mi)
+            nBytes += mi->second.nTxSize;
+    }
+
+    Object obj;
+    obj.push_back(Pair("size", (uint64_t)nSize));
+    obj.push_back(Pair("bytes", nBytes));
+    obj.push_back(Pair("usage", (uint64_t)nUsage));
+    obj.push_back(Pair("maxmempool", nMaxMempoolSize));
+    return obj;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1U)
@@ -262,13 +287,7 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1U ? params[1].get_bool() : false);
@@ -305,3 +324,22 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0U)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns the size and hit rate of the signature cache.");
+
+    uint64_t nEntries, nMaxEntries, nLookups, nHits;
+    GetSignatureCacheStats(nEntries, nMaxEntries, nLookups, nHits);
+
+    Object result;
+    result.push_back(Pair("entries", (uint64_t)nEntries));
+    result.push_back(Pair("maxentries", (uint64_t)nMaxEntries));
+    result.push_back(Pair("lookups", (uint64_t)nLookups));
+    result.push_back(Pair("hits", (uint64_t)nHits));
+    result.push_back(Pair("hitrate", nLookups ? (double)nHits / nLookups : 0.0));
+    return result;
+}
@@ -61,6 +61,15 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("inbound", stats.fInbound));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        obj.push_back(Pair("bytessent", (uint64_t)stats.nSendBytes));
+        obj.push_back(Pair("bytesrecv", (uint64_t)stats.nRecvBytes));
+        obj.push_back(Pair("pingtime", stats.dPingTime));
+        if (stats.dPingWait > 0.0)
+            obj.push_back(Pair("pingwait", stats.dPingWait));
+        obj.push_back(Pair("invsent", (uint64_t)stats.nInvSent));
+        obj.push_back(Pair("invrecv", (uint64_t)stats.nInvRecv));
+        obj.push_back(Pair("invqueued", (uint64_t)stats.nInvQueued));
+        obj.push_back(Pair("invdelay", stats.dInvDelay));
 
         ret.push_back(obj);
     }
@@ -68,6 +77,37 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getnetworkinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0U)
+        throw runtime_error(
+            "getnetworkinfo\n"
+            "Returns an object containing peer-to-peer networking state info.");
+
+    uint64_t nEntries, nBytes, nLookups, nHits;
+    GetBlockServeCacheStats(nEntries, nBytes, nLookups, nHits);
+
+    Object blockcache;
+    blockcache.push_back(Pair("entries", (uint64_t)nEntries));
+    blockcache.push_back(Pair("bytes", (uint64_t)nBytes));
+    blockcache.push_back(Pair("maxbytes", (int64_t)nBlockServeCacheSize));
+    blockcache.push_back(Pair("lookups", (uint64_t)nLookups));
+    blockcache.push_back(Pair("hits", (uint64_t)nHits));
+    blockcache.push_back(Pair("hitrate", nLookups ? (double)nHits / nLookups : 0.0));
+
+    Object obj;
+    obj.push_back(Pair("version",         FormatFullVersion()));
+    obj.push_back(Pair("protocolversion", (int)PROTOCOL_VERSION));
+    obj.push_back(Pair("localservices",   strprintf("%08" PRIx64, nLocalServices)));
+    obj.push_back(Pair("timeoffset",      (int64_t)GetTimeOffset()));
+    {
+        LOCK(cs_vNodes);
+        obj.push_back(Pair("connections", (int)vNodes.size()));
+    }
+    obj.push_back(Pair("blockcache",      blockcache));
+    return obj;
+}
+
 Value getnodes(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0U)
@@ -346,22 +346,60 @@ Value smsglocalkeys(const Array& params, bool fHelp)
 
 Value smsgscanchain(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0U)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "smsgscanchain \n"
-            "Look for public keys in the block chain.");
+            "smsgscanchain [start|rescan|stop|status]\n"
+            "Look for public keys in the block chain, in the background.\n"
+            "start: continue from the height the last scan reached (default).\n"
+            "rescan: scan again from the genesis block.\n"
+            "stop: stop a running scan, it can be continued with start.\n"
+            "status: show the progress of the current or last scan.");
     
     if (!fSecMsgenabled)
         throw runtime_error("Secure messaging is disabled.");
     
+    std::string mode = "start";
+    if (params.size() > 0)
+        mode = params[0].get_str();
+    
     Object result;
-    if (!SecureMsgScanBlockChain())
+    if (mode == "start" || mode == "rescan")
     {
-        result.push_back(Pair("result", "Scan Chain Failed."));
+        if (!SecureMsgScanBlockChain(mode == "rescan"))
+            result.push_back(Pair("result", "Scan Chain Failed, a scan may already be running."));
+        else
+            result.push_back(Pair("result", "Scan Chain Started."));
     } else
+    if (mode == "stop")
     {
-        result.push_back(Pair("result", "Scan Chain Completed."));
-    }
+        SecureMsgStopScanBlockChain();
+        result.push_back(Pair("result", "Scan Chain Stopping."));
+    } else
+    if (mode == "status")
+    {
+        SecMsgScanChainStatus status;
+        SecureMsgGetScanChainStatus(status);
+        
+        result.push_back(Pair("running",        status.fRunning));
+        if (!status.fRunning && status.fFailed)
+            result.push_back(Pair("failed",     true));
+        result.push_back(Pair("startheight",    status.nStartHeight));
+        result.push_back(Pair("height",         status.nHeight));
+        result.push_back(Pair("targetheight",   status.nTargetHeight));
+        result.push_back(Pair("blocks",         (uint64_t)status.nBlocks));
+        result.push_back(Pair("transactions",   (uint64_t)status.nTransactions));
+        result.push_back(Pair("inputs",         (uint64_t)status.nInputs));
+        result.push_back(Pair("pubkeys",        (uint64_t)status.nPubkeys));
+        result.push_back(Pair("duplicates",     (uint64_t)status.nDuplicates));
+        result.push_back(Pair("starttime",      (int64_t)status.nStartTime));
+        result.push_back(Pair("ms",             (int64_t)status.nMillis));
+        result.push_back(Pair("blockspersec",   status.nMillis > 0 ? (double)status.nBlocks * 1000.0 / status.nMillis : 0.0));
+    } else
+    {
+        result.push_back(Pair("result", "Unknown Mode."));
+        result.push_back(Pair("expected", "smsgscanchain [start|rescan|stop|status]"));
+    };
+    
     return result;
 }
 
@@ -870,6 +908,7 @@ Value smsgbuckets(const Array& params, bool fHelp)
             {
                 std::string sFile = boost::lexical_cast<std::string>(it->first) + "_01.dat";
                 
+                SecureMsgCloseBucket(it->first);
                 try {
                     boost::filesystem::path fullPath = GetDataDir() / "smsgStore" / sFile;
                     boost::filesystem::remove(fullPath);
@@ -893,3 +932,63 @@ Value smsgbuckets(const Array& params, bool fHelp)
 
     return result;
 };
+
+Value smsgbenchpow(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2U)
+        throw runtime_error(
+            "smsgbenchpow [seconds=5] [payload bytes]\n"
+            "Measure the secure message proof of work hash rate, on one thread\n"
+            "and on all -smsgpowthreads threads.\n"
+            "The payload defaults to the largest possible message.");
+    
+    int64_t nSeconds = 5;
+    if (params.size() > 0U)
+        nSeconds = params[0].get_int64();
+    if (nSeconds < 1 || nSeconds > 60)
+        throw runtime_error("seconds must be between 1 and 60.");
+    
+    uint32_t nPayload = SMSG_MAX_MSG_WORST;
+    if (params.size() > 1U)
+    {
+        int64_t n = params[1].get_int64();
+        if (n < 0 || n > SMSG_MAX_MSG_WORST)
+            throw runtime_error("Invalid payload size.");
+        nPayload = n;
+    };
+    
+    double dSingle = SecureMsgBenchPow(nPayload, 1, nSeconds * 500);
+    double dAll = SecureMsgBenchPow(nPayload, nSmsgPowThreads, nSeconds * 500);
+    
+    // -- a hash meets the target with probability 1 / 2^17
+    Object result;
+    result.push_back(Pair("payload", (int)nPayload));
+    result.push_back(Pair("threads", nSmsgPowThreads));
+    result.push_back(Pair("hashespersec1thread", dSingle));
+    result.push_back(Pair("hashespersec", dAll));
+    result.push_back(Pair("secondspermessage", dAll > 0 ? 131072.0 / dAll : 0.0));
+    return result;
+}
+
+Value smsgscaninfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0U)
+        throw runtime_error(
+            "smsgscaninfo\n"
+            "Show trial decryption counters for received messages, since startup.");
+    
+    SecMsgScanStats stats;
+    SecureMsgGetScanStats(stats);
+    
+    Object result;
+    result.push_back(Pair("threads", nSmsgScanThreads));
+    result.push_back(Pair("messages", (uint64_t)stats.nMessages));
+    result.push_back(Pair("trials", (uint64_t)stats.nTrials));
+    result.push_back(Pair("macmatches", (uint64_t)stats.nMatches));
+    result.push_back(Pair("decrypts", (uint64_t)stats.nDecrypts));
+    result.push_back(Pair("received", (uint64_t)stats.nFound));
+    result.push_back(Pair("time_ms", (int64_t)stats.nMillis));
+    result.push_back(Pair("trialspersec", stats.nMillis > 0 ? stats.nTrials * 1000.0 / stats.nMillis : 0.0));
+    result.push_back(Pair("messagespersec", stats.nMillis > 0 ? stats.nMessages * 1000.0 / stats.nMillis : 0.0));
+    return result;
+}
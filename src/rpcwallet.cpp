@@ -2234,6 +2234,8 @@ Value clearwallettransactions(const Array& params, bool fHelp)
         pcursor->close();
         walletdb.TxnCommit();
         
+        // transactions were erased behind the wallet's back, drop its cached balances
+        pwalletMain->MarkDirty();
         
         //pwalletMain->mapWallet.clear();
     }
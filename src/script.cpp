@@ -4,8 +4,6 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -1222,63 +1220,133 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
 
+/** Cache of signatures known to be valid.
+ * Entries are salted 32-byte digests of (signature hash, signature, public key), kept
+ * in a fixed-size set-associative table split into shards with one lock each, so
+ * script check threads and the mempool rarely wait on each other. The salt keeps
+ * slot positions and evictions unpredictable to would-be DoS attackers.
+ */
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    static const unsigned int SHARDS = 16;
+    static const unsigned int WAYS = 4;
+
+    class CShard
+    {
+    public:
+        CCriticalSection cs;
+        std::vector<uint256> vTable; // WAYS slots per bucket, 0 marks a free slot
+        uint64_t nEntries;
+        uint64_t nLookups;
+        uint64_t nHits;
+
+        CShard() : nEntries(0), nLookups(0), nHits(0) {}
+    };
+
+    CShard vShards[SHARDS];
+    uint256 nSalt;
+    uint64_t nBuckets; // per shard, 0 when the cache is disabled
+
+    uint256 GetEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey) const
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << nSalt << hash << vchSig << pubKey;
+        return ss.GetHash();
+    }
 
 public:
-    bool
-    Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    CSignatureCache() : nBuckets(0) {}
+
+    void Init(int64_t nMaxMegabytes)
+    {
+        nSalt = GetRandHash();
+        nBuckets = (uint64_t)std::max((int64_t)0, nMaxMegabytes) * 1024 * 1024 / (sizeof(uint256) * WAYS * SHARDS);
+        for (unsigned int i = 0; i < SHARDS; i++)
+        {
+            LOCK(vShards[i].cs);
+            vShards[i].vTable.assign(nBuckets * WAYS, 0);
+            vShards[i].nEntries = 0;
+        }
+    }
+
+    bool Get(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
-        LOCK(cs_sigcache);
+        if (nBuckets == 0)
+            return false;
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+        CShard& shard = vShards[entry.Get64(0) % SHARDS];
+        unsigned int nPos = (entry.Get64(1) % nBuckets) * WAYS;
+
+        LOCK(shard.cs);
+        shard.nLookups++;
+        for (unsigned int i = 0; i < WAYS; i++)
+        {
+            if (shard.vTable[nPos + i] == entry)
+            {
+                shard.nHits++;
+                return true;
+            }
+        }
         return false;
     }
 
-    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    void Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (nBuckets == 0)
+            return;
 
-        LOCK(cs_sigcache);
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+        CShard& shard = vShards[entry.Get64(0) % SHARDS];
+        unsigned int nPos = (entry.Get64(1) % nBuckets) * WAYS;
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        LOCK(shard.cs);
+        for (unsigned int i = 0; i < WAYS; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (shard.vTable[nPos + i] == entry)
+                return;
+            if (shard.vTable[nPos + i] == 0)
+            {
+                shard.vTable[nPos + i] = entry;
+                shard.nEntries++;
+                return;
+            }
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Bucket full: evict the slot picked by the (salted, so unpredictable) digest
+        shard.vTable[nPos + entry.Get64(2) % WAYS] = entry;
+    }
+
+    void GetStats(uint64_t& nEntries, uint64_t& nMaxEntries, uint64_t& nLookups, uint64_t& nHits)
+    {
+        nEntries = nLookups = nHits = 0;
+        nMaxEntries = nBuckets * WAYS * SHARDS;
+        for (unsigned int i = 0; i < SHARDS; i++)
+        {
+            LOCK(vShards[i].cs);
+            nEntries += vShards[i].nEntries;
+            nLookups += vShards[i].nLookups;
+            nHits += vShards[i].nHits;
+        }
     }
 };
 
+static CSignatureCache signatureCache;
+
+void InitSignatureCache(int64_t nMaxMegabytes)
+{
+    signatureCache.Init(nMaxMegabytes);
+}
+
+void GetSignatureCacheStats(uint64_t& nEntries, uint64_t& nMaxEntries, uint64_t& nLookups, uint64_t& nHits)
+{
+    signatureCache.GetStats(nEntries, nMaxEntries, nLookups, nHits);
+}
+
 bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
-    static CSignatureCache signatureCache;
-
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -650,6 +650,10 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
                   int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
+// Allocate the signature cache, nMaxMegabytes of 0 disables it
+void InitSignatureCache(int64_t nMaxMegabytes);
+void GetSignatureCacheStats(uint64_t& nEntries, uint64_t& nMaxEntries, uint64_t& nLookups, uint64_t& nHits);
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
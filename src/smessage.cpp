@@ -11,6 +11,26 @@ Notes:
         -nosmsg             Disable secure messaging (fNoSmsg)
         -debugsmsg          Show extra debug messages (fDebugSmsg)
         -smsgscanchain      Scan the block chain for public key addresses on startup
+        -smsgpowthreads     Threads for the proof of work of sent messages (nSmsgPowThreads)
+        -smsgscanthreads    Threads trying received messages against the receive addresses (nSmsgScanThreads)
+    
+    
+    Bucket Files
+        Messages are appended to smsgStore/<bucket time>_01.dat, the format is unchanged so
+        older versions can still read it. Each store also appends a (timestamp, sample, offset,
+        length) entry to <bucket time>_01.idx, so startup reads only the index files.
+        Buckets without a valid index, or appended to by an older version, are scanned once.
+        Messages are served from memory mapped files, SMSG_MAPPED_FILES are kept open.
+    
+    
+    Bucket Sync
+        Peers announce buckets in smsgInv as (time, no. of messages, hash).
+        Buckets that differ are reconciled by smsgSketch if the peer set SMSG_NODE_SKETCH
+        in smsgPing/smsgPong: an invertible bloom lookup table over the bucket's tokens, sized
+        from the difference in message counts. The peer subtracts its own sketch, replies
+        with smsgHave listing only the messages missing here and sends smsgWant for the
+        ones it's missing. If the sketch can't be decoded the full token list is sent.
+        Older peers get smsgShow and full token lists.
     
     
     Wallet Locked
@@ -46,11 +66,16 @@ Notes:
 
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 
 #include "base58.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h" // pwalletMain
+#include "pbkdf2.h"
 #include "txdb.h"
 
 
@@ -78,6 +103,8 @@ boost::signals2::signal<void (SecMsgStored& outboxHdr)> NotifySecMsgOutboxChange
 boost::signals2::signal<void ()> NotifySecMsgWalletUnlocked;
 
 bool fSecMsgenabled = false;
+int nSmsgPowThreads = 1;
+int nSmsgScanThreads = 1;
 
 std::map<int64_t, SecMsgBucket> smsgBuckets;
 std::vector<SecMsgAddress>      smsgAddresses;
@@ -194,6 +221,143 @@ void SecMsgBucket::hashBucket()
 };
 
 
+bool SecMsgSketchCell::IsEmpty() const
+{
+    static const unsigned char zero[16] = {0};
+    return nCount == 0
+        && nCheck == 0
+        && memcmp(key, zero, 16) == 0;
+};
+
+SecMsgSketch::SecMsgSketch(uint32_t nCellsIn)
+{
+    // -- cells are split into one table per hash, so a token never lands twice in a cell
+    uint32_t nCells = ((nCellsIn + SMSG_SKETCH_HASHES - 1) / SMSG_SKETCH_HASHES) * SMSG_SKETCH_HASHES;
+    vCells.resize(std::max(nCells, SMSG_SKETCH_HASHES));
+};
+
+uint32_t SecMsgSketch::CellsFor(uint32_t nDifferences)
+{
+    uint32_t nCells = SMSG_SKETCH_MIN_CELLS + 4 * nDifferences;
+    return ((nCells + SMSG_SKETCH_HASHES - 1) / SMSG_SKETCH_HASHES) * SMSG_SKETCH_HASHES;
+};
+
+void SecMsgSketch::Toggle(const unsigned char* key, int32_t nDelta)
+{
+    uint32_t nTable = vCells.size() / SMSG_SKETCH_HASHES;
+    uint32_t nCheck = XXH32(key, 16, SMSG_SKETCH_HASHES);
+    
+    for (uint32_t k = 0; k < SMSG_SKETCH_HASHES; ++k)
+    {
+        SecMsgSketchCell& cell = vCells[k * nTable + XXH32(key, 16, k) % nTable];
+        cell.nCount += nDelta;
+        for (int i = 0; i < 16; ++i)
+            cell.key[i] ^= key[i];
+        cell.nCheck ^= nCheck;
+    };
+};
+
+void SecMsgSketch::Insert(const SecMsgToken& token)
+{
+    unsigned char key[16];
+    memcpy(key, &token.timestamp, 8);
+    memcpy(key+8, token.sample, 8);
+    Toggle(key, 1);
+};
+
+void SecMsgSketch::Subtract(const SecMsgSketch& other)
+{
+    for (size_t n = 0; n < vCells.size() && n < other.vCells.size(); ++n)
+    {
+        vCells[n].nCount -= other.vCells[n].nCount;
+        for (int i = 0; i < 16; ++i)
+            vCells[n].key[i] ^= other.vCells[n].key[i];
+        vCells[n].nCheck ^= other.vCells[n].nCheck;
+    };
+};
+
+bool SecMsgSketch::Decode(std::vector<SecMsgToken>& vOurs, std::vector<SecMsgToken>& vTheirs)
+{
+    /*
+    Peel cells holding a single token until none are left,
+    positive counts are tokens only in this sketch, negative only in the subtracted one.
+    
+    Destroys the sketch, returns false if some differences could not be listed.
+    */
+    
+    // -- a sketch from a peer could be made to peel the same tokens forever
+    size_t nMaxTokens = vCells.size();
+    
+    bool fProgress = true;
+    while (fProgress)
+    {
+        fProgress = false;
+        for (size_t n = 0; n < vCells.size(); ++n)
+        {
+            if (vOurs.size() + vTheirs.size() >= nMaxTokens)
+                return false;
+            
+            SecMsgSketchCell& cell = vCells[n];
+            if ((cell.nCount != 1 && cell.nCount != -1)
+                || cell.nCheck != XXH32(cell.key, 16, SMSG_SKETCH_HASHES))
+                continue;
+            
+            SecMsgToken token;
+            memcpy(&token.timestamp, cell.key, 8);
+            memcpy(token.sample, cell.key+8, 8);
+            token.offset = 0;
+            
+            if (cell.nCount > 0)
+                vOurs.push_back(token);
+            else
+                vTheirs.push_back(token);
+            
+            unsigned char key[16];
+            memcpy(key, cell.key, 16);
+            Toggle(key, -cell.nCount);
+            fProgress = true;
+        };
+    };
+    
+    for (size_t n = 0; n < vCells.size(); ++n)
+    {
+        if (!vCells[n].IsEmpty())
+            return false;
+    };
+    
+    return true;
+};
+
+void SecMsgSketch::Write(std::vector<unsigned char>& vch) const
+{
+    size_t nStart = vch.size();
+    vch.resize(nStart + vCells.size() * SMSG_SKETCH_CELL_LEN);
+    
+    unsigned char* p = &vch[nStart];
+    for (size_t n = 0; n < vCells.size(); ++n, p += SMSG_SKETCH_CELL_LEN)
+    {
+        memcpy(p, &vCells[n].nCount, 4);
+        memcpy(p+4, vCells[n].key, 16);
+        memcpy(p+20, &vCells[n].nCheck, 4);
+    };
+};
+
+bool SecMsgSketch::Read(const unsigned char* p, uint32_t nBytes)
+{
+    if (nBytes != vCells.size() * SMSG_SKETCH_CELL_LEN)
+        return false;
+    
+    for (size_t n = 0; n < vCells.size(); ++n, p += SMSG_SKETCH_CELL_LEN)
+    {
+        memcpy(&vCells[n].nCount, p, 4);
+        memcpy(vCells[n].key, p+4, 16);
+        memcpy(&vCells[n].nCheck, p+20, 4);
+    };
+    
+    return true;
+};
+
+
 bool SecMsgDB::Open(const char* pszMode)
 {
     if (smsgDB)
@@ -397,6 +561,53 @@ bool SecMsgDB::WritePK(CKeyID& addr, CPubKey& pubkey)
     return true;
 };
 
+bool SecMsgDB::ReadScanHeight(int& nHeight)
+{
+    if (!pdb)
+        return false;
+    
+    std::string strValue;
+    leveldb::Status s = pdb->Get(leveldb::ReadOptions(), "sh", &strValue);
+    if (!s.ok())
+        return false;
+    
+    try {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> nHeight;
+    } catch (std::exception& e) {
+        printf("SecMsgDB::ReadScanHeight() unserialize threw: %s.\n", e.what());
+        return false;
+    }
+    
+    return true;
+};
+
+bool SecMsgDB::WriteScanHeight(int nHeight)
+{
+    if (!pdb)
+        return false;
+    
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << nHeight;
+    
+    if (activeBatch)
+    {
+        activeBatch->Put("sh", ssValue.str());
+        return true;
+    };
+    
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status s = pdb->Put(writeOptions, "sh", ssValue.str());
+    if (!s.ok())
+    {
+        printf("SecMsgDB write failure: %s\n", s.ToString().c_str());
+        return false;
+    };
+    
+    return true;
+};
+
 bool SecMsgDB::ExistsPK(CKeyID& addr)
 {
     if (!pdb)
@@ -625,6 +836,7 @@ void ThreadSecureMsg(void* parg)
                 {
                     if (fDebugSmsg)
                         printf("Removing bucket %" PRId64 " \n", it->first);
+                    SecureMsgCloseBucket(it->first);
                     std::string fileName = boost::lexical_cast<std::string>(it->first) + "_01.dat";
                     fs::path fullPath = GetDataDir() / "smsgStore" / fileName;
                     if (fs::exists(fullPath))
@@ -637,6 +849,7 @@ void ThreadSecureMsg(void* parg)
                         };
                     } else
                         printf("Path %s does not exist \n", fullPath.string().c_str());
+                    SecureMsgRemoveIndex(it->first);
                     
                     // -- look for a wl file, it stores incoming messages when wallet is locked
                     fileName = boost::lexical_cast<std::string>(it->first) + "_01_wl.dat";
@@ -724,50 +937,80 @@ void ThreadSecureMsgPow(void* parg)
             // -- fifo (smallest key first)
             it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
         }
-        // -- break up lock, SecureMsgSetHash will take long
+        // -- break up lock, SecureMsgSetHashes will take long
         
-        for (;;)
+        bool fStopped = false;
+        while (!fStopped)
         {
+            // -- take a batch of queued messages, all are worked on at once
+            std::vector<SecMsgStored> vStored;
+            std::vector<std::vector<unsigned char> > vKeys;
             {
-                LOCK(cs_smsgDB); 
-                if (!dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
-                    break;
+                LOCK(cs_smsgDB);
+                while (vStored.size() < SMSG_POW_MAX_BATCH
+                    && dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+                {
+                    vStored.push_back(smsgStored);
+                    vKeys.push_back(std::vector<unsigned char>(chKey, chKey + 18));
+                };
             }
             
-            unsigned char* pHeader = &smsgStored.vchMessage[0];
-            unsigned char* pPayload = &smsgStored.vchMessage[SMSG_HDR_LEN];
-            SecureMessage* psmsg = (SecureMessage*) pHeader;
-            
-            // -- do proof of work
-            rv = SecureMsgSetHash(pHeader, pPayload, psmsg->nPayload);
-            if (rv == 2) 
-                break; // /eave message in db, if terminated due to shutdown
+            if (vStored.empty())
+                break;
             
-            // -- message is removed here, no matter what
-            {
-                LOCK(cs_smsgDB);
-                dbOutbox.EraseSmesg(chKey);
-            }
-            if (rv != 0)
+            std::vector<SecMsgPowJob> vJobs(vStored.size());
+            for (unsigned int i = 0; i < vStored.size(); ++i)
             {
-                printf("SecMsgPow: Could not get proof of work hash, message removed.\n");
-                continue;
+                vJobs[i].pHeader = &vStored[i].vchMessage[0];
+                vJobs[i].pPayload = &vStored[i].vchMessage[SMSG_HDR_LEN];
+                vJobs[i].nPayload = ((SecureMessage*) vJobs[i].pHeader)->nPayload;
             };
             
-            // -- add to message store
+            // -- do proof of work
+            int64_t nStart = GetTimeMillis();
+            SecureMsgSetHashes(vJobs);
+            if (fDebugSmsg)
+                printf("SecMsgPow: %" PRIszu " messages took %" PRId64 " ms.\n", vJobs.size(), GetTimeMillis() - nStart);
+            
+            for (unsigned int i = 0; i < vJobs.size(); ++i)
             {
-                LOCK(cs_smsg);
-                if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload, true) != 0)
+                unsigned char* pHeader = vJobs[i].pHeader;
+                unsigned char* pPayload = vJobs[i].pPayload;
+                SecureMessage* psmsg = (SecureMessage*) pHeader;
+                
+                rv = vJobs[i].rv;
+                if (rv == 2)
+                {
+                    fStopped = true;
+                    continue; // leave message in db, if terminated due to shutdown
+                };
+                
+                // -- message is removed here, no matter what
                 {
-                    printf("SecMsgPow: Could not place message in buckets, message removed.\n");
+                    LOCK(cs_smsgDB);
+                    dbOutbox.EraseSmesg(&vKeys[i][0]);
+                }
+                if (rv != 0)
+                {
+                    printf("SecMsgPow: Could not get proof of work hash, message removed.\n");
                     continue;
                 };
-            }
-            
-            // -- test if message was sent to self
-            if (SecureMsgScanMessage(pHeader, pPayload, psmsg->nPayload, true) != 0)
-            {
-                // message recipient is not this node (or failed)
+                
+                // -- add to message store
+                {
+                    LOCK(cs_smsg);
+                    if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload, true) != 0)
+                    {
+                        printf("SecMsgPow: Could not place message in buckets, message removed.\n");
+                        continue;
+                    };
+                }
+                
+                // -- test if message was sent to self
+                if (SecureMsgScanMessage(pHeader, pPayload, psmsg->nPayload, true) != 0)
+                {
+                    // message recipient is not this node (or failed)
+                };
             };
         };
         
@@ -813,70 +1056,381 @@ std::string fsReadable(uint64_t nBytes)
     return std::string(buffer);
 };
 
-int SecureMsgBuildBucketSet()
+// -- Bucket files hold the messages, header then payload, in the format
+//    older versions read and write. Their index is kept beside them in
+//    <bucket time>_01.idx: SMSG_INDEX_MAGIC, SMSG_INDEX_VERSION, then one
+//    SMSG_INDEX_ENTRY_LEN byte entry (timestamp, sample, offset, length) per
+//    message, in file order. Each store appends one entry.
+//    An index is only used while its last entry ends where the bucket file
+//    does, so a file appended to by an older version is scanned again.
+
+static fs::path SecureMsgIndexPath(int64_t bucket)
 {
-    /*
-        Build the bucket set by scanning the files in the smsgStore dir.
-        
-        smsgBuckets should be empty
-    */
+    return GetDataDir() / "smsgStore" / (boost::lexical_cast<std::string>(bucket) + "_01.idx");
+};
+
+void SecureMsgRemoveIndex(int64_t bucket)
+{
+    fs::path fullPath = SecureMsgIndexPath(bucket);
+    try {
+        if (fs::exists(fullPath))
+            fs::remove(fullPath);
+    } catch (const fs::filesystem_error& ex)
+    {
+        printf("Error removing index file %s.\n", ex.what());
+    };
+};
+
+static bool SecureMsgReadIndex(int64_t bucket, uint32_t &nDataSize, std::set<SecMsgToken> *pTokens)
+{
+    // -- read the index of a bucket, returns false if it's missing or stale,
+    //    without pTokens only the last entry is read
     
-    if (fDebugSmsg)
-        printf("SecureMsgBuildBucketSet()\n");
-        
-    int64_t  now            = GetTime();
-    uint32_t nFiles         = 0;
-    uint32_t nMessages      = 0;
+    fs::path pathData = GetDataDir() / "smsgStore" / (boost::lexical_cast<std::string>(bucket) + "_01.dat");
+    uint64_t nFileSize;
+    try {
+        nFileSize = fs::file_size(pathData);
+    } catch (const fs::filesystem_error&)
+    {
+        return false;
+    };
     
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    fs::directory_iterator itend;
+    FILE *fp;
+    if (!(fp = fopen(SecureMsgIndexPath(bucket).string().c_str(), "rb")))
+        return false;
     
+    uint32_t header[2];
+    long int nIndexSize = -1;
+    if (fread(header, sizeof(uint32_t), 2, fp) == 2
+        && fseek(fp, 0, SEEK_END) == 0)
+        nIndexSize = ftell(fp);
     
-    if (!fs::exists(pathSmsgDir)
-        || !fs::is_directory(pathSmsgDir))
+    if (nIndexSize < 8
+        || header[0] != SMSG_INDEX_MAGIC
+        || header[1] != SMSG_INDEX_VERSION
+        || (nIndexSize - 8) % SMSG_INDEX_ENTRY_LEN != 0)
     {
-        printf("Message store directory does not exist.\n");
-        return 0; // not an error
-    }
+        fclose(fp);
+        return false;
+    };
     
+    uint32_t nEntries = (nIndexSize - 8) / SMSG_INDEX_ENTRY_LEN;
+    uint32_t nFirst = pTokens || nEntries == 0 ? 0 : nEntries - 1;
     
-    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
+    std::vector<unsigned char> vchIndex((nEntries - nFirst) * SMSG_INDEX_ENTRY_LEN);
+    if (vchIndex.size() > 0
+        && (fseek(fp, 8 + nFirst * SMSG_INDEX_ENTRY_LEN, SEEK_SET) != 0
+            || fread(&vchIndex[0], 1, vchIndex.size(), fp) != vchIndex.size()))
     {
-        if (!fs::is_regular_file(itd->status()))
-            continue;
-        
-        std::string fileType = (*itd).path().extension().string();
-        
-        if (fileType.compare(".dat") != 0)
-            continue;
-            
-        std::string fileName = (*itd).path().filename().string();
-        
-        
-        if (fDebugSmsg)
-            printf("Processing file: %s.\n", fileName.c_str());
-        
-        nFiles++;
-        
-        // TODO files must be split if > 2GB
-        // time_noFile.dat
-        size_t sep = fileName.find_first_of("_");
-        if (sep == std::string::npos)
-            continue;
-        
-        std::string stime = fileName.substr(0, sep);
+        fclose(fp);
+        return false;
+    };
+    fclose(fp);
+    
+    uint64_t nEnd = 0;
+    SecMsgToken token;
+    for (uint32_t i = nFirst; i < nEntries; ++i)
+    {
+        unsigned char *p = &vchIndex[(i - nFirst) * SMSG_INDEX_ENTRY_LEN];
+        uint32_t nOffset, nLength;
+        memcpy(&token.timestamp, p, 8);
+        memcpy(token.sample, p + 8, 8);
+        memcpy(&nOffset, p + 16, 4);
+        memcpy(&nLength, p + 20, 4);
+        token.offset = nOffset;
+        nEnd = (uint64_t)nOffset + nLength;
+        if (pTokens)
+            pTokens->insert(token);
+    };
+    
+    if (nEnd != nFileSize)
+        return false;
+    
+    nDataSize = nEnd;
+    return true;
+};
+
+static void SecureMsgPackIndexEntry(unsigned char *p, const SecMsgToken &token, uint32_t nLength)
+{
+    uint32_t nOffset = token.offset;
+    memcpy(p, &token.timestamp, 8);
+    memcpy(p + 8, token.sample, 8);
+    memcpy(p + 16, &nOffset, 4);
+    memcpy(p + 20, &nLength, 4);
+};
+
+static bool SecureMsgAppendIndex(int64_t bucket, const SecMsgToken &token, uint32_t nLength)
+{
+    unsigned char entry[SMSG_INDEX_ENTRY_LEN];
+    SecureMsgPackIndexEntry(entry, token, nLength);
+    
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(SecureMsgIndexPath(bucket).string().c_str(), "ab"))
+        || fwrite(entry, 1, SMSG_INDEX_ENTRY_LEN, fp) != SMSG_INDEX_ENTRY_LEN)
+    {
+        printf("SecureMsgAppendIndex() failed: %s\n", strerror(errno));
+        if (fp)
+            fclose(fp);
+        return false;
+    };
+    
+    return fclose(fp) == 0;
+};
+
+static bool SecMsgTokenOffsetLess(const SecMsgToken &a, const SecMsgToken &b)
+{
+    return a.offset < b.offset;
+};
+
+static bool SecureMsgWriteIndex(int64_t bucket, uint32_t nDataSize, const std::set<SecMsgToken> &tokens)
+{
+    // -- entries go in file order, each runs to the next one so the last ends at nDataSize
+    std::vector<SecMsgToken> vSorted(tokens.begin(), tokens.end());
+    std::sort(vSorted.begin(), vSorted.end(), SecMsgTokenOffsetLess);
+    
+    std::vector<unsigned char> vchIndex(8 + vSorted.size() * SMSG_INDEX_ENTRY_LEN);
+    uint32_t header[2] = {SMSG_INDEX_MAGIC, SMSG_INDEX_VERSION};
+    memcpy(&vchIndex[0], header, 8);
+    for (size_t i = 0; i < vSorted.size(); ++i)
+    {
+        uint32_t nEnd = i + 1 < vSorted.size() ? vSorted[i + 1].offset : nDataSize;
+        SecureMsgPackIndexEntry(&vchIndex[8 + i * SMSG_INDEX_ENTRY_LEN], vSorted[i], nEnd - vSorted[i].offset);
+    };
+    
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(SecureMsgIndexPath(bucket).string().c_str(), "wb"))
+        || fwrite(&vchIndex[0], 1, vchIndex.size(), fp) != vchIndex.size())
+    {
+        printf("SecureMsgWriteIndex() failed: %s\n", strerror(errno));
+        if (fp)
+            fclose(fp);
+        return false;
+    };
+    
+    return fclose(fp) == 0;
+};
+
+static void SecureMsgScanBucketFile(FILE *fp, uint32_t &nDataSize, std::set<SecMsgToken> &tokens)
+{
+    // -- walk the messages of a bucket file without a valid index, stopping
+    //    at the first message that doesn't fit
+    
+    fseek(fp, 0, SEEK_END);
+    long int nFileSize = ftell(fp);
+    
+    SecureMessage smsg;
+    long int ofs = 0;
+    while (ofs + (long int)SMSG_HDR_LEN <= nFileSize)
+    {
+        if (fseek(fp, ofs, SEEK_SET) != 0
+            || fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+            break;
         
-        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
+        if (smsg.version[0] != 1
+            || smsg.nPayload > SMSG_MAX_MSG_WORST
+            || ofs + (long int)SMSG_HDR_LEN + (long int)smsg.nPayload > nFileSize)
+            break;
         
-        if (fileTime < now - SMSG_RETENTION)
+        if (smsg.nPayload >= 8)
         {
-            printf("Dropping file %s, expired.\n", fileName.c_str());
-            try {
-                fs::remove((*itd).path());
-            } catch (const fs::filesystem_error& ex)
+            SecMsgToken token;
+            token.timestamp = smsg.timestamp;
+            token.offset = ofs;
+            if (fread(token.sample, sizeof(unsigned char), 8, fp) != 8)
+                break;
+            tokens.insert(token);
+        };
+        
+        ofs += SMSG_HDR_LEN + smsg.nPayload;
+    };
+    
+    nDataSize = ofs;
+};
+
+static bool SecureMsgIndexBucketFile(int64_t bucket, uint32_t &nDataSize, std::set<SecMsgToken> &tokens)
+{
+    // -- rebuild the index of a bucket by scanning its messages
+    
+    fs::path fullpath = GetDataDir() / "smsgStore" / (boost::lexical_cast<std::string>(bucket) + "_01.dat");
+    
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(fullpath.string().c_str(), "rb")))
+    {
+        printf("Error opening file: %s\n", strerror(errno));
+        return false;
+    };
+    
+    SecureMsgScanBucketFile(fp, nDataSize, tokens);
+    fclose(fp);
+    
+    // -- drop whatever followed, a partly written message
+    try {
+        if (fs::file_size(fullpath) > nDataSize)
+            fs::resize_file(fullpath, nDataSize);
+    } catch (const fs::filesystem_error& ex)
+    {
+        printf("Error truncating bucket file %s.\n", ex.what());
+        return false;
+    };
+    
+    return SecureMsgWriteIndex(bucket, nDataSize, tokens);
+};
+
+// -- Bucket files mapped for retrieval, least recently used closed first.
+//    Guarded by cs_smsg. A file is unmapped before it is written or removed.
+class SecMsgMappedBucket
+{
+public:
+    boost::shared_ptr<boost::interprocess::file_mapping>    mapping;
+    boost::shared_ptr<boost::interprocess::mapped_region>   region;
+    uint32_t                                                nDataSize;
+    uint64_t                                                nLastUsed;
+};
+
+static std::map<int64_t, SecMsgMappedBucket> mapSmsgMapped;
+static uint64_t nSmsgMappedUses = 0;
+
+void SecureMsgCloseBucket(int64_t bucket)
+{
+    mapSmsgMapped.erase(bucket);
+};
+
+static void SecureMsgCloseBuckets()
+{
+    mapSmsgMapped.clear();
+};
+
+static const unsigned char *SecureMsgMapBucket(int64_t bucket, uint32_t &nDataSize)
+{
+    std::map<int64_t, SecMsgMappedBucket>::iterator it = mapSmsgMapped.find(bucket);
+    if (it != mapSmsgMapped.end())
+    {
+        it->second.nLastUsed = ++nSmsgMappedUses;
+        nDataSize = it->second.nDataSize;
+        return (const unsigned char*) it->second.region->get_address();
+    };
+    
+    std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
+    fs::path fullpath = GetDataDir() / "smsgStore" / fileName;
+    
+    SecMsgMappedBucket mapped;
+    if (!SecureMsgReadIndex(bucket, mapped.nDataSize, NULL)
+        || mapped.nDataSize == 0)
+    {
+        printf("SecureMsgMapBucket() no index or no messages in %s\n", fileName.c_str());
+        return NULL;
+    };
+    
+    try {
+        mapped.mapping.reset(new boost::interprocess::file_mapping(fullpath.string().c_str(), boost::interprocess::read_only));
+        mapped.region.reset(new boost::interprocess::mapped_region(*mapped.mapping, boost::interprocess::read_only, 0, mapped.nDataSize));
+    } catch (boost::interprocess::interprocess_exception& e)
+    {
+        printf("SecureMsgMapBucket() could not map %s: %s\n", fileName.c_str(), e.what());
+        return NULL;
+    };
+    
+    if (mapSmsgMapped.size() >= SMSG_MAPPED_FILES)
+    {
+        std::map<int64_t, SecMsgMappedBucket>::iterator itOldest = mapSmsgMapped.begin();
+        for (it = mapSmsgMapped.begin(); it != mapSmsgMapped.end(); ++it)
+        {
+            if (it->second.nLastUsed < itOldest->second.nLastUsed)
+                itOldest = it;
+        };
+        mapSmsgMapped.erase(itOldest);
+    };
+    
+    mapped.nLastUsed = ++nSmsgMappedUses;
+    mapSmsgMapped[bucket] = mapped;
+    
+    nDataSize = mapped.nDataSize;
+    return (const unsigned char*) mapped.region->get_address();
+};
+
+int SecureMsgBuildBucketSet()
+{
+    /*
+        Build the bucket set by scanning the files in the smsgStore dir.
+        
+        smsgBuckets should be empty
+    */
+    
+    if (fDebugSmsg)
+        printf("SecureMsgBuildBucketSet()\n");
+        
+    int64_t  now            = GetTime();
+    uint32_t nFiles         = 0;
+    uint32_t nMessages      = 0;
+    
+    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
+    fs::directory_iterator itend;
+    
+    
+    if (!fs::exists(pathSmsgDir)
+        || !fs::is_directory(pathSmsgDir))
+    {
+        printf("Message store directory does not exist.\n");
+        return 0; // not an error
+    }
+    
+    
+    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
+    {
+        if (!fs::is_regular_file(itd->status()))
+            continue;
+        
+        std::string fileType = (*itd).path().extension().string();
+        
+        if (fileType.compare(".idx") == 0)
+        {
+            // -- an older version may have removed the bucket file
+            if (!fs::exists(fs::path((*itd).path()).replace_extension(".dat")))
+            {
+                try {
+                    fs::remove((*itd).path());
+                } catch (const fs::filesystem_error& ex)
+                {
+                    printf("Error removing index file %s.\n", ex.what());
+                };
+            };
+            continue;
+        };
+        
+        if (fileType.compare(".dat") != 0)
+            continue;
+            
+        std::string fileName = (*itd).path().filename().string();
+        
+        
+        if (fDebugSmsg)
+            printf("Processing file: %s.\n", fileName.c_str());
+        
+        nFiles++;
+        
+        // TODO files must be split if > 2GB
+        // time_noFile.dat
+        size_t sep = fileName.find_first_of("_");
+        if (sep == std::string::npos)
+            continue;
+        
+        std::string stime = fileName.substr(0, sep);
+        
+        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
+        
+        if (fileTime < now - SMSG_RETENTION)
+        {
+            printf("Dropping file %s, expired.\n", fileName.c_str());
+            try {
+                fs::remove((*itd).path());
+            } catch (const fs::filesystem_error& ex)
             {
                 printf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
             };
+            SecureMsgRemoveIndex(fileTime);
             continue;
         };
         
@@ -888,57 +1442,19 @@ int SecureMsgBuildBucketSet()
         };
         
         
-        SecureMessage smsg;
         std::set<SecMsgToken>& tokenSet = smsgBuckets[fileTime].setTokens;
         
         {
             LOCK(cs_smsg);
-            FILE *fp;
-            
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                printf("Error opening file: %s\n", strerror(errno));
-                continue;
-            };
             
-            for (;;)
+            // -- only the index is read, files without a valid one are scanned once
+            uint32_t nDataSize;
+            if (!SecureMsgReadIndex(fileTime, nDataSize, &tokenSet))
             {
-                long int ofs = ftell(fp);
-                SecMsgToken token;
-                token.offset = ofs;
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        printf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //printf("End of file.\n");
-                    };
-                    break;
-                };
-                token.timestamp = smsg.timestamp;
-                
-                if (smsg.nPayload < 8)
-                    continue;
-                
-                if (fread(token.sample, sizeof(unsigned char), 8, fp) != 8)
-                {
-                    printf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-                
-                if (fseek(fp, smsg.nPayload-8, SEEK_CUR) != 0)
-                {
-                    printf("fseek, strerror: %s.\n", strerror(errno));
-                    break;
-                };
-                
-                tokenSet.insert(token);
+                printf("Indexing bucket file %s.\n", fileName.c_str());
+                tokenSet.clear();
+                SecureMsgIndexBucketFile(fileTime, nDataSize, tokenSet);
             };
-            
-            fclose(fp);
         };
         smsgBuckets[fileTime].hashBucket();
         
@@ -1133,6 +1649,89 @@ int SecureMsgWriteIni()
 };
 
 
+class SecMsgScanCheck
+{
+// -- A job for the scan threads: pfn(parg, n) handles item n of the caller's batch
+public:
+    SecMsgScanCheck() : pfn(NULL), parg(NULL), n(0) {};
+    SecMsgScanCheck(void (*pfnIn)(void*, size_t), void* pargIn, size_t nIn) : pfn(pfnIn), parg(pargIn), n(nIn) {};
+    
+    bool operator()()
+    {
+        pfn(parg, n);
+        return true;
+    };
+    
+    void swap(SecMsgScanCheck& check)
+    {
+        std::swap(pfn, check.pfn);
+        std::swap(parg, check.parg);
+        std::swap(n, check.n);
+    };
+    
+private:
+    void (*pfn)(void*, size_t);
+    void* parg;
+    size_t n;
+};
+
+// -- Trial decryption of received messages and the chain scan share one pool of
+//    nSmsgScanThreads - 1 threads, started with secure messaging and stopped at shutdown.
+//    cs_smsgScanQueue lets one batch at a time through, its caller works on it too.
+static CCheckQueue<SecMsgScanCheck> smsgScanQueue(1);
+static CCriticalSection cs_smsgScanQueue;
+static int nSmsgScanWorkers = 0;
+
+static void ThreadSecureMsgScan(void* parg)
+{
+    RenameThread("pinkcoin-smsg-scanw"); // Make this thread recognisable
+    
+    try {
+        smsgScanQueue.Thread();
+    } catch (std::exception& e)
+    {
+        PrintException(&e, "ThreadSecureMsgScan()");
+    } catch (...)
+    {
+        PrintException(NULL, "ThreadSecureMsgScan()");
+    };
+};
+
+static void SecureMsgStartScanThreads()
+{
+    LOCK(cs_smsgScanQueue);
+    
+    // -- idle while disabled, only started once
+    while (nSmsgScanWorkers < nSmsgScanThreads - 1)
+    {
+        if (!NewThread(ThreadSecureMsgScan, NULL))
+        {
+            printf("SecureMsg could not start scan thread %d.\n", nSmsgScanWorkers + 1);
+            break;
+        };
+        nSmsgScanWorkers++;
+    };
+};
+
+static int SecureMsgRunScanChecks(std::vector<SecMsgScanCheck>& vChecks)
+{
+    // -- returns the no. of threads that worked on the batch
+    LOCK(cs_smsgScanQueue);
+    
+    if (nSmsgScanWorkers < 1
+        || vChecks.size() < 2)
+    {
+        for (std::vector<SecMsgScanCheck>::iterator it = vChecks.begin(); it != vChecks.end(); ++it)
+            (*it)();
+        return 1;
+    };
+    
+    CCheckQueueControl<SecMsgScanCheck> control(&smsgScanQueue);
+    control.Add(vChecks);
+    control.Wait();
+    return std::min((size_t)nSmsgScanWorkers + 1, vChecks.size());
+};
+
 /** called from AppInit2() in init.cpp */
 bool SecureMsgStart(bool fDontStart, bool fScanChain)
 {
@@ -1156,9 +1755,11 @@ bool SecureMsgStart(bool fDontStart, bool fScanChain)
             printf("Failed to load addresses from wallet.\n");
     };
     
+    SecureMsgStartScanThreads();
+    
     if (fScanChain)
     {
-        SecureMsgScanBlockChain();
+        SecureMsgScanBlockChain(false);
     };
     
     if (SecureMsgBuildBucketSet() != 0)
@@ -1183,6 +1784,10 @@ bool SecureMsgStart(bool fDontStart, bool fScanChain)
 /** called from Shutdown() in init.cpp */
 bool SecureMsgShutdown()
 {
+    // -- the chain scan would reopen the db after it's closed, stop it even if disabled
+    SecureMsgStopScanBlockChain(true);
+    smsgScanQueue.Quit();
+    
     if (!fSecMsgenabled)
         return false;
     
@@ -1194,6 +1799,11 @@ bool SecureMsgShutdown()
     
     fSecMsgenabled = false;
     
+    {
+        LOCK(cs_smsg);
+        SecureMsgCloseBuckets();
+    }
+    
     if (smsgDB)
     {
         LOCK(cs_smsgDB);
@@ -1206,6 +1816,31 @@ bool SecureMsgShutdown()
     return true;
 };
 
+static void SecureMsgPushFlags(CNode* pnode, const char* pszCommand)
+{
+    // -- smsgPing and smsgPong carry the features of this node, older nodes ignore the data
+    uint32_t nFlags = SMSG_NODE_SKETCH;
+    std::vector<unsigned char> vchData(4);
+    memcpy(&vchData[0], &nFlags, 4);
+    pnode->PushMessage(pszCommand, vchData);
+};
+
+static void SecureMsgReadFlags(CNode* pfrom, CDataStream& vRecv)
+{
+    if (vRecv.empty())
+        return; // older node
+    
+    std::vector<unsigned char> vchData;
+    vRecv >> vchData;
+    
+    if (vchData.size() < 4U)
+        return;
+    
+    uint32_t nFlags;
+    memcpy(&nFlags, &vchData[0], 4);
+    pfrom->smsgData.fSketch = nFlags & SMSG_NODE_SKETCH;
+};
+
 bool SecureMsgEnable()
 {
     // -- start secure messaging at runtime
@@ -1241,6 +1876,8 @@ bool SecureMsgEnable()
         
     }; // LOCK(cs_smsg);
     
+    SecureMsgStartScanThreads();
+    
     // -- start threads
     if (!NewThread(ThreadSecureMsg, NULL)
         || !NewThread(ThreadSecureMsgPow, NULL))
@@ -1255,8 +1892,8 @@ bool SecureMsgEnable()
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
         {
-            pnode->PushMessage("smsgPing");
-            pnode->PushMessage("smsgPong"); // Send pong as have missed initial ping sent by peer when it connected
+            SecureMsgPushFlags(pnode, "smsgPing");
+            SecureMsgPushFlags(pnode, "smsgPong"); // Send pong as have missed initial ping sent by peer when it connected
         };
     }
     
@@ -1277,6 +1914,8 @@ bool SecureMsgDisable()
         LOCK(cs_smsg);
         fSecMsgenabled = false;
         
+        SecureMsgCloseBuckets();
+        
         // -- clear smsgBuckets
         std::map<int64_t, SecMsgBucket>::iterator it;
         it = smsgBuckets.begin();
@@ -1306,6 +1945,9 @@ bool SecureMsgDisable()
         
     }; // LOCK(cs_smsg);
     
+    // -- the chain scan would reopen the db after it's closed
+    SecureMsgStopScanBlockChain(true);
+    
     // -- allow time for threads to stop
     MilliSleep(3000); // milliseconds
     // TODO be certain that threads have stopped
@@ -1384,6 +2026,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         vchDataOut.reserve(4 + 8 * nInvBuckets); // reserve max possible size
         vchDataOut.resize(4);
         uint32_t nShowBuckets = 0;
+        uint32_t nSketches = 0;
         
         
         unsigned char *p = &vchData[4];
@@ -1442,6 +2085,36 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                 || (smsgBuckets[time].setTokens.size() == ncontent
                     && smsgBuckets[time].hash != hash)) // if same amount in buckets check hash
             {
+                std::set<SecMsgToken>& tokenSet = smsgBuckets[time].setTokens;
+                uint32_t nHave = tokenSet.size();
+                
+                // -- the difference in counts is only a lower bound, equal counts with
+                //    different hashes differ by at least a message each way.
+                //    If the sketch doesn't decode the peer falls back to the full token list
+                uint32_t nDiff = nHave < ncontent ? ncontent - nHave : nHave - ncontent;
+                uint32_t nCells = SecMsgSketch::CellsFor(nDiff > 0 ? nDiff : 2);
+                if (pfrom->smsgData.fSketch
+                    && nCells <= SMSG_SKETCH_MAX_CELLS
+                    && nCells * SMSG_SKETCH_CELL_LEN < ncontent * 16)
+                {
+                    // -- send a sketch of the bucket, peer replies with only the messages this node is missing
+                    if (fDebugSmsg)
+                        printf("Sending sketch of bucket %" PRId64 ", %u cells.\n", time, nCells);
+                    
+                    SecMsgSketch sketch(nCells);
+                    for (std::set<SecMsgToken>::iterator it = tokenSet.begin(); it != tokenSet.end(); ++it)
+                        sketch.Insert(*it);
+                    
+                    std::vector<unsigned char> vchSketch(12);
+                    memcpy(&vchSketch[0], &time, 8);
+                    memcpy(&vchSketch[8], &nCells, 4);
+                    sketch.Write(vchSketch);
+                    pfrom->PushMessage("smsgSketch", vchSketch);
+                    
+                    nSketches++;
+                    continue;
+                };
+                
                 if (fDebugSmsg)
                     printf("Requesting contents of bucket %" PRId64 ".\n", time);
                 
@@ -1459,7 +2132,8 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         {
             pfrom->PushMessage("smsgShow", vchDataOut);
         } else
-        if (nLocked < 1) // Don't report buckets as matched if any are locked
+        if (nLocked < 1 // Don't report buckets as matched if any are locked
+            && nSketches < 1)
         {
             // -- peer has no buckets we want, don't send them again until something changes
             //    peer will still request buckets from this node if needed (< ncontent)
@@ -1529,19 +2203,22 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         
         
     } else
-    if (strCommand == "smsgHave")
+    if (strCommand == "smsgSketch")
     {
-        // -- peer has these messages in bucket
+        // -- peer sent a sketch of a bucket, reply with the messages it's missing
         std::vector<unsigned char> vchData;
         vRecv >> vchData;
         
-        if (vchData.size() < 8U)
+        if (vchData.size() < 12U)
+        {
+            pfrom->Misbehaving(1);
             return false;
-        
-        int n = (vchData.size() - 8U) / 16;
+        };
         
         int64_t time;
+        uint32_t nCells;
         memcpy(&time, &vchData[0], 8);
+        memcpy(&nCells, &vchData[8], 4);
         
         // -- Check time valid:
         int64_t now = GetTime();
@@ -1559,21 +2236,145 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             return false;
         };
         
-        if (smsgBuckets[time].nLockCount > 0)
+        if (nCells < SMSG_SKETCH_HASHES
+            || nCells > SMSG_SKETCH_MAX_CELLS
+            || nCells % SMSG_SKETCH_HASHES != 0)
         {
-            if (fDebugSmsg)
-                printf("Bucket %" PRId64 " lock count %u, waiting for message data from peer %u.\n", time, smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+            printf("smsgSketch, invalid no. of cells %u.\n", nCells);
+            pfrom->Misbehaving(1);
             return false;
-        }; 
-        
-        if (fDebugSmsg)
-            printf("Sifting through bucket %" PRId64 ".\n", time);
+        };
         
-        std::vector<unsigned char> vchDataOut;
-        vchDataOut.resize(8);
-        memcpy(&vchDataOut[0], &vchData[0], 8);
+        SecMsgSketch sketchPeer(nCells);
+        if (!sketchPeer.Read(&vchData[12], vchData.size() - 12))
+        {
+            printf("smsgSketch, size %" PRIszu " doesn't match %u cells.\n", vchData.size(), nCells);
+            pfrom->Misbehaving(1);
+            return false;
+        };
         
-        std::set<SecMsgToken>& tokenSet = smsgBuckets[time].setTokens;
+        std::map<int64_t, SecMsgBucket>::iterator itb = smsgBuckets.find(time);
+        if (itb == smsgBuckets.end())
+        {
+            if (fDebugSmsg)
+                printf("Don't have bucket %" PRId64 ".\n", time);
+            return false;
+        };
+        
+        std::set<SecMsgToken>& tokenSet = itb->second.setTokens;
+        std::set<SecMsgToken>::iterator it;
+        
+        SecMsgSketch sketch(nCells);
+        for (it = tokenSet.begin(); it != tokenSet.end(); ++it)
+            sketch.Insert(*it);
+        sketch.Subtract(sketchPeer);
+        
+        std::vector<SecMsgToken> vOurs, vTheirs;
+        std::vector<unsigned char> vchDataOut(8);
+        memcpy(&vchDataOut[0], &time, 8);
+        
+        if (sketch.Decode(vOurs, vTheirs))
+        {
+            if (fDebugSmsg)
+                printf("Bucket %" PRId64 " differs by %" PRIszu " messages here, %" PRIszu " on peer.\n", time, vOurs.size(), vTheirs.size());
+            
+            for (std::vector<SecMsgToken>::iterator itd = vOurs.begin(); itd != vOurs.end(); ++itd)
+            {
+                if (tokenSet.count(*itd) < 1)
+                    continue;
+                
+                size_t nd = vchDataOut.size();
+                vchDataOut.resize(nd + 16);
+                memcpy(&vchDataOut[nd], &itd->timestamp, 8);
+                memcpy(&vchDataOut[nd+8], itd->sample, 8);
+            };
+            
+            // -- ask for the messages the peer has and this node doesn't, as smsgHave would
+            std::vector<unsigned char> vchWant(8);
+            memcpy(&vchWant[0], &time, 8);
+            for (std::vector<SecMsgToken>::iterator itd = vTheirs.begin(); itd != vTheirs.end(); ++itd)
+            {
+                if (tokenSet.count(*itd) > 0)
+                    continue;
+                
+                size_t nd = vchWant.size();
+                vchWant.resize(nd + 16);
+                memcpy(&vchWant[nd], &itd->timestamp, 8);
+                memcpy(&vchWant[nd+8], itd->sample, 8);
+            };
+            
+            if (vchWant.size() > 8U
+                && itb->second.nLockCount < 1)
+            {
+                if (fDebugSmsg)
+                    printf("Locking bucket %" PRIu64 " for peer %u.\n", time, pfrom->smsgData.nPeerId);
+                itb->second.nLockCount   = 3;
+                itb->second.nLockPeerId  = pfrom->smsgData.nPeerId;
+                pfrom->PushMessage("smsgWant", vchWant);
+            };
+        } else
+        {
+            // -- too many differences for the sketch, send the full token list as for smsgShow
+            if (fDebugSmsg)
+                printf("Could not decode sketch of bucket %" PRId64 ", sending all %" PRIszu " tokens.\n", time, tokenSet.size());
+            
+            vchDataOut.resize(8U + 16U * tokenSet.size());
+            unsigned char* p = &vchDataOut[8];
+            for (it = tokenSet.begin(); it != tokenSet.end(); ++it, p += 16)
+            {
+                memcpy(p, &it->timestamp, 8);
+                memcpy(p+8, &it->sample, 8);
+            };
+        };
+        
+        if (vchDataOut.size() > 8U)
+            pfrom->PushMessage("smsgHave", vchDataOut);
+    } else
+    if (strCommand == "smsgHave")
+    {
+        // -- peer has these messages in bucket
+        std::vector<unsigned char> vchData;
+        vRecv >> vchData;
+        
+        if (vchData.size() < 8U)
+            return false;
+        
+        int n = (vchData.size() - 8U) / 16;
+        
+        int64_t time;
+        memcpy(&time, &vchData[0], 8);
+        
+        // -- Check time valid:
+        int64_t now = GetTime();
+        if (time < now - SMSG_RETENTION)
+        {
+            if (fDebugSmsg)
+                printf("Not interested in peer bucket %" PRId64 ", has expired.\n", time);
+            return false;
+        };
+        if (time > now + SMSG_TIME_LEEWAY)
+        {
+            if (fDebugSmsg)
+                printf("Not interested in peer bucket %" PRId64 ", in the future.\n", time);
+            pfrom->Misbehaving(1);
+            return false;
+        };
+        
+        if (smsgBuckets[time].nLockCount > 0)
+        {
+            if (fDebugSmsg)
+                printf("Bucket %" PRId64 " lock count %u, waiting for message data from peer %u.\n", time, smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+            return false;
+        }; 
+        
+        if (fDebugSmsg)
+            printf("Sifting through bucket %" PRId64 ".\n", time);
+        
+        std::vector<unsigned char> vchDataOut;
+        vchDataOut.resize(8);
+        memcpy(&vchDataOut[0], &vchData[0], 8);
+        
+        std::set<SecMsgToken>& tokenSet = smsgBuckets[time].setTokens;
         std::set<SecMsgToken>::iterator it;
         SecMsgToken token;
         unsigned char* p = &vchData[8];
@@ -1642,6 +2443,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         
         std::set<SecMsgToken>& tokenSet = itb->second.setTokens;
         std::set<SecMsgToken>::iterator it;
+        std::vector<SecMsgToken> vWanted;
         SecMsgToken token;
         unsigned char* p = &vchData[8];
         for (int i = 0; i < n; ++i)
@@ -1656,31 +2458,35 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                     printf("Don't have wanted message %" PRId64 ".\n", token.timestamp);
             } else
             {
-                //printf("Have message at %d.\n", it->offset); // DEBUG
-                token.offset = it->offset;
-                //printf("winb before SecureMsgRetrieve %d.\n", token.timestamp);
-                
-                // -- place in vchOne so if SecureMsgRetrieve fails it won't corrupt vchBunch
-                if (SecureMsgRetrieve(token, vchOne) == 0)
-                {
-                    nBunch++;
-                    vchBunch.insert(vchBunch.end(), vchOne.begin(), vchOne.end()); // append
-                } else
-                {
-                    printf("SecureMsgRetrieve failed %" PRId64 ".\n", token.timestamp);
-                };
-                
-                if (nBunch >= 500
-                    || vchBunch.size() >= 96000U)
-                {
-                    if (fDebugSmsg)
-                        printf("Break bunch %u, %" PRIszu ".\n", nBunch, vchBunch.size());
-                    break; // end here, peer will send more want messages if needed.
-                };
+                vWanted.push_back(*it);
             };
             p += 16;
         };
         
+        // -- read the messages in file order, one pass through the mapped bucket
+        std::sort(vWanted.begin(), vWanted.end(), SecMsgTokenOffsetLess);
+        
+        for (std::vector<SecMsgToken>::iterator itw = vWanted.begin(); itw != vWanted.end(); ++itw)
+        {
+            // -- place in vchOne so if SecureMsgRetrieve fails it won't corrupt vchBunch
+            if (SecureMsgRetrieve(*itw, vchOne) == 0)
+            {
+                nBunch++;
+                vchBunch.insert(vchBunch.end(), vchOne.begin(), vchOne.end()); // append
+            } else
+            {
+                printf("SecureMsgRetrieve failed %" PRId64 ".\n", itw->timestamp);
+            };
+            
+            if (nBunch >= 500
+                || vchBunch.size() >= 96000U)
+            {
+                if (fDebugSmsg)
+                    printf("Break bunch %u, %" PRIszu ".\n", nBunch, vchBunch.size());
+                break; // end here, peer will send more want messages if needed.
+            };
+        };
+        
         if (nBunch > 0)
         {
             if (fDebugSmsg)
@@ -1735,13 +2541,15 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
     if (strCommand == "smsgPing")
     {
         // -- smsgPing is the initial message, send reply
-        pfrom->PushMessage("smsgPong");
+        SecureMsgReadFlags(pfrom, vRecv);
+        SecureMsgPushFlags(pfrom, "smsgPong");
     } else
     if (strCommand == "smsgPong")
     {
         if (fDebugSmsg)
              printf("Peer replied, secure messaging enabled.\n");
         
+        SecureMsgReadFlags(pfrom, vRecv);
         pfrom->smsgData.fEnabled = true;
     } else
     if (strCommand == "smsgDisabled")
@@ -1804,7 +2612,7 @@ bool SecureMsgSendData(CNode* pto, bool fSendTrickle)
         if (fDebugSmsg)
             printf("SecureMsgSendData() new node %s, peer id %u.\n", pto->addrName.c_str(), pto->smsgData.nPeerId);
         // -- Send smsgPing once, do nothing until receive 1st smsgPong (then set fEnabled)
-        pto->PushMessage("smsgPing");
+        SecureMsgPushFlags(pto, "smsgPing");
         pto->smsgData.lastSeen = GetTime();
         return true;
     } else
@@ -1941,10 +2749,10 @@ int SecureMsgInsertAddress(CKeyID& hashKey, CPubKey& pubKey)
 };
 
 
-static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
-    uint32_t& nTransactions, uint32_t& nInputs, uint32_t& nPubkeys, uint32_t& nDuplicates)
+static bool ScanBlock(CBlock& block, CTxDB& txdb, std::vector<std::pair<CKeyID, CPubKey> >& vKeys,
+    uint32_t& nTransactions, uint32_t& nInputs)
 {
-    // -- should have LOCK(cs_smsg) where db is opened
+    // -- collects the public keys found, SecureMsgWritePubKeys adds them to the db
     BOOST_FOREACH(CTransaction& tx, block.vtx)
     {
         if (!tx.IsStandard())
@@ -2030,14 +2838,7 @@ static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
                         break;
                     };
                     
-                    int rv = SecureMsgInsertAddress(hashKey, pubKey, addrpkdb);
-                    if (rv != 0)
-                    {
-                        if (rv == 4)
-                            nDuplicates++;
-                        break;
-                    };
-                    nPubkeys++;
+                    vKeys.push_back(std::make_pair(hashKey, pubKey));
                     break;
                 };
                 
@@ -2046,16 +2847,70 @@ static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
             nInputs++;
         };
         nTransactions++;
-        
-        if (nTransactions % 10000 == 0) // for ScanChainForPublicKeys
+    };
+    return true;
+};
+
+
+
+
+static bool SecureMsgWritePubKeys(std::vector<std::pair<CKeyID, CPubKey> >& vKeys, int nScanHeight,
+    uint32_t& nPubkeys, uint32_t& nDuplicates)
+{
+    /* add public keys to the db in one batch
+       
+       if nScanHeight >= 0 the chain scan marker is moved to it in the same batch
+    */
+    
+    LOCK(cs_smsgDB);
+    
+    SecMsgDB addrpkdb;
+    if (!addrpkdb.Open("cw"))
+        return false;
+    
+    // -- look up existing keys before starting the batch, lookups scan the whole active batch
+    std::set<CKeyID> setSeen;
+    std::vector<size_t> vNew;
+    for (size_t i = 0; i < vKeys.size(); ++i)
+    {
+        if (!setSeen.insert(vKeys[i].first).second
+            || addrpkdb.ExistsPK(vKeys[i].first))
+        {
+            nDuplicates++;
+            continue;
+        };
+        vNew.push_back(i);
+    };
+    
+    if (vNew.empty() && nScanHeight < 0)
+        return true;
+    
+    if (!addrpkdb.TxnBegin())
+        return false;
+    
+    for (std::vector<size_t>::iterator it = vNew.begin(); it != vNew.end(); ++it)
+    {
+        if (!addrpkdb.WritePK(vKeys[*it].first, vKeys[*it].second))
         {
-            printf("Scanning transaction no. %u.\n", nTransactions);
+            addrpkdb.TxnAbort();
+            return false;
         };
     };
+    
+    if (nScanHeight >= 0
+        && !addrpkdb.WriteScanHeight(nScanHeight))
+    {
+        addrpkdb.TxnAbort();
+        return false;
+    };
+    
+    if (!addrpkdb.TxnCommit())
+        return false;
+    
+    nPubkeys += vNew.size();
     return true;
 };
 
-
 bool SecureMsgScanBlock(CBlock& block)
 {
     /*
@@ -2071,106 +2926,277 @@ bool SecureMsgScanBlock(CBlock& block)
     uint32_t nPubkeys       = 0;
     uint32_t nDuplicates    = 0;
     
+    std::vector<std::pair<CKeyID, CPubKey> > vKeys;
     {
-        LOCK(cs_smsgDB);
         CTxDB txdb("r");
-        
-        SecMsgDB addrpkdb;
-        if (!addrpkdb.Open("cw")
-            || !addrpkdb.TxnBegin())
-            return false;
-        
-        ScanBlock(block, txdb, addrpkdb,
-            nTransactions, nInputs, nPubkeys, nDuplicates);
-        
-        addrpkdb.TxnCommit();
+        ScanBlock(block, txdb, vKeys, nTransactions, nInputs);
     }
     
+    if (!SecureMsgWritePubKeys(vKeys, -1, nPubkeys, nDuplicates))
+        return false;
+    
     if (fDebugSmsg)
         printf("Found %u transactions, %u inputs, %u new public keys, %u duplicates.\n", nTransactions, nInputs, nPubkeys, nDuplicates);
     
     return true;
 };
 
-bool ScanChainForPublicKeys(CBlockIndex* pindexStart)
+// -- Chain scan progress, guarded by cs_smsgScanChain
+static CCriticalSection cs_smsgScanChain;
+static SecMsgScanChainStatus smsgScanChain;
+static bool fSmsgScanChainStop = false;
+static bool fSmsgScanChainRescan = false;
+static boost::thread* pthreadSmsgScanChain = NULL;
+
+class SecMsgScanChainPart
 {
-    printf("Scanning block chain for public keys.\n");
-    int64_t nStart = GetTimeMillis();
+// -- What was found in one block of a window
+public:
+    SecMsgScanChainPart()
+    {
+        pindex = NULL;
+        nTransactions = 0;
+        nInputs = 0;
+    };
     
-    if (fDebugSmsg)
-        printf("From height %u.\n", pindexStart->nHeight);
+    CBlockIndex* pindex;
+    std::vector<std::pair<CKeyID, CPubKey> > vKeys;
+    uint32_t nTransactions;
+    uint32_t nInputs;
+};
+
+static bool ScanChainStopped()
+{
+    LOCK(cs_smsgScanChain);
+    return fShutdown || !fSecMsgenabled || fSmsgScanChainStop;
+};
+
+static void ScanChainBlock(void* parg, size_t n)
+{
+    SecMsgScanChainPart& part = (*(std::vector<SecMsgScanChainPart>*)parg)[n];
+    if (ScanChainStopped())
+        return;
     
-    // -- public keys are in txin.scriptSig
-    //    matching addresses are in scriptPubKey of txin's referenced output
+    CBlock block;
+    if (!block.ReadFromDisk(part.pindex, true))
+    {
+        printf("ScanChainForPublicKeys() could not read block at height %d.\n", part.pindex->nHeight);
+        return;
+    };
     
-    uint32_t nBlocks        = 0;
-    uint32_t nTransactions  = 0;
-    uint32_t nInputs        = 0;
-    uint32_t nPubkeys       = 0;
-    uint32_t nDuplicates    = 0;
+    CTxDB txdb("r");
+    ScanBlock(block, txdb, part.vKeys, part.nTransactions, part.nInputs);
+};
+
+bool ScanChainForPublicKeys(int nStartHeight)
+{
+    /*
+    Scan the main chain from nStartHeight for public keys.
     
-    {
-        LOCK(cs_smsgDB);
+    The chain is taken in windows of SMSG_SCAN_CHAIN_WINDOW blocks, read on the
+    scan threads. Each window's keys are written in one batch together with the
+    height scanned to, so a stopped scan resumes there.
+    */
     
-        CTxDB txdb("r");
+    printf("Scanning block chain for public keys from height %d.\n", nStartHeight);
+    int64_t nStart = GetTimeMillis();
+    
+    // -- the scan threads are shared with received messages, go through them a few blocks at a time
+    size_t nSlice = std::max(nSmsgScanThreads, 1) * SMSG_SCAN_CHUNK;
+    
+    int nHeight = nStartHeight;
+    while (!ScanChainStopped())
+    {
+        std::vector<CBlockIndex*> vBlocks;
+        int nTargetHeight;
+        {
+            LOCK(cs_main);
+            nTargetHeight = nBestHeight;
+            for (int h = nHeight; h <= nBestHeight && vBlocks.size() < SMSG_SCAN_CHAIN_WINDOW; ++h)
+                vBlocks.push_back(FindBlockByHeight(h));
+        }
         
-        SecMsgDB addrpkdb;
-        if (!addrpkdb.Open("cw")
-            || !addrpkdb.TxnBegin())
-            return false;
+        {
+            LOCK(cs_smsgScanChain);
+            smsgScanChain.nTargetHeight = nTargetHeight;
+        }
+        
+        if (vBlocks.empty())
+            break;
         
-        CBlockIndex* pindex = pindexStart;
-        while (pindex)
+        std::vector<SecMsgScanChainPart> vParts(vBlocks.size());
+        for (size_t i = 0; i < vBlocks.size() && !ScanChainStopped(); i += nSlice)
         {
-            nBlocks++;
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            
-            ScanBlock(block, txdb, addrpkdb,
-                nTransactions, nInputs, nPubkeys, nDuplicates);
-            
-            pindex = pindex->pnext;
+            std::vector<SecMsgScanCheck> vChecks;
+            for (size_t k = i; k < vBlocks.size() && k < i + nSlice; ++k)
+            {
+                vParts[k].pindex = vBlocks[k];
+                vChecks.push_back(SecMsgScanCheck(&ScanChainBlock, &vParts, k));
+            };
+            SecureMsgRunScanChecks(vChecks);
+        };
+        
+        // -- the scan gave up part way through, don't mark the window scanned
+        if (ScanChainStopped())
+            break;
+        
+        std::vector<std::pair<CKeyID, CPubKey> > vKeys;
+        uint32_t nTransactions = 0, nInputs = 0, nPubkeys = 0, nDuplicates = 0;
+        for (size_t i = 0; i < vParts.size(); ++i)
+        {
+            vKeys.insert(vKeys.end(), vParts[i].vKeys.begin(), vParts[i].vKeys.end());
+            nTransactions += vParts[i].nTransactions;
+            nInputs += vParts[i].nInputs;
         };
         
-        addrpkdb.TxnCommit();
+        nHeight = vBlocks.back()->nHeight;
+        if (!SecureMsgWritePubKeys(vKeys, nHeight, nPubkeys, nDuplicates))
+        {
+            printf("ScanChainForPublicKeys() could not write public keys at height %d.\n", nHeight);
+            return false;
+        };
+        nHeight++;
+        
+        {
+            LOCK(cs_smsgScanChain);
+            smsgScanChain.nHeight = nHeight - 1;
+            smsgScanChain.nBlocks += vBlocks.size();
+            smsgScanChain.nTransactions += nTransactions;
+            smsgScanChain.nInputs += nInputs;
+            smsgScanChain.nPubkeys += nPubkeys;
+            smsgScanChain.nDuplicates += nDuplicates;
+            smsgScanChain.nMillis = GetTimeMillis() - nStart;
+        }
+        
+        if (fDebugSmsg)
+            printf("Scanned block chain to height %d of %d.\n", nHeight - 1, nTargetHeight);
     };
     
-    printf("Scanned %u blocks, %u transactions, %u inputs\n", nBlocks, nTransactions, nInputs);
-    printf("Found %u public keys, %u duplicates.\n", nPubkeys, nDuplicates);
+    {
+        LOCK(cs_smsgScanChain);
+        printf("Scanned %" PRIu64 " blocks, %" PRIu64 " transactions, %" PRIu64 " inputs\n",
+            smsgScanChain.nBlocks, smsgScanChain.nTransactions, smsgScanChain.nInputs);
+        printf("Found %" PRIu64 " public keys, %" PRIu64 " duplicates.\n", smsgScanChain.nPubkeys, smsgScanChain.nDuplicates);
+    }
     printf("Took %" PRId64 " ms\n", GetTimeMillis() - nStart);
     
     return true;
 };
 
-bool SecureMsgScanBlockChain()
+void ThreadSecureMsgScanChain(void* parg)
 {
-    TRY_LOCK(cs_main, lockMain);
-    if (lockMain)
+    RenameThread("pinkcoin-smsg-scan"); // Make this thread recognisable
+    
+    bool fRescan;
     {
-        CBlockIndex *pindexScan = pindexGenesisBlock;
-        if (pindexScan == NULL)
-        {
-            printf("Error: pindexGenesisBlock not set.\n");
+        LOCK(cs_smsgScanChain);
+        fRescan = fSmsgScanChainRescan;
+    }
+    
+    int nStartHeight = 0;
+    if (!fRescan)
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB addrpkdb;
+        int nScanned;
+        if (addrpkdb.Open("cr+")
+            && addrpkdb.ReadScanHeight(nScanned))
+            nStartHeight = nScanned + 1;
+    };
+    
+    {
+        LOCK(cs_smsgScanChain);
+        smsgScanChain.nStartHeight = nStartHeight;
+        smsgScanChain.nHeight = nStartHeight - 1;
+    }
+    
+    bool fResult = false;
+    try { // -- in try to catch errors opening db
+        fResult = ScanChainForPublicKeys(nStartHeight);
+    } catch (std::exception& e)
+    {
+        printf("ScanChainForPublicKeys() threw: %s.\n", e.what());
+    };
+    
+    LOCK(cs_smsgScanChain);
+    smsgScanChain.fRunning = false;
+    smsgScanChain.fFailed = !fResult;
+};
+
+static void SecureMsgJoinScanChain()
+{
+    // -- wait for the scan thread to return, it must be stopped or finished
+    boost::thread* pthread;
+    {
+        LOCK(cs_smsgScanChain);
+        pthread = pthreadSmsgScanChain;
+        pthreadSmsgScanChain = NULL;
+    }
+    
+    if (pthread)
+    {
+        pthread->join();
+        delete pthread;
+    };
+};
+
+bool SecureMsgScanBlockChain(bool fRescan)
+{
+    /*
+    Start scanning the block chain for public keys in the background,
+    from the height the last scan stopped at, or from genesis if fRescan.
+    
+    returns false if a scan is already running or could not be started
+    */
+    
+    {
+        LOCK(cs_smsgScanChain);
+        if (smsgScanChain.fRunning
+            || fShutdown)
             return false;
-        };
-        
         
-        try { // -- in try to catch errors opening db, 
-            if (!ScanChainForPublicKeys(pindexScan))
-                return false;
-        } catch (std::exception& e)
-        {
-            printf("ScanChainForPublicKeys() threw: %s.\n", e.what());
-            return false;
-        };
-    } else
+        smsgScanChain = SecMsgScanChainStatus();
+        smsgScanChain.fRunning = true;
+        smsgScanChain.nStartTime = GetTime();
+        fSmsgScanChainStop = false;
+        fSmsgScanChainRescan = fRescan;
+    }
+    
+    // -- the previous scan has finished, fRunning was cleared as it returned
+    SecureMsgJoinScanChain();
+    
+    boost::thread* pthread;
+    try {
+        pthread = new boost::thread(ThreadSecureMsgScanChain, (void*)NULL);
+    } catch (boost::thread_resource_error& e)
     {
-        printf("ScanChainForPublicKeys() Could not lock main.\n");
+        printf("SecureMsgScanBlockChain() could not start thread: %s\n", e.what());
+        LOCK(cs_smsgScanChain);
+        smsgScanChain.fRunning = false;
         return false;
     };
     
+    LOCK(cs_smsgScanChain);
+    pthreadSmsgScanChain = pthread;
     return true;
-}
+};
+
+void SecureMsgStopScanBlockChain(bool fWait)
+{
+    {
+        LOCK(cs_smsgScanChain);
+        fSmsgScanChainStop = true;
+    }
+    
+    if (fWait)
+        SecureMsgJoinScanChain();
+};
+
+void SecureMsgGetScanChainStatus(SecMsgScanChainStatus& status)
+{
+    LOCK(cs_smsgScanChain);
+    status = smsgScanChain;
+};
 
 bool SecureMsgScanBuckets()
 {
@@ -2237,6 +3263,7 @@ bool SecureMsgScanBuckets()
             {
                 printf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
             };
+            SecureMsgRemoveIndex(fileTime);
             continue;
         };
         
@@ -2287,17 +3314,15 @@ bool SecureMsgScanBuckets()
                     break;
                 };
                 
-                // -- don't report to gui, 
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
+                // -- don't report to gui, 0 is returned whether or not the message matched
+                std::vector<SecMsgScanItem> vItems(1);
+                vItems[0].pHeader = &smsg.hash[0];
+                vItems[0].pPayload = &vchData[0];
+                vItems[0].nPayload = smsg.nPayload;
                 
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
+                uint32_t nFound;
+                if (SecureMsgScanMessages(vItems, false, nFound) == 0)
+                    nFoundMessages += nFound;
                 
                 nMessages ++;
             };
@@ -2305,6 +3330,8 @@ bool SecureMsgScanBuckets()
             fclose(fp);
             
             // -- remove wl file when scanned
+            SecureMsgCloseBucket(fileTime);
+            SecureMsgRemoveIndex(fileTime);
             try {
                 fs::remove((*itd).path());
             } catch (const boost::filesystem::filesystem_error& ex)
@@ -2322,6 +3349,23 @@ bool SecureMsgScanBuckets()
 }
 
 
+static uint32_t SecureMsgScanQueued(std::vector<std::vector<unsigned char> >& vMessages)
+{
+    // -- scan a batch of messages received while the wallet was locked, don't report to gui
+    std::vector<SecMsgScanItem> vItems(vMessages.size());
+    for (size_t i = 0; i < vMessages.size(); ++i)
+    {
+        vItems[i].pHeader = &vMessages[i][0];
+        vItems[i].pPayload = &vMessages[i][SMSG_HDR_LEN];
+        vItems[i].nPayload = vMessages[i].size() - SMSG_HDR_LEN;
+    };
+    
+    uint32_t nFound = 0;
+    if (SecureMsgScanMessages(vItems, false, nFound) != 0)
+        printf("SecureMsgScanQueued(): SecureMsgScanMessages failed.\n");
+    return nFound;
+};
+
 int SecureMsgWalletUnlocked()
 {
     /*
@@ -2355,7 +3399,7 @@ int SecureMsgWalletUnlocked()
     };
     
     SecureMessage smsg;
-    std::vector<unsigned char> vchData;
+    std::vector<std::vector<unsigned char> > vMessages;
     
     for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
     {
@@ -2420,38 +3464,38 @@ int SecureMsgWalletUnlocked()
                     break;
                 };
                 
-                try {
-                    vchData.resize(smsg.nPayload);
-                } catch (std::exception& e)
+                if (smsg.nPayload == 0
+                    || smsg.nPayload > SMSG_MAX_MSG_WORST)
                 {
-                    printf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
+                    printf("SecureMsgWalletUnlocked(): Invalid payload size %u\n", smsg.nPayload);
+                    break;
                 };
                 
-                if (fread(&vchData[0], sizeof(unsigned char), smsg.nPayload, fp) != smsg.nPayload)
+                vMessages.push_back(std::vector<unsigned char>(SMSG_HDR_LEN + smsg.nPayload));
+                std::vector<unsigned char>& vchMessage = vMessages.back();
+                memcpy(&vchMessage[0], &smsg.hash[0], SMSG_HDR_LEN);
+                
+                if (fread(&vchMessage[SMSG_HDR_LEN], sizeof(unsigned char), smsg.nPayload, fp) != smsg.nPayload)
                 {
                     printf("fread data failed: %s\n", strerror(errno));
+                    vMessages.pop_back();
                     break;
                 };
                 
-                // -- don't report to gui, 
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
-                
-                if (rv == 0)
+                if (vMessages.size() >= SMSG_SCAN_BATCH)
                 {
-                    nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
+                    nFoundMessages += SecureMsgScanQueued(vMessages);
+                    nMessages += vMessages.size();
+                    vMessages.clear();
                 };
-                
-                nMessages ++;
             };
             
             fclose(fp);
             
+            nFoundMessages += SecureMsgScanQueued(vMessages);
+            nMessages += vMessages.size();
+            vMessages.clear();
+            
             // -- remove wl file when scanned
             try {
                 fs::remove((*itd).path());
@@ -2504,7 +3548,289 @@ int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeTy
     }; // LOCK(cs_smsg);
     
     
-    return 0;
+    return 0;
+};
+
+// -- Trial decryption
+//    Each received message is tried against every receive address. The
+//    ECDH shared secret and MAC are enough to reject a message, so that is
+//    all the workers compute; the full decrypt runs only for a MAC match.
+
+static CCriticalSection cs_smsgScan;
+static SecMsgScanStats smsgScanStats;
+
+class SecMsgTrialKey
+{
+public:
+    std::string     sAddress;
+    bool            fReceiveAnon;
+    CKey            key;
+};
+
+class SecMsgTrialBatch
+{
+public:
+    std::vector<SecMsgScanItem>*        pvItems;
+    std::vector<SecMsgTrialKey>*        pvKeys;
+    std::vector<CKey>                   vKeyR;      // R of each message, each is only used by the chunk holding its message
+    std::vector<char>                   vValidR;
+    std::vector<std::vector<int> >      vMatches;   // indexes into pvKeys of the MAC matches, per message
+    bool                                fCopyKeys;
+    
+    CCriticalSection                    cs;
+    uint64_t                            nTrials;
+};
+
+static bool SecureMsgTrialMac(EC_KEY *pkeyk, const EC_POINT *pR, const unsigned char *pHeader, const unsigned char *pPayload, uint32_t nPayload)
+{
+    // -- derive key_m and check the MAC as SecureMsgDecrypt does
+    SecureMessage* psmsg = (SecureMessage*) pHeader;
+    
+    unsigned char P[32];
+    if (ECDH_compute_key(P, 32, pR, pkeyk, NULL) != 32)
+        return false;
+    
+    unsigned char H[64]; // key_e, key_m
+    SHA512(P, 32, H);
+    
+    unsigned char MAC[32];
+    HMAC_SHA256_CTX ctx;
+    HMAC_SHA256_Init(&ctx, &H[32], 32);
+    HMAC_SHA256_Update(&ctx, &psmsg->timestamp, sizeof(psmsg->timestamp));
+    HMAC_SHA256_Update(&ctx, pPayload, nPayload);
+    HMAC_SHA256_Final(MAC, &ctx);
+    
+    return memcmp(MAC, psmsg->mac, 32) == 0;
+};
+
+static void SecureMsgTrialChunk(void* parg, size_t nStart)
+{
+    // -- trial MACs of the SMSG_SCAN_CHUNK messages from nStart
+    SecMsgTrialBatch *pbatch = (SecMsgTrialBatch*) parg;
+    std::vector<SecMsgScanItem>& vItems = *pbatch->pvItems;
+    
+    // -- chunks on the scan threads take their own copy of the private keys, EC_KEYs aren't shared
+    std::vector<SecMsgTrialKey> vKeysCopy;
+    if (pbatch->fCopyKeys)
+        vKeysCopy = *pbatch->pvKeys;
+    std::vector<SecMsgTrialKey>& vKeys = pbatch->fCopyKeys ? vKeysCopy : *pbatch->pvKeys;
+    
+    uint64_t nTrials = 0;
+    size_t nEnd = std::min(nStart + SMSG_SCAN_CHUNK, vItems.size());
+    for (size_t i = nStart; i < nEnd; ++i)
+    {
+        if (!pbatch->vValidR[i])
+            continue;
+        
+        const EC_POINT *pR = EC_KEY_get0_public_key(pbatch->vKeyR[i].GetECKey());
+        for (size_t k = 0; k < vKeys.size(); ++k)
+        {
+            nTrials++;
+            if (SecureMsgTrialMac(vKeys[k].key.GetECKey(), pR, vItems[i].pHeader, vItems[i].pPayload, vItems[i].nPayload))
+                pbatch->vMatches[i].push_back(k);
+        };
+    };
+    
+    LOCK(pbatch->cs);
+    pbatch->nTrials += nTrials;
+};
+
+static void SecureMsgLoadTrialKeys(std::vector<SecMsgTrialKey>& vKeys)
+{
+    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    {
+        if (!it->fReceiveEnabled)
+            continue;
+        
+        CBitcoinAddress coinAddress(it->sAddress);
+        CKeyID ckid;
+        SecMsgTrialKey trialKey;
+        if (!coinAddress.GetKeyID(ckid)
+            || !pwalletMain->GetKey(ckid, trialKey.key))
+        {
+            if (fDebugSmsg)
+                printf("Could not get private key for %s.\n", it->sAddress.c_str());
+            continue;
+        };
+        
+        trialKey.sAddress = coinAddress.ToString();
+        trialKey.fReceiveAnon = it->fReceiveAnon;
+        vKeys.push_back(trialKey);
+    };
+};
+
+static int SecureMsgSaveInbox(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, const std::string& addressTo, bool reportToGui)
+{
+    SecureMessage* psmsg = (SecureMessage*) pHeader;
+    std::string sPrefix("im");
+    unsigned char chKey[18];
+    memcpy(&chKey[0],  sPrefix.data(),    2);
+    memcpy(&chKey[2],  &psmsg->timestamp, 8);
+    memcpy(&chKey[10], pPayload,          8);
+    
+    SecMsgStored smsgInbox;
+    smsgInbox.timeReceived  = GetTime();
+    smsgInbox.status        = (SMSG_MASK_UNREAD) & 0xFF;
+    smsgInbox.sAddrTo       = addressTo;
+    
+    // -- data may not be contiguous
+    try {
+        smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
+    } catch (std::exception& e) {
+        printf("SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
+        return 1;
+    };
+    memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
+    memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
+    
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB dbInbox;
+        
+        if (dbInbox.Open("cw"))
+        {
+            if (dbInbox.ExistsSmesg(chKey))
+            {
+                if (fDebugSmsg)
+                    printf("Message already exists in inbox db.\n");
+            } else
+            {
+                dbInbox.WriteSmesg(chKey, smsgInbox);
+                
+                if (reportToGui)
+                    NotifySecMsgInboxChanged(smsgInbox);
+                printf("SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
+            };
+        };
+    }
+    
+    return 0;
+};
+
+int SecureMsgScanMessages(std::vector<SecMsgScanItem>& vItems, bool reportToGui, uint32_t& nFound)
+{
+    /* 
+    Check which messages belong to this node, add those to the inbox db.
+    
+    if !reportToGui don't fire NotifySecMsgInboxChanged
+    
+    returns
+        0 success,
+        1 error
+        3 wallet is locked - messages stored for scanning later.
+    */
+    
+    nFound = 0;
+    if (vItems.empty())
+        return 0;
+    
+    if (fDebugSmsg)
+        printf("SecureMsgScanMessages() %" PRIszu " messages\n", vItems.size());
+    
+    if (pwalletMain->IsLocked())
+    {
+        if (fDebugSmsg)
+            printf("ScanMessage: Wallet is locked, storing message to scan later.\n");
+        
+        int rv = 3;
+        for (std::vector<SecMsgScanItem>::iterator it = vItems.begin(); it != vItems.end(); ++it)
+        {
+            if (SecureMsgStoreUnscanned(it->pHeader, it->pPayload, it->nPayload) != 0)
+                rv = 1;
+        };
+        return rv;
+    };
+    
+    int64_t nStart = GetTimeMillis();
+    
+    std::vector<SecMsgTrialKey> vKeys;
+    SecureMsgLoadTrialKeys(vKeys);
+    
+    SecMsgTrialBatch batch;
+    batch.pvItems = &vItems;
+    batch.pvKeys = &vKeys;
+    batch.vKeyR.resize(vItems.size());
+    batch.vValidR.resize(vItems.size(), 0);
+    batch.vMatches.resize(vItems.size());
+    batch.fCopyKeys = false;
+    batch.nTrials = 0;
+    
+    for (size_t i = 0; i < vItems.size(); ++i)
+    {
+        SecureMessage* psmsg = (SecureMessage*) vItems[i].pHeader;
+        if (psmsg->version[0] != 1)
+            continue;
+        
+        std::vector<unsigned char> vchR(psmsg->cpkR, psmsg->cpkR+33);
+        CPubKey cpkR(vchR);
+        if (!cpkR.IsValid()
+            || !batch.vKeyR[i].SetPubKey(cpkR))
+        {
+            printf("Could not set pubkey for R: %s.\n", ValueString(cpkR.Raw()).c_str());
+            continue;
+        };
+        batch.vValidR[i] = 1;
+    };
+    
+    std::vector<SecMsgScanCheck> vChecks;
+    for (size_t i = 0; i < vItems.size(); i += SMSG_SCAN_CHUNK)
+        vChecks.push_back(SecMsgScanCheck(&SecureMsgTrialChunk, &batch, i));
+    batch.fCopyKeys = vChecks.size() > 1 && nSmsgScanThreads > 1;
+    int nThreads = SecureMsgRunScanChecks(vChecks);
+    
+    uint64_t nMatches = 0, nDecrypts = 0;
+    int rv = 0;
+    MessageData msg;
+    for (size_t i = 0; i < vItems.size(); ++i)
+    {
+        std::vector<int>& vMatches = batch.vMatches[i];
+        for (std::vector<int>::iterator it = vMatches.begin(); it != vMatches.end(); ++it)
+        {
+            nMatches++;
+            std::string addressTo = vKeys[*it].sAddress;
+            
+            if (!vKeys[*it].fReceiveAnon)
+            {
+                // -- have to do full decrypt to see address from
+                nDecrypts++;
+                if (SecureMsgDecrypt(false, addressTo, vItems[i].pHeader, vItems[i].pPayload, vItems[i].nPayload, msg) != 0
+                    || msg.sFromAddress.compare("anon") == 0)
+                    continue;
+            };
+            
+            if (fDebugSmsg)
+                printf("Decrypted message with %s.\n", addressTo.c_str());
+            
+            if (SecureMsgSaveInbox(vItems[i].pHeader, vItems[i].pPayload, vItems[i].nPayload, addressTo, reportToGui) != 0)
+                rv = 1;
+            else
+                nFound++;
+            break;
+        };
+    };
+    
+    int64_t nMillis = GetTimeMillis() - nStart;
+    {
+        LOCK(cs_smsgScan);
+        smsgScanStats.nMessages += vItems.size();
+        smsgScanStats.nTrials += batch.nTrials;
+        smsgScanStats.nMatches += nMatches;
+        smsgScanStats.nDecrypts += nDecrypts;
+        smsgScanStats.nFound += nFound;
+        smsgScanStats.nMillis += nMillis;
+    }
+    
+    if (fDebugSmsg)
+        printf("SecureMsgScanMessages() %" PRIszu " messages, %" PRIszu " addresses, %d threads, %u found, took %" PRId64 " ms\n",
+            vItems.size(), vKeys.size(), nThreads, nFound, nMillis);
+    
+    return rv;
+};
+
+void SecureMsgGetScanStats(SecMsgScanStats& stats)
+{
+    LOCK(cs_smsgScan);
+    stats = smsgScanStats;
 };
 
 int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, bool reportToGui)
@@ -2517,113 +3843,21 @@ int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32
      - loads messages received when wallet locked in bulk.
     
     returns
-        0 success,
+        0 success, whether or not the message matched
         1 error
-        2 no match
         3 wallet is locked - message stored for scanning later.
     */
     
     if (fDebugSmsg)
         printf("SecureMsgScanMessage()\n");
     
-    if (pwalletMain->IsLocked())
-    {
-        if (fDebugSmsg)
-            printf("ScanMessage: Wallet is locked, storing message to scan later.\n");
-        
-        int rv;
-        if ((rv = SecureMsgStoreUnscanned(pHeader, pPayload, nPayload)) != 0)
-            return 1;
-        
-        return 3;
-    };
-    
-    std::string addressTo;
-    MessageData msg; // placeholder
-    bool fOwnMessage = false;
-    
-    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
-    {
-        if (!it->fReceiveEnabled)
-            continue;
-        
-        CBitcoinAddress coinAddress(it->sAddress);
-        addressTo = coinAddress.ToString();
-        
-        if (!it->fReceiveAnon)
-        {
-            // -- have to do full decrypt to see address from
-            if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebugSmsg)
-                    printf("Decrypted message with %s.\n", addressTo.c_str());
-                
-                if (msg.sFromAddress.compare("anon") != 0)
-                    fOwnMessage = true;
-                break;
-            };
-        } else
-        {
-            
-            if (SecureMsgDecrypt(true, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebugSmsg)
-                    printf("Decrypted message with %s.\n", addressTo.c_str());
-                
-                fOwnMessage = true;
-                break;
-            };
-        }
-    };
-    
-    if (fOwnMessage)
-    {
-        // -- save to inbox
-        SecureMessage* psmsg = (SecureMessage*) pHeader;
-        std::string sPrefix("im");
-        unsigned char chKey[18];
-        memcpy(&chKey[0],  sPrefix.data(),    2);
-        memcpy(&chKey[2],  &psmsg->timestamp, 8);
-        memcpy(&chKey[10], pPayload,          8);
-        
-        SecMsgStored smsgInbox;
-        smsgInbox.timeReceived  = GetTime();
-        smsgInbox.status        = (SMSG_MASK_UNREAD) & 0xFF;
-        smsgInbox.sAddrTo       = addressTo;
-        
-        // -- data may not be contiguous
-        try {
-            smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
-        } catch (std::exception& e) {
-            printf("SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
-            return 1;
-        };
-        memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
-        memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
-        
-        {
-            LOCK(cs_smsgDB);
-            SecMsgDB dbInbox;
-            
-            if (dbInbox.Open("cw"))
-            {
-                if (dbInbox.ExistsSmesg(chKey))
-                {
-                    if (fDebugSmsg)
-                        printf("Message already exists in inbox db.\n");
-                } else
-                {
-                    dbInbox.WriteSmesg(chKey, smsgInbox);
-                    
-                    if (reportToGui)
-                        NotifySecMsgInboxChanged(smsgInbox);
-                    printf("SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
-                };
-            };
-        }
-    };
+    std::vector<SecMsgScanItem> vItems(1);
+    vItems[0].pHeader = pHeader;
+    vItems[0].pPayload = pPayload;
+    vItems[0].nPayload = nPayload;
     
-    return 0;
+    uint32_t nFound;
+    return SecureMsgScanMessages(vItems, reportToGui, nFound);
 };
 
 int SecureMsgGetLocalKey(CKeyID& ckid, CPubKey& cpkOut)
@@ -2767,60 +4001,30 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<unsigned char>& vchData)
     
     // -- has cs_smsg lock from SecureMsgReceiveData
     
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    
-    //printf("token.offset %d.\n", token.offset); // DEBUG
     int64_t bucket = token.timestamp - (token.timestamp % SMSG_BUCKET_LEN);
-    std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
     
-    //printf("bucket %d.\n", bucket);
-    //printf("bucket lld %lld.\n", bucket);
-    //printf("fileName %s.\n", fileName.c_str());
-    
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "rb")))
-    {
-        printf("Error opening file: %s\nPath %s\n", strerror(errno), fullpath.string().c_str());
-        return 1;
-    };
-    
-    errno = 0;
-    if (fseek(fp, token.offset, SEEK_SET) != 0)
-    {
-        printf("fseek, strerror: %s.\n", strerror(errno));
-        fclose(fp);
+    uint32_t nDataSize;
+    const unsigned char *pData = SecureMsgMapBucket(bucket, nDataSize);
+    if (!pData)
         return 1;
-    };
     
-    SecureMessage smsg;
-    errno = 0;
-    if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+    if (token.offset < 0
+        || (uint64_t)token.offset + SMSG_HDR_LEN > nDataSize)
     {
-        printf("fread header failed: %s\n", strerror(errno));
-        fclose(fp);
-        return 1;
-    };
-    
-    try {
-        vchData.resize(SMSG_HDR_LEN + smsg.nPayload);
-    } catch (std::exception& e) {
-        printf("SecureMsgRetrieve(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + smsg.nPayload, e.what());
+        printf("SecureMsgRetrieve(): offset %ld is past the end of bucket %" PRId64 ".\n", token.offset, bucket);
         return 1;
     };
     
-    memcpy(&vchData[0], &smsg.hash[0], SMSG_HDR_LEN);
-    errno = 0;
-    if (fread(&vchData[SMSG_HDR_LEN], sizeof(unsigned char), smsg.nPayload, fp) != smsg.nPayload)
+    const unsigned char *pHeader = pData + token.offset;
+    uint32_t nPayload;
+    memcpy(&nPayload, pHeader + SMSG_HDR_LEN - 4, 4);
+    if ((uint64_t)token.offset + SMSG_HDR_LEN + nPayload > nDataSize)
     {
-        printf("fread data failed: %s. Wanted %u bytes.\n", strerror(errno), smsg.nPayload);
-        fclose(fp);
+        printf("SecureMsgRetrieve(): message at %ld overruns bucket %" PRId64 ".\n", token.offset, bucket);
         return 1;
     };
     
-    
-    fclose(fp);
+    vchData.assign(pHeader, pHeader + SMSG_HDR_LEN + nPayload);
     
     return 0;
 };
@@ -2876,6 +4080,7 @@ int SecureMsgReceive(CNode* pfrom, std::vector<unsigned char>& vchData)
     };
     
     uint32_t n = 12;
+    std::vector<SecMsgScanItem> vScan;
     
     for (uint32_t i = 0; i < nBunch; ++i)
     {
@@ -2908,14 +4113,22 @@ int SecureMsgReceive(CNode* pfrom, std::vector<unsigned char>& vchData)
             break; // continue?
         };
         
-        if (SecureMsgScanMessage(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload, true) != 0)
-        {
-            // message recipient is not this node (or failed)
-        };
+        SecMsgScanItem item;
+        item.pHeader = &vchData[n];
+        item.pPayload = &vchData[n + SMSG_HDR_LEN];
+        item.nPayload = psmsg->nPayload;
+        vScan.push_back(item);
         
         n += SMSG_HDR_LEN + psmsg->nPayload;
     };
     
+    // -- try the whole bunch against the receive addresses at once
+    uint32_t nFound;
+    if (SecureMsgScanMessages(vScan, true, nFound) != 0)
+    {
+        // message recipient is not this node (or failed)
+    };
+    
     // -- if messages have been added, bucket must exist now
     itb = smsgBuckets.find(bktTime);
     if (itb == smsgBuckets.end())
@@ -3078,25 +4291,31 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
         std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
         fs::path fullpath = pathSmsgDir / fileName;
         
-        FILE *fp;
-        errno = 0;
-        if (!(fp = fopen(fullpath.string().c_str(), "ab")))
+        // -- the mapping would go stale, and can't be open while writing on windows
+        SecureMsgCloseBucket(bucket);
+        
+        // -- the message goes after the last indexed one, anything past it is
+        //    dropped when the index is rebuilt
+        uint32_t nDataSize = 0;
+        if (fs::exists(fullpath)
+            && !SecureMsgReadIndex(bucket, nDataSize, NULL))
         {
-            printf("Error opening file: %s\n", strerror(errno));
-            return 1;
+            std::set<SecMsgToken> setScanned;
+            if (!SecureMsgIndexBucketFile(bucket, nDataSize, setScanned))
+            {
+                printf("Error: could not reindex bucket file %s\n", fileName.c_str());
+                return 1;
+            };
         };
         
-        // -- on windows ftell will always return 0 after fopen(ab), call fseek to set.
+        FILE *fp;
         errno = 0;
-        if (fseek(fp, 0, SEEK_END) != 0)
+        if (!(fp = fopen(fullpath.string().c_str(), "ab")))
         {
-            printf("Error fseek failed: %s\n", strerror(errno));
+            printf("Error opening file: %s\n", strerror(errno));
             return 1;
         };
         
-        
-        ofs = ftell(fp);
-        
         if (fwrite(pHeader, sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN
             || fwrite(pPayload, sizeof(unsigned char), nPayload, fp) != nPayload)
         {
@@ -3105,13 +4324,22 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
             return 1;
         };
         
-        fclose(fp);
-        
+        ofs = nDataSize;
         token.offset = ofs;
         
         //printf("token.offset: %d\n", token.offset); // DEBUG
         tokenSet.insert(token);
         
+        fclose(fp);
+        
+        // -- a new bucket file starts a new index
+        if ((nDataSize == 0 && !SecureMsgWriteIndex(bucket, 0, std::set<SecMsgToken>()))
+            || !SecureMsgAppendIndex(bucket, token, SMSG_HDR_LEN + nPayload))
+        {
+            // -- rebuilt from the messages on the next store or restart
+            printf("Error: could not index bucket %" PRId64 ".\n", bucket);
+        };
+        
         if (fUpdateBucket)
             smsgBuckets[bucket].hashBucket();
     };
@@ -3195,6 +4423,171 @@ int SecureMsgValidate(unsigned char *pHeader, unsigned char *pPayload, uint32_t
     return rv;
 };
 
+// -- HMAC-SHA256 of a message keyed by its nonse, as checked by
+//    SecureMsgValidate, using the SHA256 primitives directly.
+//    The key fills the first block of both hashes, so no midstate carries over
+//    from one nonse to the next. What is saved is setting up an HMAC_CTX and
+//    its EVP digests on every try: the pads and the header copy are built once
+//    and only the nonse bytes are rewritten.
+class SecMsgPowHasher
+{
+public:
+    SecMsgPowHasher()
+    {
+        // -- the key is 32 bytes, the rest of each pad block is constant
+        memset(ipad + 32, 0x36, 32);
+        memset(opad + 32, 0x5c, 32);
+        pPayload = NULL;
+        nPayload = 0;
+    };
+    
+    void Set(const unsigned char *pHeaderIn, const unsigned char *pPayloadIn, uint32_t nPayloadIn)
+    {
+        memcpy(header, pHeaderIn + 4, SMSG_HDR_LEN - 4);
+        pPayload = pPayloadIn;
+        nPayload = nPayloadIn;
+    };
+    
+    void Hash(uint32_t nonse, unsigned char *sha256Hash)
+    {
+        unsigned char civ[4];
+        memcpy(civ, &nonse, 4);
+        for (int i = 0; i < 32; ++i)
+        {
+            ipad[i] = civ[i & 3] ^ 0x36;
+            opad[i] = civ[i & 3] ^ 0x5c;
+        };
+        
+        // -- nonse is the 4 bytes before nPayload, at the end of the header
+        memcpy(&header[SMSG_HDR_LEN - 4 - 8], &nonse, 4);
+        
+        unsigned char inner[32];
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, ipad, 64);
+        SHA256_Update(&ctx, header, SMSG_HDR_LEN - 4);
+        SHA256_Update(&ctx, pPayload, nPayload);
+        SHA256_Update(&ctx, pPayload, nPayload);
+        SHA256_Final(inner, &ctx);
+        
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, opad, 64);
+        SHA256_Update(&ctx, inner, 32);
+        SHA256_Final(sha256Hash, &ctx);
+    };
+    
+private:
+    unsigned char header[SMSG_HDR_LEN - 4];
+    const unsigned char* pPayload;
+    uint32_t nPayload;
+    unsigned char ipad[64];
+    unsigned char opad[64];
+};
+
+static inline bool SecureMsgPowMeetsTarget(const unsigned char *sha256Hash)
+{
+    return sha256Hash[31] == 0
+        && sha256Hash[30] == 0
+        && (~(sha256Hash[29]) & ((1<<0) || (1<<1) || (1<<2)) );
+};
+
+static CCriticalSection cs_smsgPow;
+
+static void SecureMsgPowWorker(std::vector<SecMsgPowJob> *pvJobs, size_t nJob)
+{
+    // -- Claim ranges of nonses round robin from the unsolved messages,
+    //    so all messages in the batch progress together.
+    std::vector<SecMsgPowJob>& vJobs = *pvJobs;
+    SecMsgPowHasher hasher;
+    unsigned char sha256Hash[32];
+    
+    while (fSecMsgenabled)
+    {
+        SecMsgPowJob* pjob = NULL;
+        uint64_t nStart, nEnd;
+        {
+            LOCK(cs_smsgPow);
+            for (size_t k = 0; k < vJobs.size(); ++k)
+            {
+                SecMsgPowJob& job = vJobs[(nJob + k) % vJobs.size()];
+                if (job.rv != -1 || job.nNextNonse > 4294967295U)
+                    continue;
+                pjob = &job;
+                nJob = (nJob + k + 1) % vJobs.size();
+                break;
+            };
+            if (!pjob)
+                break;
+            
+            nStart = pjob->nNextNonse;
+            nEnd = std::min(nStart + SMSG_POW_CHUNK, (uint64_t)4294967296ULL);
+            pjob->nNextNonse = nEnd;
+            pjob->nActive++;
+            
+            // -- copy the header under the lock, the winner writes to it
+            hasher.Set(pjob->pHeader, pjob->pPayload, pjob->nPayload);
+        }
+        
+        bool fFound = false;
+        uint64_t n;
+        for (n = nStart; n < nEnd && fSecMsgenabled; ++n)
+        {
+            hasher.Hash((uint32_t)n, sha256Hash);
+            if (SecureMsgPowMeetsTarget(sha256Hash))
+            {
+                fFound = true;
+                break;
+            };
+        };
+        
+        LOCK(cs_smsgPow);
+        pjob->nActive--;
+        pjob->nHashes += n - nStart + (fFound ? 1 : 0);
+        if (pjob->rv != -1)
+            continue;
+        
+        if (fFound)
+        {
+            SecureMessage* psmsg = (SecureMessage*) pjob->pHeader;
+            uint32_t nonse = (uint32_t)n;
+            memcpy(&psmsg->nonse[0], &nonse, 4);
+            memcpy(psmsg->hash, sha256Hash, 4);
+            pjob->rv = 0;
+        } else
+        if (pjob->nNextNonse > 4294967295U && pjob->nActive == 0)
+        {
+            if (fDebugSmsg)
+                printf("No match %u\n", (uint32_t)(n - 1));
+            pjob->rv = 1;
+        };
+    };
+};
+
+void SecureMsgSetHashes(std::vector<SecMsgPowJob>& vJobs)
+{
+    /*  proof of work and checksum for a batch of messages
+        
+        Spreads the nonse ranges of all messages over nSmsgPowThreads threads.
+        Sets rv of each job as SecureMsgSetHash returns.
+    */
+    
+    if (vJobs.empty())
+        return;
+    
+    int nThreads = std::max(nSmsgPowThreads, 1);
+    
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; ++i)
+        threadGroup.create_thread(boost::bind(&SecureMsgPowWorker, &vJobs, i % vJobs.size()));
+    threadGroup.join_all();
+    
+    for (std::vector<SecMsgPowJob>::iterator it = vJobs.begin(); it != vJobs.end(); ++it)
+    {
+        if (it->rv == -1)
+            it->rv = 2; // -- threads only leave work unfinished on shutdown
+    };
+};
+
 int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload)
 {
     /*  proof of work and checksum
@@ -3208,104 +4601,91 @@ int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t n
         
     */
     
-    SecureMessage* psmsg = (SecureMessage*) pHeader;
-    
     int64_t nStart = GetTimeMillis();
-    unsigned char civ[32];
-    unsigned char sha256Hash[32];
-    
-    //std::vector<unsigned char> vchHash;
-    //vchHash.resize(32);
-    
-    bool found = false;
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
     
-    uint32_t nonse = 0;
-    
-    //CBigNum bnTarget(2);
-    //bnTarget = bnTarget.pow(256 - 40);
+    std::vector<SecMsgPowJob> vJobs(1);
+    vJobs[0].pHeader = pHeader;
+    vJobs[0].pPayload = pPayload;
+    vJobs[0].nPayload = nPayload;
     
-    // -- break for HMAC_CTX_cleanup
-    for (;;)
-    {
-        if (!fSecMsgenabled)
-           break;
-        
-        //psmsg->timestamp = GetTime();
-        //memcpy(&psmsg->timestamp, &now, 8);
-        memcpy(&psmsg->nonse[0], &nonse, 4);
-        
-        for (int i = 0; i < 32; i+=4)
-            memcpy(civ+i, &nonse, 4);
-        
-        unsigned int nBytes;
-        if (!HMAC_Init_ex(&ctx, &civ[0], 32, EVP_sha256(), NULL)
-            || !HMAC_Update(&ctx, (unsigned char*) pHeader+4, SMSG_HDR_LEN-4)
-            || !HMAC_Update(&ctx, (unsigned char*) pPayload, nPayload)
-            || !HMAC_Update(&ctx, pPayload, nPayload)
-            || !HMAC_Final(&ctx, sha256Hash, &nBytes)
-            //|| !HMAC_Final(&ctx, &vchHash[0], &nBytes)
-            || nBytes != 32)
-            break;
-        
-        /*
-        if (CBigNum(vchHash) <= bnTarget)
-        {
-            found = true;
-            if (fDebugSmsg)
-                printf("Match %u\n", nonse);
-            break;
-        };
-        */
-        
-        if (sha256Hash[31] == 0
-            && sha256Hash[30] == 0
-            && (~(sha256Hash[29]) & ((1<<0) || (1<<1) || (1<<2)) ))
-        //    && sha256Hash[29] == 0)
-        {
-            found = true;
-            //if (fDebugSmsg)
-            //    printf("Match %u\n", nonse);
-            break;
-        }
-        
-        //if (nonse >= UINT32_MAX)
-        if (nonse >= 4294967295U)
-        {
-            if (fDebugSmsg)
-                printf("No match %u\n", nonse);
-            break;
-            //return 1; 
-        }    
-        nonse++;
-    };
+    SecureMsgSetHashes(vJobs);
     
-    HMAC_CTX_cleanup(&ctx);
+    SecureMessage* psmsg = (SecureMessage*) pHeader;
+    uint32_t nonse;
+    memcpy(&nonse, &psmsg->nonse[0], 4);
     
-    if (!fSecMsgenabled)
+    if (vJobs[0].rv == 2)
     {
         if (fDebugSmsg)
             printf("SecureMsgSetHash() stopped, shutdown detected.\n");
         return 2;
     };
     
-    if (!found)
+    if (vJobs[0].rv != 0)
     {
         if (fDebugSmsg)
-            printf("SecureMsgSetHash() failed, took %" PRId64 " ms, nonse %u\n", GetTimeMillis() - nStart, nonse);
+            printf("SecureMsgSetHash() failed, took %" PRId64 " ms\n", GetTimeMillis() - nStart);
         return 1;
     };
     
-    memcpy(psmsg->hash, sha256Hash, 4);
-    //memcpy(psmsg->hash, &vchHash[0], 4);
-    
     if (fDebugSmsg)
         printf("SecureMsgSetHash() took %" PRId64 " ms, nonse %u\n", GetTimeMillis() - nStart, nonse);
     
     return 0;
 };
 
+static void SecureMsgBenchPowWorker(std::vector<unsigned char> *pvchMessage, int64_t nStop, uint64_t *pnHashes)
+{
+    SecMsgPowHasher hasher;
+    hasher.Set(&(*pvchMessage)[0], &(*pvchMessage)[SMSG_HDR_LEN], pvchMessage->size() - SMSG_HDR_LEN);
+    unsigned char sha256Hash[32];
+    
+    uint32_t nonse = 0;
+    while (!fShutdown)
+    {
+        for (int i = 0; i < 256; ++i)
+            hasher.Hash(nonse++, sha256Hash);
+        *pnHashes += 256;
+        
+        if (GetTimeMillis() >= nStop)
+            break;
+    };
+};
+
+double SecureMsgBenchPow(uint32_t nPayload, int nThreads, int64_t nMillis)
+{
+    /*  Hash a random message of nPayload bytes on nThreads threads for
+        nMillis milliseconds.
+        
+        returns hashes per second, over all threads
+    */
+    
+    nThreads = std::max(nThreads, 1);
+    
+    std::vector<unsigned char> vchMessage(SMSG_HDR_LEN + nPayload);
+    RAND_bytes(&vchMessage[0], vchMessage.size());
+    
+    std::vector<uint64_t> vHashes(nThreads, 0);
+    int64_t nStart = GetTimeMillis();
+    int64_t nStop = nStart + nMillis;
+    
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; ++i)
+        threadGroup.create_thread(boost::bind(&SecureMsgBenchPowWorker, &vchMessage, nStop, &vHashes[i]));
+    threadGroup.join_all();
+    
+    int64_t nElapsed = std::max(GetTimeMillis() - nStart, (int64_t)1);
+    uint64_t nHashes = 0;
+    for (int i = 0; i < nThreads; ++i)
+        nHashes += vHashes[i];
+    
+    if (fDebugSmsg)
+        printf("SecureMsgBenchPow() %u byte payload, %d threads: %" PRIu64 " hashes in %" PRId64 " ms\n",
+            nPayload, nThreads, nHashes, nElapsed);
+    
+    return (double)nHashes * 1000.0 / nElapsed;
+};
+
 int SecureMspinkcrypt(SecureMessage& smsg, std::string& addressFrom, std::string& addressTo, std::string& message)
 {
     /* Create a secure message
@@ -27,6 +27,22 @@ const unsigned int SMSG_TIME_IGNORE     = 90;                // seconds that a p
 
 const unsigned int SMSG_MAX_MSG_BYTES   = 4096;              // the user input part
 
+const unsigned int SMSG_INDEX_MAGIC     = 0x58494d53;        // "SMIX", starts the index file of a bucket
+const unsigned int SMSG_INDEX_VERSION   = 1;
+const unsigned int SMSG_INDEX_ENTRY_LEN = 8 + 8 + 4 + 4;     // timestamp, sample, offset, length
+const unsigned int SMSG_MAPPED_FILES    = 8;                 // bucket files kept mapped for retrieval
+
+const unsigned int SMSG_POW_CHUNK       = 1024;              // nonses claimed at a time by a proof of work thread
+const unsigned int SMSG_POW_MAX_BATCH   = 16;                // outbox messages worked on at once
+const unsigned int SMSG_SCAN_CHUNK      = 16;                // messages claimed at a time by a trial decryption thread
+const unsigned int SMSG_SCAN_BATCH      = 1024;              // wallet locked messages scanned at once on unlock
+const unsigned int SMSG_SCAN_CHAIN_WINDOW = 1000;            // blocks scanned for public keys between progress markers
+
+const unsigned int SMSG_SKETCH_HASHES   = 3;                 // cells each token is added to in a bucket sketch
+const unsigned int SMSG_SKETCH_CELL_LEN = 4 + 16 + 4;        // count, token sum, check sum
+const unsigned int SMSG_SKETCH_MIN_CELLS = 48;               // enough to decode a few differences
+const unsigned int SMSG_SKETCH_MAX_CELLS = 3000;             // above this buckets are sent as full token lists
+
 // max size of payload worst case compression
 const unsigned int SMSG_MAX_MSG_WORST = LZ4_COMPRESSBOUND(SMSG_MAX_MSG_BYTES+SMSG_PL_HDR_LEN);
 
@@ -34,9 +50,13 @@ const unsigned int SMSG_MAX_MSG_WORST = LZ4_COMPRESSBOUND(SMSG_MAX_MSG_BYTES+SMS
 
 #define SMSG_MASK_UNREAD            (1 << 0)
 
+#define SMSG_NODE_SKETCH            (1 << 0)    // peer reconciles buckets by sketch, sent in smsgPing and smsgPong
+
 
 
 extern bool fSecMsgenabled;
+extern int nSmsgPowThreads;
+extern int nSmsgScanThreads;
 
 class SecMsgStored;
 
@@ -106,6 +126,99 @@ public:
 };
 
 
+class SecMsgPowJob
+{
+// -- A message being worked on by the proof of work threads
+public:
+    SecMsgPowJob()
+    {
+        pHeader = NULL;
+        pPayload = NULL;
+        nPayload = 0;
+        nNextNonse = 0;
+        nActive = 0;
+        nHashes = 0;
+        rv = -1;
+    };
+    
+    unsigned char*  pHeader;
+    unsigned char*  pPayload;
+    uint32_t        nPayload;
+    
+    uint64_t        nNextNonse;     // start of the next unclaimed range
+    int             nActive;        // threads hashing a claimed range
+    uint64_t        nHashes;
+    int             rv;             // -1 while unsolved, then as SecureMsgSetHash
+};
+
+
+class SecMsgScanItem
+{
+// -- A received message to try against the receive addresses
+public:
+    unsigned char*  pHeader;
+    unsigned char*  pPayload;
+    uint32_t        nPayload;
+};
+
+class SecMsgScanStats
+{
+// -- Trial decryption counters, since startup
+public:
+    SecMsgScanStats()
+    {
+        nMessages = 0;
+        nTrials = 0;
+        nMatches = 0;
+        nDecrypts = 0;
+        nFound = 0;
+        nMillis = 0;
+    };
+    
+    uint64_t    nMessages;
+    uint64_t    nTrials;        // ECDH and MAC checks, one per message and address
+    uint64_t    nMatches;       // MAC matches
+    uint64_t    nDecrypts;      // full decrypts, to check the sender
+    uint64_t    nFound;         // messages saved to the inbox
+    int64_t     nMillis;
+};
+
+
+class SecMsgScanChainStatus
+{
+// -- Progress of the background block chain scan for public keys
+public:
+    SecMsgScanChainStatus()
+    {
+        fRunning = false;
+        fFailed = false;
+        nStartHeight = 0;
+        nHeight = -1;
+        nTargetHeight = 0;
+        nBlocks = 0;
+        nTransactions = 0;
+        nInputs = 0;
+        nPubkeys = 0;
+        nDuplicates = 0;
+        nStartTime = 0;
+        nMillis = 0;
+    };
+    
+    bool        fRunning;
+    bool        fFailed;
+    int         nStartHeight;
+    int         nHeight;            // scanned up to and including
+    int         nTargetHeight;      // best height when the last window was taken
+    uint64_t    nBlocks;
+    uint64_t    nTransactions;
+    uint64_t    nInputs;
+    uint64_t    nPubkeys;
+    uint64_t    nDuplicates;
+    int64_t     nStartTime;
+    int64_t     nMillis;
+};
+
+
 class SecMsgToken
 {
 public:
@@ -139,6 +252,47 @@ public:
 };
 
 
+class SecMsgSketchCell
+{
+public:
+    SecMsgSketchCell()
+    {
+        nCount = 0;
+        memset(key, 0, 16);
+        nCheck = 0;
+    };
+    
+    bool IsEmpty() const;
+    
+    int32_t                     nCount;
+    unsigned char               key[16];      // xor of token timestamp and sample
+    uint32_t                    nCheck;       // xor of token key hashes
+};
+
+class SecMsgSketch
+{
+// -- Invertible bloom lookup table over the tokens of a bucket.
+//    Subtracting a peer's sketch from this node's leaves only the tokens
+//    held by one of the two, which Decode() lists while there are few enough.
+public:
+    SecMsgSketch(uint32_t nCellsIn);
+    
+    void Insert(const SecMsgToken& token);
+    void Subtract(const SecMsgSketch& other);
+    bool Decode(std::vector<SecMsgToken>& vOurs, std::vector<SecMsgToken>& vTheirs);
+    
+    void Write(std::vector<unsigned char>& vch) const;
+    bool Read(const unsigned char* p, uint32_t nBytes);
+    
+    static uint32_t CellsFor(uint32_t nDifferences);
+    
+    std::vector<SecMsgSketchCell> vCells;
+    
+private:
+    void Toggle(const unsigned char* key, int32_t nDelta);
+};
+
+
 class SecMsgBucket
 {
 public:
@@ -305,6 +459,9 @@ public:
     bool WritePK(CKeyID& addr, CPubKey& pubkey);
     bool ExistsPK(CKeyID& addr);
     
+    bool ReadScanHeight(int& nHeight);
+    bool WriteScanHeight(int nHeight);
+    
     bool NextSmesg(leveldb::Iterator* it, std::string& prefix, unsigned char* vchKey, SecMsgStored& smsgStored);
     bool NextSmesgKey(leveldb::Iterator* it, std::string& prefix, unsigned char* vchKey);
     bool ReadSmesg(unsigned char* chKey, SecMsgStored& smsgStored);
@@ -338,8 +495,10 @@ bool SecureMsgSendData(CNode* pto, bool fSendTrickle);
 
 
 bool SecureMsgScanBlock(CBlock& block);
-bool ScanChainForPublicKeys(CBlockIndex* pindexStart);
-bool SecureMsgScanBlockChain();
+bool ScanChainForPublicKeys(int nStartHeight);
+bool SecureMsgScanBlockChain(bool fRescan);
+void SecureMsgStopScanBlockChain(bool fWait = false);
+void SecureMsgGetScanChainStatus(SecMsgScanChainStatus& status);
 bool SecureMsgScanBuckets();
 
 
@@ -347,6 +506,8 @@ int SecureMsgWalletUnlocked();
 int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode);
 
 int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, bool reportToGui);
+int SecureMsgScanMessages(std::vector<SecMsgScanItem>& vItems, bool reportToGui, uint32_t& nFound);
+void SecureMsgGetScanStats(SecMsgScanStats& stats);
 
 int SecureMsgGetStoredKey(CKeyID& ckid, CPubKey& cpkOut);
 int SecureMsgGetLocalKey(CKeyID& ckid, CPubKey& cpkOut);
@@ -355,6 +516,8 @@ int SecureMsgGetLocalPublicKey(std::string& strAddress, std::string& strPublicKe
 int SecureMsgAddAddress(std::string& address, std::string& publicKey);
 
 int SecureMsgRetrieve(SecMsgToken &token, std::vector<unsigned char>& vchData);
+void SecureMsgCloseBucket(int64_t bucket);
+void SecureMsgRemoveIndex(int64_t bucket);
 
 int SecureMsgReceive(CNode* pfrom, std::vector<unsigned char>& vchData);
 
@@ -368,6 +531,8 @@ int SecureMsgSend(std::string& addressFrom, std::string& addressTo, std::string&
 
 int SecureMsgValidate(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload);
 int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload);
+void SecureMsgSetHashes(std::vector<SecMsgPowJob>& vJobs);
+double SecureMsgBenchPow(uint32_t nPayload, int nThreads, int64_t nMillis);
 
 int SecureMspinkcrypt(SecureMessage& smsg, std::string& addressFrom, std::string& addressTo, std::string& message);
 
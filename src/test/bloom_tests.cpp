@@ -0,0 +1,46 @@
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+#include "bloom.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // Every one of the last nElements/2 entries must be found, and
+    // random hashes only rarely
+    CRollingBloomFilter rb(100, 0.01);
+    vector<uint256> vData;
+    for (int i = 0; i < 1000; i++)
+    {
+        vData.push_back(GetRandHash());
+        rb.insert(vData.back());
+    }
+    for (int i = 1000 - 50; i < 1000; i++)
+        BOOST_CHECK(rb.contains(vData[i]));
+
+    int nHits = 0;
+    for (int i = 0; i < 10000; i++)
+        if (rb.contains(GetRandHash()))
+            nHits++;
+    // Expect around 1% false positives
+    BOOST_CHECK(nHits < 300);
+
+    // Entries older than three generations are forgotten
+    int nOld = 0;
+    for (int i = 0; i < 100; i++)
+        if (rb.contains(vData[i]))
+            nOld++;
+    BOOST_CHECK(nOld < 10);
+
+    rb.reset();
+    int nAfterReset = 0;
+    for (int i = 0; i < 1000; i++)
+        if (rb.contains(vData[i]))
+            nAfterReset++;
+    BOOST_CHECK(nAfterReset == 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,65 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+using namespace std;
+
+#include "checkqueue.h"
+
+#define NUM_WORKERS 3
+#define NUM_CHECKS 1000
+
+class CFakeCheck
+{
+private:
+    bool fOk;
+
+public:
+    CFakeCheck() : fOk(true) {}
+    CFakeCheck(bool fOkIn) : fOk(fOkIn) {}
+
+    bool operator()() const { return fOk; }
+    void swap(CFakeCheck &check) { std::swap(fOk, check.fOk); }
+};
+
+static void RunChecks(CCheckQueue<CFakeCheck> &queue, int nBad, bool fExpected)
+{
+    CCheckQueueControl<CFakeCheck> control(&queue);
+    for (int i = 0; i < NUM_CHECKS; i += 100)
+    {
+        std::vector<CFakeCheck> vChecks;
+        for (int j = i; j < i + 100; j++)
+            vChecks.push_back(CFakeCheck(j != nBad));
+        control.Add(vChecks);
+    }
+    BOOST_CHECK(control.Wait() == fExpected);
+}
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_results)
+{
+    CCheckQueue<CFakeCheck> queue(16);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < NUM_WORKERS; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CFakeCheck>::Thread, &queue));
+
+    // The queue must be reusable after both a passing and a failing batch
+    RunChecks(queue, -1, true);
+    RunChecks(queue, NUM_CHECKS / 2, false);
+    RunChecks(queue, -1, true);
+    RunChecks(queue, NUM_CHECKS - 1, false);
+
+    queue.Quit();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_nothreads)
+{
+    // Without any workers the master thread does all the checks itself
+    CCheckQueue<CFakeCheck> queue(16);
+    RunChecks(queue, -1, true);
+    RunChecks(queue, 0, false);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,73 @@
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+#include "smessage.h"
+
+// Spread out, repeatable tokens so the sketches decode the same on every run
+static SecMsgToken TestToken(int64_t nTime, uint64_t n)
+{
+    uint64_t sample = (n + 1) * 0x9E3779B97F4A7C15ULL;
+    return SecMsgToken(nTime + n % SMSG_BUCKET_LEN, (unsigned char*)&sample, 8, 0);
+}
+
+BOOST_AUTO_TEST_SUITE(smessage_tests)
+
+BOOST_AUTO_TEST_CASE(sketch_reconcile)
+{
+    // Sketches of two buckets sharing most tokens decode to just the differences
+    int64_t nTime = 1400000000;
+    vector<SecMsgToken> vShared, vOurs, vTheirs;
+    for (int i = 0; i < 500; i++)
+        vShared.push_back(TestToken(nTime, i));
+    for (int i = 500; i < 505; i++)
+        vOurs.push_back(TestToken(nTime, i));
+    for (int i = 505; i < 508; i++)
+        vTheirs.push_back(TestToken(nTime, i));
+
+    uint32_t nCells = SecMsgSketch::CellsFor(vOurs.size() + vTheirs.size());
+    SecMsgSketch sketch(nCells), sketchPeer(nCells);
+    for (unsigned int i = 0; i < vShared.size(); i++)
+    {
+        sketch.Insert(vShared[i]);
+        sketchPeer.Insert(vShared[i]);
+    }
+    for (unsigned int i = 0; i < vOurs.size(); i++)
+        sketch.Insert(vOurs[i]);
+    for (unsigned int i = 0; i < vTheirs.size(); i++)
+        sketchPeer.Insert(vTheirs[i]);
+
+    // Round trip the peer's sketch through its wire format
+    vector<unsigned char> vch;
+    sketchPeer.Write(vch);
+    BOOST_CHECK(vch.size() == nCells * SMSG_SKETCH_CELL_LEN);
+    SecMsgSketch sketchRead(nCells);
+    BOOST_CHECK(sketchRead.Read(&vch[0], vch.size()));
+
+    sketch.Subtract(sketchRead);
+    vector<SecMsgToken> vDecodedOurs, vDecodedTheirs;
+    BOOST_CHECK(sketch.Decode(vDecodedOurs, vDecodedTheirs));
+
+    set<SecMsgToken> setOurs(vOurs.begin(), vOurs.end());
+    set<SecMsgToken> setTheirs(vTheirs.begin(), vTheirs.end());
+    BOOST_CHECK(vDecodedOurs.size() == vOurs.size());
+    BOOST_CHECK(vDecodedTheirs.size() == vTheirs.size());
+    for (unsigned int i = 0; i < vDecodedOurs.size(); i++)
+        BOOST_CHECK(setOurs.count(vDecodedOurs[i]));
+    for (unsigned int i = 0; i < vDecodedTheirs.size(); i++)
+        BOOST_CHECK(setTheirs.count(vDecodedTheirs[i]));
+}
+
+BOOST_AUTO_TEST_CASE(sketch_overflow)
+{
+    // Far more differences than cells can't be decoded
+    int64_t nTime = 1400000000;
+    SecMsgSketch sketch(SMSG_SKETCH_MIN_CELLS);
+    for (int i = 0; i < 200; i++)
+        sketch.Insert(TestToken(nTime, i));
+
+    vector<SecMsgToken> vOurs, vTheirs;
+    BOOST_CHECK(!sketch.Decode(vOurs, vTheirs));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,9 @@
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/thread.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -25,10 +28,27 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Write-back cache for committed batches during the initial block download,
+// so leveldb sees one large write every few hundred blocks instead of one per block
+static CCriticalSection cs_writeCache;
+static TxDBWriteMap mapWriteCache;
+static int64_t nWriteCacheBytes = 0;
+static int64_t nWriteCacheMax = 0;
+static int64_t nLastWriteCacheFlush = 0;
+static bool fWriteCacheFlushed = false; // since the coins cache was last flushed
+
+// Rough per-entry overhead of std::map and std::string, for sizing the write cache
+static const int64_t WRITE_CACHE_ENTRY_OVERHEAD = 96;
+
+// Flush the write cache at least this often (in seconds) so a crash loses little work
+static const int64_t WRITE_CACHE_FLUSH_INTERVAL = 300;
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
-    int nCacheSizeMB = GetArg("-dbcache", 100);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    // -dbcache is split between leveldb's read cache and our write cache
+    int64_t nCacheSize = GetArg("-dbcache", 100) * 1048576;
+    nWriteCacheMax = nCacheSize / 2;
+    options.block_cache = leveldb::NewLRUCache(nCacheSize - nWriteCacheMax);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
     return options;
 }
@@ -135,16 +155,21 @@ void CTxDB::Close()
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
-    activeBatch = new leveldb::WriteBatch();
+    activeBatch = new TxDBWriteMap();
     return true;
 }
 
-bool CTxDB::TxnCommit()
+static bool WriteToDB(leveldb::DB *pdb, const TxDBWriteMap& writes)
 {
-    assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
-    delete activeBatch;
-    activeBatch = NULL;
+    leveldb::WriteBatch batch;
+    for (TxDBWriteMap::const_iterator it = writes.begin(); it != writes.end(); ++it)
+    {
+        if ((*it).second.first)
+            batch.Delete((*it).first);
+        else
+            batch.Put((*it).first, (*it).second.second);
+    }
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
     if (!status.ok()) {
         printf("LevelDB batch commit failure: %s\n", status.ToString().c_str());
         return false;
@@ -152,48 +177,146 @@ bool CTxDB::TxnCommit()
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
+static bool FlushWriteCache(leveldb::DB *pdb)
+{
+    AssertLockHeld(cs_writeCache);
+    nLastWriteCacheFlush = GetTime();
+    if (mapWriteCache.empty())
+        return true;
+    if (fDebug)
+        printf("FlushWriteCache() : writing %" PRIszu " entries, %" PRId64 " bytes\n", mapWriteCache.size(), nWriteCacheBytes);
+    if (!WriteToDB(pdb, mapWriteCache))
+        return false;
+    mapWriteCache.clear();
+    nWriteCacheBytes = 0;
+    fWriteCacheFlushed = true;
+    return true;
+}
+
+static void AddToWriteCache(TxDBWriteMap& writes)
+{
+    AssertLockHeld(cs_writeCache);
+    if (mapWriteCache.empty())
+        nLastWriteCacheFlush = GetTime();
+    for (TxDBWriteMap::iterator it = writes.begin(); it != writes.end(); ++it)
+    {
+        TxDBWriteMap::iterator mi = mapWriteCache.find((*it).first);
+        if (mi == mapWriteCache.end())
+        {
+            mi = mapWriteCache.insert(make_pair((*it).first, make_pair(false, string()))).first;
+            nWriteCacheBytes += (*it).first.size() + WRITE_CACHE_ENTRY_OVERHEAD;
         }
+        nWriteCacheBytes += (int64_t)(*it).second.second.size() - (int64_t)(*mi).second.second.size();
+        (*mi).second.first = (*it).second.first;
+        (*mi).second.second.swap((*it).second.second);
     }
+}
+
+static void CommitCoinsBatch(std::map<uint256, CCoins>& mapCoinsBatch);
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
+bool CTxDB::TxnCommit()
+{
+    assert(activeBatch);
+    bool fOk;
+    {
+        LOCK(cs_writeCache);
+        if (nWriteCacheMax > 0 && IsInitialBlockDownload())
+        {
+            // Hold the batch back; flushing the whole cache at once keeps the db consistent
+            AddToWriteCache(*activeBatch);
+            fOk = nWriteCacheBytes < nWriteCacheMax || FlushWriteCache(pdb);
+        }
+        else if (!mapWriteCache.empty())
+        {
+            AddToWriteCache(*activeBatch);
+            fOk = FlushWriteCache(pdb);
         }
+        else
+            fOk = WriteToDB(pdb, *activeBatch);
     }
-};
+    delete activeBatch;
+    activeBatch = NULL;
+    if (!fOk) {
+        mapCoinsBatch.clear();
+        return false;
+    }
+    if (!mapCoinsBatch.empty())
+        CommitCoinsBatch(mapCoinsBatch);
+    return true;
+}
 
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. Batches held in
+// the write-back cache come next, as leveldb doesn't have them yet.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
+    TxDBWriteMap::const_iterator mi;
+    if (activeBatch && (mi = activeBatch->find(key.str())) != activeBatch->end())
+    {
+        *deleted = (*mi).second.first;
+        if (!*deleted)
+            *value = (*mi).second.second;
+        return true;
+    }
+
+    LOCK(cs_writeCache);
+    if (mapWriteCache.empty() || (mi = mapWriteCache.find(key.str())) == mapWriteCache.end())
+        return false;
+    *deleted = (*mi).second.first;
+    if (!*deleted)
+        *value = (*mi).second.second;
+    return true;
+}
+
+bool CTxDB::PutBatch(const CDataStream &key, const string *value)
+{
+    if (activeBatch) {
+        (*activeBatch)[key.str()] = value ? make_pair(false, *value) : make_pair(true, string());
+        return true;
+    }
+
+    {
+        // A direct write must not be overtaken by an older cached one at the next flush
+        LOCK(cs_writeCache);
+        TxDBWriteMap::iterator mi = mapWriteCache.find(key.str());
+        if (mi != mapWriteCache.end())
+        {
+            nWriteCacheBytes -= (*mi).first.size() + (*mi).second.second.size() + WRITE_CACHE_ENTRY_OVERHEAD;
+            mapWriteCache.erase(mi);
+        }
+    }
+
+    leveldb::Status status = value ? pdb->Put(leveldb::WriteOptions(), key.str(), *value)
+                                   : pdb->Delete(leveldb::WriteOptions(), key.str());
+    if (!status.ok() && !(value == NULL && status.IsNotFound())) {
+        printf("LevelDB write failure: %s\n", status.ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool FlushTxDBCache()
+{
+    if (!txdb)
+        return true;
+    LOCK(cs_writeCache);
+    return FlushWriteCache(txdb);
+}
+
+void ThreadFlushTxDB(void* parg)
+{
+    // Make this thread recognisable as the tx database flushing thread
+    RenameThread("pinkcoin-txdbflush");
+
+    while (!fShutdown)
+    {
+        MilliSleep(1000);
+
+        LOCK(cs_writeCache);
+        if (!mapWriteCache.empty() && GetTime() - nLastWriteCacheFlush >= WRITE_CACHE_FLUSH_INTERVAL)
+            FlushWriteCache(txdb);
     }
-    return scanner.foundEntry;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -252,6 +375,233 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+//
+// Coins database (-coinsdb)
+//
+// The unspent outputs of each transaction under a "coins" key, with a write-back
+// cache in front that is flushed every -coinsflush blocks. While the tx index
+// holds batches back, the flush waits for those to be written on their own size
+// or time trigger, so it never forces them out early. It is derived data: a
+// missing entry (or a null one in the cache) only means the caller falls back to
+// the tx index and the block files. "coinsbest" records the best chain the flushed
+// entries belong to, and the entries are dropped at startup if it doesn't match.
+//
+
+static CCriticalSection cs_coinsCache;
+static map<uint256, CCoins> mapCoinsCache;
+static set<uint256> setCoinsDirty;
+static int nCoinsCommits = 0;
+
+// Clean entries are dropped after a flush once the cache grows beyond this
+static const unsigned int MAX_COINS_CACHE_ENTRIES = 250000;
+
+static string GetCoinsKey(uint256 hash)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair(string("coins"), hash);
+    return ssKey.str();
+}
+
+bool CTxDB::ReadCoins(uint256 hash, CCoins& coins)
+{
+    coins.SetNull();
+
+    map<uint256, CCoins>::const_iterator mi = mapCoinsBatch.find(hash);
+    if (mi != mapCoinsBatch.end())
+    {
+        coins = (*mi).second;
+        return !coins.IsNull();
+    }
+
+    LOCK(cs_coinsCache);
+    mi = mapCoinsCache.find(hash);
+    if (mi != mapCoinsCache.end())
+    {
+        coins = (*mi).second;
+        return !coins.IsNull();
+    }
+
+    // Coins never go through activeBatch, so there is no need for ScanBatch
+    string strValue;
+    if (!pdb->Get(leveldb::ReadOptions(), GetCoinsKey(hash), &strValue).ok())
+        return false;
+    try {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> coins;
+    }
+    catch (std::exception &e) {
+        coins.SetNull();
+        return false;
+    }
+    mapCoinsCache[hash] = coins;
+    return !coins.IsNull();
+}
+
+bool CTxDB::WriteCoins(uint256 hash, const CCoins& coins)
+{
+    if (activeBatch)
+    {
+        mapCoinsBatch[hash] = coins;
+        return true;
+    }
+
+    LOCK(cs_coinsCache);
+    mapCoinsCache[hash] = coins;
+    setCoinsDirty.insert(hash);
+    return true;
+}
+
+bool CTxDB::UpdateCoins(const CTransaction& tx)
+{
+    if (!tx.IsCoinBase())
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            // Inputs that aren't in the coins database stay out of it
+            CCoins coins;
+            if (!ReadCoins(txin.prevout.hash, coins))
+                continue;
+            coins.Spend(txin.prevout.n);
+            if (coins.IsFullySpent())
+                coins.SetNull();
+            if (!WriteCoins(txin.prevout.hash, coins))
+                return false;
+        }
+    }
+    return WriteCoins(tx.GetHash(), CCoins(tx));
+}
+
+bool CTxDB::ForgetCoins(const CTransaction& tx)
+{
+    // Disconnecting a block: the previous outputs are read back from the
+    // restored tx index and the block files the next time they are needed
+    if (!tx.IsCoinBase())
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            if (!WriteCoins(txin.prevout.hash, CCoins()))
+                return false;
+        }
+    }
+    return WriteCoins(tx.GetHash(), CCoins());
+}
+
+bool CTxDB::CheckCoinsBestChain(uint256 hashBest)
+{
+    uint256 hashCoinsBest = 0;
+    if (Read(string("coinsbest"), hashCoinsBest) && hashCoinsBest == hashBest)
+        return true;
+
+    printf("CheckCoinsBestChain() : coins database is not at the best chain, dropping it\n");
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("coins"), uint256(0));
+    iterator->Seek(ssStartKey.str());
+    leveldb::WriteBatch batch;
+    unsigned int nErased = 0;
+    while (iterator->Valid())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "coins")
+            break;
+        batch.Delete(iterator->key());
+        if (++nErased % 10000 == 0)
+        {
+            pdb->Write(leveldb::WriteOptions(), &batch);
+            batch.Clear();
+        }
+        iterator->Next();
+    }
+    delete iterator;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << string("coinsbest");
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << hashBest;
+    batch.Put(ssKey.str(), ssValue.str());
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok())
+        return error("CheckCoinsBestChain() : %s", status.ToString().c_str());
+    return true;
+}
+
+static void CommitCoinsBatch(std::map<uint256, CCoins>& mapCoinsBatch)
+{
+    LOCK(cs_coinsCache);
+    for (map<uint256, CCoins>::iterator mi = mapCoinsBatch.begin(); mi != mapCoinsBatch.end(); ++mi)
+    {
+        mapCoinsCache[(*mi).first] = (*mi).second;
+        setCoinsDirty.insert((*mi).first);
+    }
+    mapCoinsBatch.clear();
+
+    bool fTxDBFlushed;
+    {
+        LOCK(cs_writeCache);
+        fTxDBFlushed = mapWriteCache.empty() || fWriteCacheFlushed;
+    }
+    if (++nCoinsCommits >= GetArg("-coinsflush", 100) && fTxDBFlushed)
+        FlushCoinsCache();
+}
+
+bool FlushCoinsCache()
+{
+    if (!fCoinsDB || !txdb)
+        return true;
+
+    LOCK(cs_coinsCache);
+    if (setCoinsDirty.empty())
+        return true;
+
+    // The cache holds everything committed so far, so the flushed entries are
+    // exactly the state at the best chain currently in the database. Batches held
+    // back during the initial download go first so that best chain is on disk.
+    {
+        LOCK(cs_writeCache);
+        if (!FlushWriteCache(txdb))
+            return false;
+        fWriteCacheFlushed = false;
+    }
+    uint256 hashBest;
+    if (!CTxDB("r").ReadHashBestChain(hashBest))
+        return error("FlushCoinsCache() : hashBestChain not loaded");
+
+    leveldb::WriteBatch batch;
+    BOOST_FOREACH(const uint256& hash, setCoinsDirty)
+    {
+        const CCoins& coins = mapCoinsCache[hash];
+        if (coins.IsNull())
+        {
+            batch.Delete(GetCoinsKey(hash));
+            continue;
+        }
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << coins;
+        batch.Put(GetCoinsKey(hash), ssValue.str());
+    }
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << string("coinsbest");
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << hashBest;
+    batch.Put(ssKey.str(), ssValue.str());
+
+    leveldb::Status status = txdb->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok())
+        return error("FlushCoinsCache() : %s", status.ToString().c_str());
+
+    if (fDebug)
+        printf("FlushCoinsCache() : wrote %" PRIszu " coins entries\n", setCoinsDirty.size());
+    setCoinsDirty.clear();
+    nCoinsCommits = 0;
+    if (mapCoinsCache.size() > MAX_COINS_CACHE_ENTRIES)
+        mapCoinsCache.clear();
+    return true;
+}
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
@@ -324,90 +674,15 @@ bool CTxDB::LoadBlockIndex()
         // from BDB.
         return true;
     }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
-    {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (fRequestShutdown || strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        if (pindexNew->nFlags & CBlockIndex::BLOCK_FEE_POOL)
-            pindexNew->nFeePool       = diskindex.nFeePool;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
 
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-        iterator->Next();
-    }
-    delete iterator;
+    // Use the snapshot written at the last clean shutdown if it is still
+    // current, otherwise scan the index out of LevelDB
+    if (!LoadBlockIndexSnapshot() && !LoadBlockIndexGuts())
+        return false;
 
     if (fRequestShutdown)
         return true;
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
-    }
-
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
     {
@@ -418,7 +693,11 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
 
+    if (fCoinsDB && !CheckCoinsBestChain(hashBestChain))
+        return false;
+
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -584,3 +863,414 @@ bool CTxDB::LoadBlockIndex()
 
     return true;
 }
+
+bool CTxDB::LoadBlockIndexGuts()
+{
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. Here, we scan it
+    // out of the DB and into mapBlockIndex.
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    // Seek to start key.
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("blockindex"), uint256(0));
+    iterator->Seek(ssStartKey.str());
+    // Now read each entry.
+    while (iterator->Valid())
+    {
+        // Unpack keys and values.
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        string strType;
+        ssKey >> strType;
+        // Did we reach the end of the data to read?
+        if (fRequestShutdown || strType != "blockindex")
+            break;
+        CDiskBlockIndex diskindex;
+        ssValue >> diskindex;
+
+        uint256 blockHash = diskindex.GetBlockHash();
+
+        // Construct block index object
+        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+        pindexNew->nFile          = diskindex.nFile;
+        pindexNew->nBlockPos      = diskindex.nBlockPos;
+        pindexNew->nHeight        = diskindex.nHeight;
+        pindexNew->nMint          = diskindex.nMint;
+        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+        pindexNew->nFlags         = diskindex.nFlags;
+        pindexNew->nStakeModifier = diskindex.nStakeModifier;
+        pindexNew->prevoutStake   = diskindex.prevoutStake;
+        pindexNew->nStakeTime     = diskindex.nStakeTime;
+        pindexNew->hashProof      = diskindex.hashProof;
+        pindexNew->nVersion       = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->nTime          = diskindex.nTime;
+        pindexNew->nBits          = diskindex.nBits;
+        pindexNew->nNonce         = diskindex.nNonce;
+
+        if (pindexNew->nFlags & CBlockIndex::BLOCK_FEE_POOL)
+            pindexNew->nFeePool       = diskindex.nFeePool;
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+            pindexGenesisBlock = pindexNew;
+
+        if (!pindexNew->CheckIndex()) {
+            delete iterator;
+            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+        }
+
+        // NovaCoin: build setStakeSeen
+        if (pindexNew->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+
+        iterator->Next();
+    }
+    delete iterator;
+
+    if (fRequestShutdown)
+        return true;
+
+    // Calculate nChainTrust
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        CBlockIndex* pindex = item.second;
+        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+    }
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        CBlockIndex* pindex = item.second;
+        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+    }
+
+    return true;
+}
+
+//
+// Block index snapshot
+//
+// A flat copy of mapBlockIndex written at clean shutdown, so the next start
+// doesn't have to deserialize every LevelDB record, look up every pprev/pnext
+// hash and recompute chain trust. Records are fixed size and refer to each
+// other by position, so the file can be mapped and decoded on several threads.
+// The snapshot is only used if it matches hashBestChain in the database and is
+// removed once read, so a crash can never leave a stale one behind.
+//
+
+static const char pchSnapshotMagic[8] = { 'p', 'n', 'k', 'b', 'i', 'd', 'x', 0 };
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const unsigned int SNAPSHOT_CHUNK_RECORDS = 16384;
+
+struct CBlockIndexSnapshotHeader
+{
+    char pchMagic[8];
+    uint32_t nVersion;
+    uint32_t nRecordSize;
+    uint64_t nRecords;
+    unsigned char hashBestChain[32];
+    unsigned char hashChecksum[32]; // hash of the per-chunk record hashes
+};
+
+struct CBlockIndexSnapshotRecord
+{
+    unsigned char hashBlock[32];
+    unsigned char nChainTrust[32];
+    unsigned char hashProof[32];
+    unsigned char hashMerkleRoot[32];
+    unsigned char hashPrevoutStake[32];
+    int64_t nMint;
+    int64_t nMoneySupply;
+    int64_t nFeePool;
+    uint64_t nStakeModifier;
+    int32_t nPrev; // position of pprev, -1 if none
+    int32_t nNext; // position of pnext, -1 if none
+    uint32_t nFile;
+    uint32_t nBlockPos;
+    int32_t nHeight;
+    uint32_t nFlags;
+    uint32_t nPrevoutStakeN;
+    uint32_t nStakeTime;
+    int32_t nVersion;
+    uint32_t nTime;
+    uint32_t nBits;
+    uint32_t nNonce;
+};
+
+static boost::filesystem::path GetBlockIndexSnapshotFile()
+{
+    return GetDataDir() / "blkindex.snapshot";
+}
+
+/** Decodes chunks of snapshot records into preallocated block index entries */
+class CBlockIndexSnapshotDecoder
+{
+private:
+    const CBlockIndexSnapshotRecord* pRecords;
+    uint64_t nRecords;
+    std::vector<CBlockIndex*>& vIndex;
+    std::vector<uint256>& vHash;
+    std::vector<uint256> vChunkHash;
+
+    boost::mutex mutex;
+    unsigned int nNextChunk;
+    bool fFailed;
+
+    bool Decode(unsigned int nChunk)
+    {
+        uint64_t nBegin = (uint64_t)nChunk * SNAPSHOT_CHUNK_RECORDS;
+        uint64_t nEnd = std::min(nRecords, nBegin + SNAPSHOT_CHUNK_RECORDS);
+        vChunkHash[nChunk] = Hash((const unsigned char*)&pRecords[nBegin], (const unsigned char*)&pRecords[nEnd]);
+
+        for (uint64_t i = nBegin; i < nEnd; i++)
+        {
+            const CBlockIndexSnapshotRecord& rec = pRecords[i];
+            if (rec.nPrev < -1 || rec.nPrev >= (int64_t)nRecords || rec.nNext < -1 || rec.nNext >= (int64_t)nRecords)
+                return false;
+
+            CBlockIndex* pindex = vIndex[i];
+            memcpy(&vHash[i], rec.hashBlock, 32);
+            pindex->pprev = rec.nPrev >= 0 ? vIndex[rec.nPrev] : NULL;
+            pindex->pnext = rec.nNext >= 0 ? vIndex[rec.nNext] : NULL;
+            pindex->nFile = rec.nFile;
+            pindex->nBlockPos = rec.nBlockPos;
+            memcpy(&pindex->nChainTrust, rec.nChainTrust, 32);
+            pindex->nHeight = rec.nHeight;
+            pindex->nMint = rec.nMint;
+            pindex->nMoneySupply = rec.nMoneySupply;
+            pindex->nFeePool = rec.nFeePool;
+            pindex->nFlags = rec.nFlags;
+            pindex->nStakeModifier = rec.nStakeModifier;
+            memcpy(&pindex->prevoutStake.hash, rec.hashPrevoutStake, 32);
+            pindex->prevoutStake.n = rec.nPrevoutStakeN;
+            pindex->nStakeTime = rec.nStakeTime;
+            memcpy(&pindex->hashProof, rec.hashProof, 32);
+            pindex->nVersion = rec.nVersion;
+            memcpy(&pindex->hashMerkleRoot, rec.hashMerkleRoot, 32);
+            pindex->nTime = rec.nTime;
+            pindex->nBits = rec.nBits;
+            pindex->nNonce = rec.nNonce;
+        }
+        return true;
+    }
+
+public:
+    CBlockIndexSnapshotDecoder(const CBlockIndexSnapshotRecord* pRecordsIn, uint64_t nRecordsIn,
+                               std::vector<CBlockIndex*>& vIndexIn, std::vector<uint256>& vHashIn) :
+        pRecords(pRecordsIn), nRecords(nRecordsIn), vIndex(vIndexIn), vHash(vHashIn),
+        vChunkHash((nRecordsIn + SNAPSHOT_CHUNK_RECORDS - 1) / SNAPSHOT_CHUNK_RECORDS), nNextChunk(0), fFailed(false) {}
+
+    void Loop()
+    {
+        while (true)
+        {
+            unsigned int nChunk;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (fFailed || nNextChunk >= vChunkHash.size())
+                    return;
+                nChunk = nNextChunk++;
+            }
+            if (!Decode(nChunk))
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                fFailed = true;
+                return;
+            }
+        }
+    }
+
+    bool Run()
+    {
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), (int)vChunkHash.size()));
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads - 1; i++)
+            threadGroup.create_thread(boost::bind(&CBlockIndexSnapshotDecoder::Loop, this));
+        Loop();
+        threadGroup.join_all();
+        return !fFailed;
+    }
+
+    uint256 GetChecksum() const
+    {
+        return Hash(vChunkHash.begin(), vChunkHash.end());
+    }
+};
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotFile();
+    if (!boost::filesystem::exists(pathSnapshot))
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    bool fLoaded = false;
+    try
+    {
+        uint256 hashBest;
+        if (!ReadHashBestChain(hashBest))
+            throw runtime_error("hashBestChain not loaded");
+
+        interprocess::file_mapping mapping(pathSnapshot.string().c_str(), interprocess::read_only);
+        interprocess::mapped_region region(mapping, interprocess::read_only);
+        const unsigned char* pbegin = (const unsigned char*)region.get_address();
+        size_t nSize = region.get_size();
+
+        CBlockIndexSnapshotHeader header;
+        if (nSize < sizeof(header))
+            throw runtime_error("truncated header");
+        memcpy(&header, pbegin, sizeof(header));
+        if (memcmp(header.pchMagic, pchSnapshotMagic, sizeof(pchSnapshotMagic)) != 0
+            || header.nVersion != SNAPSHOT_VERSION
+            || header.nRecordSize != sizeof(CBlockIndexSnapshotRecord))
+            throw runtime_error("unknown format");
+        if (memcmp(header.hashBestChain, &hashBest, 32) != 0)
+            throw runtime_error("best chain has moved on");
+        if (header.nRecords == 0 || header.nRecords > (uint64_t)std::numeric_limits<int32_t>::max()
+            || nSize != sizeof(header) + header.nRecords * sizeof(CBlockIndexSnapshotRecord))
+            throw runtime_error("bad size");
+
+        // Entries are allocated up front so records can link to any position
+        std::vector<CBlockIndex*> vIndex(header.nRecords);
+        std::vector<uint256> vHash(header.nRecords);
+        for (uint64_t i = 0; i < header.nRecords; i++)
+            vIndex[i] = new CBlockIndex();
+
+        CBlockIndexSnapshotDecoder decoder((const CBlockIndexSnapshotRecord*)(pbegin + sizeof(header)), header.nRecords, vIndex, vHash);
+        bool fDecoded = decoder.Run();
+        uint256 hashChecksum = decoder.GetChecksum();
+        if (!fDecoded || memcmp(header.hashChecksum, &hashChecksum, 32) != 0)
+        {
+            BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+                delete pindex;
+            throw runtime_error("checksum mismatch");
+        }
+
+        // Records are in hash order, so every insert lands at the end of the map
+        uint256 hashGenesis = (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet);
+        for (uint64_t i = 0; i < header.nRecords; i++)
+        {
+            CBlockIndex* pindex = vIndex[i];
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(mapBlockIndex.end(), make_pair(vHash[i], pindex));
+            pindex->phashBlock = &((*mi).first);
+
+            if (pindexGenesisBlock == NULL && vHash[i] == hashGenesis)
+                pindexGenesisBlock = pindex;
+
+            // NovaCoin: build setStakeSeen
+            if (pindex->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+        }
+        fLoaded = true;
+    }
+    catch (std::exception& e)
+    {
+        printf("LoadBlockIndexSnapshot() : not using %s: %s\n", pathSnapshot.string().c_str(), e.what());
+    }
+
+    boost::filesystem::remove(pathSnapshot);
+
+    if (fLoaded)
+        printf("LoadBlockIndexSnapshot() : loaded %" PRIszu " block index entries in %" PRId64 "ms\n", mapBlockIndex.size(), GetTimeMillis() - nStart);
+    return fLoaded;
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    LOCK(cs_main);
+    if (pindexBest == NULL || mapBlockIndex.empty())
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    // Positions of the entries, looked up by pointer to link pprev/pnext
+    std::vector<std::pair<const CBlockIndex*, int32_t> > vPos;
+    vPos.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vPos.push_back(make_pair(item.second, (int32_t)vPos.size()));
+    sort(vPos.begin(), vPos.end());
+
+    boost::filesystem::path pathTmp = GetDataDir() / "blkindex.snapshot.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : open %s failed", pathTmp.string().c_str());
+
+    CBlockIndexSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.pchMagic, pchSnapshotMagic, sizeof(pchSnapshotMagic));
+    header.nVersion = SNAPSHOT_VERSION;
+    header.nRecordSize = sizeof(CBlockIndexSnapshotRecord);
+    header.nRecords = mapBlockIndex.size();
+    memcpy(header.hashBestChain, &hashBestChain, 32);
+
+    bool fOk = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    std::vector<CBlockIndexSnapshotRecord> vChunk;
+    vChunk.reserve(SNAPSHOT_CHUNK_RECORDS);
+    std::vector<uint256> vChunkHash;
+    map<uint256, CBlockIndex*>::const_iterator it = mapBlockIndex.begin();
+    while (fOk && it != mapBlockIndex.end())
+    {
+        const CBlockIndex* pindex = (*it).second;
+        CBlockIndexSnapshotRecord rec;
+        memset(&rec, 0, sizeof(rec));
+
+        rec.nPrev = rec.nNext = -1;
+        if (pindex->pprev)
+            rec.nPrev = lower_bound(vPos.begin(), vPos.end(), make_pair((const CBlockIndex*)pindex->pprev, (int32_t)0))->second;
+        if (pindex->pnext)
+            rec.nNext = lower_bound(vPos.begin(), vPos.end(), make_pair((const CBlockIndex*)pindex->pnext, (int32_t)0))->second;
+
+        memcpy(rec.hashBlock, &(*it).first, 32);
+        memcpy(rec.nChainTrust, &pindex->nChainTrust, 32);
+        memcpy(rec.hashProof, &pindex->hashProof, 32);
+        memcpy(rec.hashMerkleRoot, &pindex->hashMerkleRoot, 32);
+        memcpy(rec.hashPrevoutStake, &pindex->prevoutStake.hash, 32);
+        rec.nMint = pindex->nMint;
+        rec.nMoneySupply = pindex->nMoneySupply;
+        rec.nFeePool = pindex->nFeePool;
+        rec.nStakeModifier = pindex->nStakeModifier;
+        rec.nFile = pindex->nFile;
+        rec.nBlockPos = pindex->nBlockPos;
+        rec.nHeight = pindex->nHeight;
+        rec.nFlags = pindex->nFlags;
+        rec.nPrevoutStakeN = pindex->prevoutStake.n;
+        rec.nStakeTime = pindex->nStakeTime;
+        rec.nVersion = pindex->nVersion;
+        rec.nTime = pindex->nTime;
+        rec.nBits = pindex->nBits;
+        rec.nNonce = pindex->nNonce;
+        vChunk.push_back(rec);
+
+        ++it;
+        if (vChunk.size() == SNAPSHOT_CHUNK_RECORDS || it == mapBlockIndex.end())
+        {
+            const unsigned char* pchunk = (const unsigned char*)&vChunk[0];
+            vChunkHash.push_back(Hash(pchunk, pchunk + vChunk.size() * sizeof(CBlockIndexSnapshotRecord)));
+            fOk = fwrite(&vChunk[0], sizeof(CBlockIndexSnapshotRecord), vChunk.size(), file) == vChunk.size();
+            vChunk.clear();
+        }
+    }
+
+    uint256 hashChecksum = Hash(vChunkHash.begin(), vChunkHash.end());
+    memcpy(header.hashChecksum, &hashChecksum, 32);
+    fOk = fOk && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+
+    if (!fOk || !RenameOver(pathTmp, GetBlockIndexSnapshotFile()))
+    {
+        boost::filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : write %s failed", pathTmp.string().c_str());
+    }
+
+    printf("WriteBlockIndexSnapshot() : wrote %" PRIszu " block index entries in %" PRId64 "ms\n", mapBlockIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
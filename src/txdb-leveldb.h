@@ -15,6 +15,10 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+// Pending writes by serialized key: (true, "") for an erase, (false, value) for a
+// write. A later write to the same key replaces the earlier one.
+typedef std::map<std::string, std::pair<bool, std::string> > TxDBWriteMap;
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -45,17 +49,26 @@ private:
 
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
-    leveldb::WriteBatch *activeBatch;
+    // On commit they go to leveldb, or during the initial block download to a
+    // write-back cache shared by all CTxDB instances (see TxnCommit).
+    TxDBWriteMap *activeBatch;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
 
+    // Coins changed since TxnBegin. They go to the shared coins cache on TxnCommit
+    // and are dropped on TxnAbort, so the cache never sees an aborted block.
+    std::map<uint256, CCoins> mapCoinsBatch;
+
 protected:
-    // Returns true and sets (value,false) if activeBatch contains the given key
-    // or leaves value alone and sets deleted = true if activeBatch contains a
-    // delete for it.
+    // Returns true and sets (value,false) if activeBatch or the write-back cache
+    // contains the given key or leaves value alone and sets deleted = true if
+    // they contain a delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    // Queues a write or erase in activeBatch, or applies it right away
+    bool PutBatch(const CDataStream &key, const std::string *value);
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
@@ -64,15 +77,12 @@ protected:
         ssKey << key;
         std::string strValue;
 
-        bool readFromDb = true;
-        if (activeBatch) {
-            // First we must search for it in the currently pending set of
-            // changes to the db. If not found in the batch, go on to read disk.
-            bool deleted = false;
-            readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
-            if (deleted) {
-                return false;
-            }
+        // First we must search for it in the currently pending set of
+        // changes to the db. If not found in the batch, go on to read disk.
+        bool deleted = false;
+        bool readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
+        if (deleted) {
+            return false;
         }
         if (readFromDb) {
             leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
@@ -109,17 +119,9 @@ protected:
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+        std::string strValue = ssValue.str();
 
-        if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
-        if (!status.ok()) {
-            printf("LevelDB write failure: %s\n", status.ToString().c_str());
-            return false;
-        }
-        return true;
+        return PutBatch(ssKey, &strValue);
     }
 
     template<typename K>
@@ -133,12 +135,7 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
-        return (status.ok() || status.IsNotFound());
+        return PutBatch(ssKey, NULL);
     }
 
     template<typename K>
@@ -149,11 +146,9 @@ protected:
         ssKey << key;
         std::string unused;
 
-        if (activeBatch) {
-            bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
+        bool deleted;
+        if (ScanBatch(ssKey, &unused, &deleted)) {
+            return !deleted;
         }
 
 
@@ -169,6 +164,7 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        mapCoinsBatch.clear();
         return true;
     }
 
@@ -192,6 +188,11 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadCoins(uint256 hash, CCoins& coins);
+    bool WriteCoins(uint256 hash, const CCoins& coins);
+    bool UpdateCoins(const CTransaction& tx);
+    bool ForgetCoins(const CTransaction& tx);
+    bool CheckCoinsBestChain(uint256 hashBest);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
@@ -204,7 +205,18 @@ public:
     bool LoadBlockIndex();
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockIndexSnapshot();
 };
 
+// Write the dirty entries of the coins cache to the database
+bool FlushCoinsCache();
+
+// Write the batches held back during the initial block download to the database
+bool FlushTxDBCache();
+void ThreadFlushTxDB(void* parg);
+
+// Write mapBlockIndex to a snapshot file for a faster next start (at clean shutdown)
+bool WriteBlockIndexSnapshot();
+
 
 #endif // BITCOIN_DB_H
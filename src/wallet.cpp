@@ -497,6 +497,10 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+
+        // new keys or erased transactions can change which outputs are ours
+        fWalletUnspentValid = false;
+        nWalletUpdated++;
     }
 }
 
@@ -675,6 +679,8 @@ bool CWallet::EraseFromWallet(uint256 hash)
         {
             CWalletDB(strWalletFile).EraseTx(hash);
             erasePoll(hash);
+            setWalletUnspent.erase(hash);
+            nWalletUpdated++;
         }
     }
     return true;
@@ -939,6 +945,8 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
 
 bool CWalletTx::WriteToDisk()
 {
+    // every change to a wallet transaction's spent flags ends up here
+    pwallet->UpdateWalletUnspent(*this);
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
@@ -1133,20 +1141,95 @@ void CWallet::ResendWalletTransactions(bool fForce)
 //
 
 
-int64_t CWallet::GetBalance() const
+bool CWallet::IsWalletUnspent(const CWalletTx& wtx) const
 {
-    int64_t nTotal = 0;
+    // immature mints are counted by GetImmatureBalance/GetStake/GetNewMint whether spent or not
+    if ((wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0)
+        return true;
+
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            return true;
+    return false;
+}
+
+void CWallet::EnsureWalletUnspent() const
+{
+    AssertLockHeld(cs_wallet);
+    if (fWalletUnspentValid)
+        return;
+
+    setWalletUnspent.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (IsWalletUnspent((*it).second))
+            setWalletUnspent.insert((*it).first);
+    fWalletUnspentValid = true;
+}
+
+void CWallet::UpdateWalletUnspent(const CWalletTx& wtx) const
+{
+    LOCK(cs_wallet);
+    nWalletUpdated++;
+    if (!fWalletUnspentValid)
+        return;
+
+    // wtx may be a copy, the entry in mapWallet is what the queries see
+    uint256 hash = wtx.GetHash();
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi != mapWallet.end() && IsWalletUnspent((*mi).second))
+        setWalletUnspent.insert(hash);
+    else
+        setWalletUnspent.erase(hash);
+}
+
+CWalletBalances CWallet::GetBalances() const
+{
+    LOCK2(cs_main, cs_wallet);
+    if (pindexBalancesCached == pindexBest
+        && nTransactionsUpdatedBalances == nTransactionsUpdated
+        && nWalletUpdatedBalances == nWalletUpdated)
+        return balancesCached;
+
+    CWalletBalances balances;
+    EnsureWalletUnspent();
+    BOOST_FOREACH(const uint256& hash, setWalletUnspent)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx* pcoin = &(*mi).second;
+
+        bool fTrusted = pcoin->IsTrusted();
+        if (fTrusted)
+            balances.nBalance += pcoin->GetAvailableCredit();
+        if (!pcoin->IsFinal() || (!fTrusted && pcoin->GetDepthInMainChain() == 0))
+            balances.nUnconfirmed += pcoin->GetAvailableCredit();
+        if (!pcoin->IsRecommended())
+            balances.nConfirming += pcoin->GetAvailableCredit();
+
+        // immature mints still in the main chain
+        if (pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            if (pcoin->IsCoinBase())
+            {
+                balances.nImmature += GetCredit(*pcoin);
+                balances.nNewMint += GetCredit(*pcoin);
+            }
+            else if (pcoin->IsCoinStake())
+                balances.nStake += GetCredit(*pcoin);
         }
     }
 
-    return nTotal;
+    balancesCached = balances;
+    pindexBalancesCached = pindexBest;
+    nTransactionsUpdatedBalances = nTransactionsUpdated;
+    nWalletUpdatedBalances = nWalletUpdated;
+    return balances;
+}
+
+int64_t CWallet::GetBalance() const
+{
+    return GetBalances().nBalance;
 }
 
 int64_t CWallet::GetTotalMinted() const
@@ -1174,47 +1257,17 @@ int64_t CWallet::GetTotalMinted() const
 
 int64_t CWallet::GetUnconfirmedBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nUnconfirmed;
 }
 
 int64_t CWallet::GetConfirmingBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsRecommended())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nConfirming;
 }
 
 int64_t CWallet::GetImmatureBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1224,8 +1277,12 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        EnsureWalletUnspent();
+        BOOST_FOREACH(const uint256& hash, setWalletUnspent)
         {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+            if (it == mapWallet.end())
+                continue;
             const CWalletTx* pcoin = &(*it).second;
 
             if (!pcoin->IsFinal())
@@ -1259,8 +1316,12 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        EnsureWalletUnspent();
+        BOOST_FOREACH(const uint256& hash, setWalletUnspent)
         {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+            if (it == mapWallet.end())
+                continue;
             const CWalletTx* pcoin = &(*it).second;
 
             // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
@@ -1325,28 +1386,12 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
 // ppcoin: total coins staked (non-spendable until maturity)
 int64_t CWallet::GetStake() const
 {
-    int64_t nTotal = 0;
-    LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    return GetBalances().nStake;
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
-    LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    return GetBalances().nNewMint;
 }
 
 bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
@@ -2437,6 +2482,71 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
 
 
 
+bool CWallet::GetStakeKernelInputCached(CTxDB& txdb, const CWalletTx* pcoin, unsigned int nOut, CStakeKernelInput& kernelRet)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    COutPoint prevout(pcoin->GetHash(), nOut);
+    std::map<COutPoint, CStakeKernelInput>::const_iterator mi = mapStakeKernelCache.find(prevout);
+    if (mi != mapStakeKernelCache.end())
+    {
+        kernelRet = (*mi).second;
+        return true;
+    }
+
+    CTxIndex txindex;
+    if (!txdb.ReadTxIndex(pcoin->GetHash(), txindex))
+        return false;
+
+    // Read block header
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+
+    // Fails until the chain has grown a selection interval past the coin's block;
+    // nothing is cached in that case, so the lookup is simply retried next round
+    if (!GetStakeKernelInput(block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin, prevout, kernelRet))
+        return false;
+
+    mapStakeKernelCache[prevout] = kernelRet;
+    return true;
+}
+
+void CWallet::UpdateStakeKernelCache(const CTransaction& tx, const CBlock* pblock, bool fConnect)
+{
+    LOCK(cs_wallet);
+    if (mapStakeKernelCache.empty())
+        return;
+
+    if (fConnect)
+    {
+        // Spent coins will never stake again
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            mapStakeKernelCache.erase(txin.prevout);
+        return;
+    }
+
+    // Every disconnected block passes its coinbase through here exactly once,
+    // so use it to drop entries whose stake modifier lookup walked through the block
+    if (!tx.IsCoinBase() || !pblock)
+        return;
+    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(pblock->GetHash());
+    if (mi == mapBlockIndex.end())
+    {
+        mapStakeKernelCache.clear();
+        return;
+    }
+    int nHeight = (*mi).second->nHeight;
+    for (std::map<COutPoint, CStakeKernelInput>::iterator it = mapStakeKernelCache.begin(); it != mapStakeKernelCache.end();)
+    {
+        if ((*it).second.nHeightModifierEnd >= nHeight)
+            mapStakeKernelCache.erase(it++);
+        else
+            ++it;
+    }
+}
+
 // NovaCoin: get current stake weight
 bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight)
 {
@@ -2464,10 +2574,10 @@ bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, ui
     CTxDB txdb("r");
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        CTxIndex txindex;
         {
             LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
+            CTxIndex txindex;
+            if (!mapStakeKernelCache.count(COutPoint(pcoin.first->GetHash(), pcoin.second)) && !txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
                 continue;
         }
 
@@ -2508,9 +2618,66 @@ bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, ui
     return true;
 }
 
+// Work out the coinstake output and the signing key for a kernel output;
+// only pay to public key and pay to address kernels can be staked
+static bool GetStakeKernelKey(const CKeyStore& keystore, const CScript& scriptPubKeyKernel, txnouttype& whichType, CScript& scriptPubKeyOut, CKey& key)
+{
+    vector<valtype> vSolutions;
+    scriptPubKeyOut.clear();
+    if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+    {
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : failed to parse kernel\n");
+        return false;
+    }
+    if (fDebug && GetBoolArg("-printcoinstake"))
+        printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+    if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+    {
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+        return false;  // only support pay to public key and pay to address
+    }
+    if (whichType == TX_PUBKEYHASH) // pay to address type
+    {
+        // convert to pay to public key type
+        if (!keystore.GetKey(uint160(vSolutions[0]), key))
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+            return false;  // unable to find corresponding public key
+        }
+        scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+    }
+    if (whichType == TX_PUBKEY)
+    {
+        valtype& vchPubKey = vSolutions[0];
+        if (!keystore.GetKey(Hash160(vchPubKey), key))
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+            return false;  // unable to find corresponding public key
+        }
+
+        if (key.GetPubKey() != vchPubKey)
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+            return false; // keys mismatch
+        }
+
+        scriptPubKeyOut = scriptPubKeyKernel;
+    }
+    return true;
+}
+
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, int64_t nPoolFees, CTransaction& txNew, CKey& key)
 {
-    CBlockIndex* pindexPrev = pindexBest;
+    CBlockIndex* pindexPrev;
+    {
+        LOCK(cs_main);
+        pindexPrev = pindexBest;
+    }
     CBigNum bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
 
@@ -2547,118 +2714,76 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
    // scriptD4L.SetDestination(addrD4L.Get());
     
 
+    static int nMaxStakeSearchInterval = 60;
+
+    // Gather the kernel inputs of every candidate first, so that the
+    // kernel search itself runs without the locks and without disk access
+    vector<PAIRTYPE(const CWalletTx*, unsigned int) > vCandidates;
+    vector<CStakeKernelInput> vKernels;
     CTxDB txdb("r");
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        CTxIndex txindex;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                continue;
-        }
-
-        // Read block header
-        CBlock block;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                continue;
-        }
+        if (fShutdown)
+            return false;
 
-        static int nMaxStakeSearchInterval = 60;
+        LOCK2(cs_main, cs_wallet);
+        if (pindexPrev != pindexBest)
+            return false;
+        CStakeKernelInput kernel;
+        if (!GetStakeKernelInputCached(txdb, pcoin.first, pcoin.second, kernel))
+            continue;
 
         unsigned int nStakeMinAgeCurrent = nStakeMinAge;
 
-        if (block.GetBlockTime() + nStakeMinAgeCurrent > txNew.nTime - nMaxStakeSearchInterval)
+        if (kernel.nTimeBlockFrom + nStakeMinAgeCurrent > txNew.nTime - nMaxStakeSearchInterval)
             continue; // only count coins meeting min age requirement
-        
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown && pindexPrev == pindexBest; n++)
-        {
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = 0, targetProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake, targetProofOfStake))
-            {
-                // Found a kernel
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
 
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
+        vCandidates.push_back(pcoin);
+        vKernels.push_back(kernel);
+    }
 
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
+    // Search backward in time from the given txNew timestamp
+    // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+    // A kernel we can't sign for is dropped and the search goes on with
+    // the other candidates
+    unsigned int nKernel = 0, nTimeKernel = 0;
+    txnouttype whichType;
+    CScript scriptPubKeyOut;
+    while (true)
+    {
+        if (!FindStakeKernel(pindexPrev, nBits, vKernels, txNew.nTime, min(nSearchInterval, (int64_t)nMaxStakeSearchInterval), nKernel, nTimeKernel))
+            return false;
 
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        // Found a kernel
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : kernel found\n");
+        scriptPubKeyKernel = vCandidates[nKernel].first->vout[vCandidates[nKernel].second].scriptPubKey;
+        if (GetStakeKernelKey(keystore, scriptPubKeyKernel, whichType, scriptPubKeyOut, key))
+            break;
+        vCandidates.erase(vCandidates.begin() + nKernel);
+        vKernels.erase(vKernels.begin() + nKernel);
+    }
 
-                //decide whether to split the stake into two outputs - presstab
-				uint64_t nCoinAge;
-				CTxDB txdb("r");
-				if (txNew.GetCoinAge(txdb, nCoinAge))
-				{
-             int64_t nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetProofOfStakeReward(nCoinAge, 0, nPoolFees, pindexBest->nHeight + 1, txNew.nTime);
-             if (nTotalSize > nSplitThreshold * COIN)
-						     txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-				}
+    {
+        PAIRTYPE(const CWalletTx*, unsigned int) pcoin = vCandidates[nKernel];
 
-				
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
-            }
+        txNew.nTime = nTimeKernel;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        //decide whether to split the stake into two outputs - presstab
+        uint64_t nCoinAge;
+        if (txNew.GetCoinAge(txdb, nCoinAge))
+        {
+            int64_t nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetProofOfStakeReward(nCoinAge, 0, nPoolFees, pindexBest->nHeight + 1, txNew.nTime);
+            if (nTotalSize > nSplitThreshold * COIN)
+                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
         }
 
-        if (fKernelFound || fShutdown)
-            break; // if kernel is found stop searching
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : added kernel type=%d\n", whichType);
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
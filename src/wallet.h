@@ -12,6 +12,7 @@
 
 
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -72,6 +73,33 @@ public:
     )
 };
 
+/** Wallet balances, all computed in a single pass over the wallet's unspent transactions */
+class CWalletBalances
+{
+public:
+    int64_t nBalance;
+    int64_t nUnconfirmed;
+    int64_t nConfirming;
+    int64_t nImmature;
+    int64_t nStake;
+    int64_t nNewMint;
+
+    CWalletBalances()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nBalance = 0;
+        nUnconfirmed = 0;
+        nConfirming = 0;
+        nImmature = 0;
+        nStake = 0;
+        nNewMint = 0;
+    }
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -89,6 +117,24 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Hashes of the transactions in mapWallet that still hold an unspent output of ours
+    // (or an immature mint). Balance and coin queries walk this instead of the whole history.
+    // Built lazily on first use and kept current by UpdateWalletUnspent.
+    mutable std::set<uint256> setWalletUnspent;
+    mutable bool fWalletUnspentValid;
+
+    // Bumped whenever a wallet transaction is written or erased
+    mutable unsigned int nWalletUpdated;
+
+    // Balances and the chain tip, mempool and wallet state they were computed at
+    mutable CWalletBalances balancesCached;
+    mutable const CBlockIndex* pindexBalancesCached;
+    mutable unsigned int nTransactionsUpdatedBalances;
+    mutable unsigned int nWalletUpdatedBalances;
+
+    bool IsWalletUnspent(const CWalletTx& wtx) const;
+    void EnsureWalletUnspent() const;
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -139,6 +185,11 @@ public:
         nTimeFirstKey = 0;
 		fSplitBlock =  false;
         // nStakeSplitThreshold = 1000;
+        fWalletUnspentValid = false;
+        nWalletUpdated = 1;
+        pindexBalancesCached = NULL;
+        nTransactionsUpdatedBalances = 0;
+        nWalletUpdatedBalances = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -209,6 +260,8 @@ public:
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(bool fForce = false);
+    void UpdateWalletUnspent(const CWalletTx& wtx) const;
+    CWalletBalances GetBalances() const;
     int64_t GetBalance() const;
     int64_t GetTotalMinted() const;
     int64_t GetUnconfirmedBalance() const;
@@ -220,6 +273,12 @@ public:
     bool CreateTransaction(CScript scriptPubKey, int64_t nValue, std::string& sNarr, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const CCoinControl *coinControl=NULL);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
 
+    /// Kernel inputs of staking candidates, filled in on first use and dropped when the
+    /// coin is spent or a reorganization disconnects a block they depend on (guarded by cs_wallet)
+    std::map<COutPoint, CStakeKernelInput> mapStakeKernelCache;
+    bool GetStakeKernelInputCached(CTxDB& txdb, const CWalletTx* pcoin, unsigned int nOut, CStakeKernelInput& kernelRet);
+    void UpdateStakeKernelCache(const CTransaction& tx, const CBlock* pblock, bool fConnect);
+
     bool GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, int64_t nPoolFees, CTransaction& txNew, CKey& key);
     int64_t AggregateStakeOut(CTransaction &txNew, int64_t &nReward);